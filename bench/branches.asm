@@ -0,0 +1,31 @@
+; Branch-heavy code: step x = 5x + 7 and branch on its sign and on
+; bits 13 and 11, 600 x 3000 times.
+        .ORIG x3000
+        AND R0, R0, #0
+        AND R3, R3, #0
+        LD R4, BIT13
+        LD R5, BIT11
+        LD R6, OUTERN
+OUTER   LD R7, INNERN
+STEP    ADD R1, R0, R0
+        ADD R1, R1, R1
+        ADD R0, R0, R1
+        ADD R0, R0, #7
+        BRn NEG
+        ADD R3, R3, #1
+NEG     AND R2, R0, R4
+        BRz B11
+        ADD R3, R3, #-1
+B11     AND R2, R0, R5
+        BRnp NEXT
+        ADD R3, R3, #2
+NEXT    ADD R7, R7, #-1
+        BRp STEP
+        ADD R6, R6, #-1
+        BRp OUTER
+        HALT
+BIT13   .FILL x2000
+BIT11   .FILL x0800
+OUTERN  .FILL #600
+INNERN  .FILL #3000
+        .END
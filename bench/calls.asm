@@ -0,0 +1,41 @@
+; Recursive JSR/RET call chains: fib(20), 80 times, saving
+; R0, R2 and R7 on a stack in R6.
+        .ORIG x3000
+        LD R6, STK
+        LD R5, REP
+AGAIN   AND R0, R0, #0
+        ADD R0, R0, #10
+        ADD R0, R0, #10
+        JSR FIB
+        ADD R5, R5, #-1
+        BRp AGAIN
+        ST R1, RES
+        HALT
+; FIB: R0 = n, returns R1 = fib(n)
+FIB     ADD R6, R6, #-1
+        STR R7, R6, #0
+        ADD R6, R6, #-1
+        STR R0, R6, #0
+        ADD R6, R6, #-1
+        STR R2, R6, #0
+        ADD R1, R0, #-2
+        BRn BASE
+        ADD R0, R0, #-1
+        JSR FIB
+        ADD R2, R1, #0
+        ADD R0, R0, #-1
+        JSR FIB
+        ADD R1, R1, R2
+        BRnzp DONE
+BASE    ADD R1, R0, #0
+DONE    LDR R2, R6, #0
+        ADD R6, R6, #1
+        LDR R0, R6, #0
+        ADD R6, R6, #1
+        LDR R7, R6, #0
+        ADD R6, R6, #1
+        RET
+STK     .FILL x5000
+REP     .FILL #80
+RES     .FILL #0
+        .END
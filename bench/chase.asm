@@ -0,0 +1,151 @@
+; LDI/STI pointer chasing: follow a 128-node ring, visited in a
+; scrambled order, through the pointer cell CUR (LDI loads the
+; next node, ST moves CUR there) and count the hops with LDI/STI
+; through COUNTP; 3000 x 1000 hops.
+        .ORIG x3000
+        LD R5, OUTERN
+OUTER   LD R4, INNERN
+HOP     LDI R1, CUR
+        ST R1, CUR
+        LDI R2, COUNTP
+        ADD R2, R2, #1
+        STI R2, COUNTP
+        ADD R4, R4, #-1
+        BRp HOP
+        ADD R5, R5, #-1
+        BRp OUTER
+        HALT
+OUTERN  .FILL #3000
+INNERN  .FILL #1000
+CUR     .FILL N0
+COUNTP  .FILL COUNT
+COUNT   .FILL #0
+N0      .FILL N37
+N1      .FILL N38
+N2      .FILL N39
+N3      .FILL N40
+N4      .FILL N41
+N5      .FILL N42
+N6      .FILL N43
+N7      .FILL N44
+N8      .FILL N45
+N9      .FILL N46
+N10     .FILL N47
+N11     .FILL N48
+N12     .FILL N49
+N13     .FILL N50
+N14     .FILL N51
+N15     .FILL N52
+N16     .FILL N53
+N17     .FILL N54
+N18     .FILL N55
+N19     .FILL N56
+N20     .FILL N57
+N21     .FILL N58
+N22     .FILL N59
+N23     .FILL N60
+N24     .FILL N61
+N25     .FILL N62
+N26     .FILL N63
+N27     .FILL N64
+N28     .FILL N65
+N29     .FILL N66
+N30     .FILL N67
+N31     .FILL N68
+N32     .FILL N69
+N33     .FILL N70
+N34     .FILL N71
+N35     .FILL N72
+N36     .FILL N73
+N37     .FILL N74
+N38     .FILL N75
+N39     .FILL N76
+N40     .FILL N77
+N41     .FILL N78
+N42     .FILL N79
+N43     .FILL N80
+N44     .FILL N81
+N45     .FILL N82
+N46     .FILL N83
+N47     .FILL N84
+N48     .FILL N85
+N49     .FILL N86
+N50     .FILL N87
+N51     .FILL N88
+N52     .FILL N89
+N53     .FILL N90
+N54     .FILL N91
+N55     .FILL N92
+N56     .FILL N93
+N57     .FILL N94
+N58     .FILL N95
+N59     .FILL N96
+N60     .FILL N97
+N61     .FILL N98
+N62     .FILL N99
+N63     .FILL N100
+N64     .FILL N101
+N65     .FILL N102
+N66     .FILL N103
+N67     .FILL N104
+N68     .FILL N105
+N69     .FILL N106
+N70     .FILL N107
+N71     .FILL N108
+N72     .FILL N109
+N73     .FILL N110
+N74     .FILL N111
+N75     .FILL N112
+N76     .FILL N113
+N77     .FILL N114
+N78     .FILL N115
+N79     .FILL N116
+N80     .FILL N117
+N81     .FILL N118
+N82     .FILL N119
+N83     .FILL N120
+N84     .FILL N121
+N85     .FILL N122
+N86     .FILL N123
+N87     .FILL N124
+N88     .FILL N125
+N89     .FILL N126
+N90     .FILL N127
+N91     .FILL N0
+N92     .FILL N1
+N93     .FILL N2
+N94     .FILL N3
+N95     .FILL N4
+N96     .FILL N5
+N97     .FILL N6
+N98     .FILL N7
+N99     .FILL N8
+N100    .FILL N9
+N101    .FILL N10
+N102    .FILL N11
+N103    .FILL N12
+N104    .FILL N13
+N105    .FILL N14
+N106    .FILL N15
+N107    .FILL N16
+N108    .FILL N17
+N109    .FILL N18
+N110    .FILL N19
+N111    .FILL N20
+N112    .FILL N21
+N113    .FILL N22
+N114    .FILL N23
+N115    .FILL N24
+N116    .FILL N25
+N117    .FILL N26
+N118    .FILL N27
+N119    .FILL N28
+N120    .FILL N29
+N121    .FILL N30
+N122    .FILL N31
+N123    .FILL N32
+N124    .FILL N33
+N125    .FILL N34
+N126    .FILL N35
+N127    .FILL N36
+        .END
@@ -0,0 +1,12 @@
+; Tight countdown loops: 2000 x 5000 iterations of ADD/BRp.
+        .ORIG x3000
+        LD R2, OUTERN
+OUTER   LD R1, INNERN
+INNER   ADD R1, R1, #-1
+        BRp INNER
+        ADD R2, R2, #-1
+        BRp OUTER
+        HALT
+OUTERN  .FILL #2000
+INNERN  .FILL #5000
+        .END
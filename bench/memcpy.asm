@@ -0,0 +1,20 @@
+; memcpy-style LDR/STR loop: copy 256 words, 12000 times.
+        .ORIG x3000
+        LD R5, REP
+AGAIN   LD R0, SRCP
+        LD R1, DSTP
+        LD R2, LEN
+COPY    LDR R3, R0, #0
+        STR R3, R1, #0
+        ADD R0, R0, #1
+        ADD R1, R1, #1
+        ADD R2, R2, #-1
+        BRp COPY
+        ADD R5, R5, #-1
+        BRp AGAIN
+        HALT
+REP     .FILL #12000
+LEN     .FILL #256
+SRCP    .FILL x4000
+DSTP    .FILL x4100
+        .END
@@ -0,0 +1,3572 @@
+/*
+ * lc3sim.c: the LC-3 machine, built as liblc3sim.a: creating and
+ * loading machines, the engines, the devices and the lc3sim.h
+ * interface. The simulate shell (main.c) is one client of it.
+ */
+#include "machine.h"
+
+const char *OP_NAMES[OP_COUNT] = {
+    "ADD", "ADD imm", "AND", "AND imm", "BR", "JMP", "JSR", "JSRR",
+    "LD", "LDI", "LDR", "LEA", "NOT", "ST", "STI", "STR", "TRAP", "RTI", "illegal"
+};
+
+const char *ENGINE_NAMES[ENGINE_COUNT] = { "switch", "threaded", "jit" };
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : cycle                                           */
+/*                                                             */
+/* Purpose   : Execute a cycle, recording it while tracing     */
+/*                                                             */
+/***************************************************************/
+void cycle(Machine *M) {
+    Trace_Record *R = M->TRACE != NULL ? TraceBegin(M) : NULL;
+
+    process_instruction(M);
+    M->CURRENT_LATCHES = M->NEXT_LATCHES;
+    M->INSTRUCTION_COUNT++;
+    if (R != NULL)
+        TraceEnd(M, R);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : execute                                         */
+/*                                                             */
+/* Purpose   : Execute up to budget instructions on the        */
+/*             machine's engine, stopping early when PC        */
+/*             reaches 0x0000, then write out the console      */
+/*             output. Returns the number executed.            */
+/*             With breakpoints set, RunChecked() is used      */
+/*             instead; while profiling, RunProfiled() is, and */
+/*             while tracing, timing or with a TRAP hook,      */
+/*             cycle() is, so the other engines never test for */
+/*             any of them. The engine runs up to the next     */
+/*             event at most, see ServiceEvents().             */
+/*                                                             */
+/***************************************************************/
+long long execute(Machine *M, long long budget) {
+    long long i = 0, n, chunk;
+
+    if (M->BREAKPOINTS != NULL) {
+        M->BREAKPOINTS->STOP = STOP_NONE;
+        M->BREAKPOINTS->RESUME = TRUE;
+    }
+    KeyboardResume(M);
+    while (i < budget && M->CURRENT_LATCHES.PC != 0x0000) {
+        if (M->EVENTS.DIRTY || EventDelay(M) == 0) {
+            ServiceEvents(M);
+            if (M->CURRENT_LATCHES.PC == 0x0000)     /* no handler for an interrupt */
+                break;
+        }
+        chunk = budget - i;
+        if (EventDelay(M) < chunk)
+            chunk = EventDelay(M);
+
+        if (M->BREAKPOINTS != NULL)
+            n = RunChecked(M, chunk);
+        else if (M->PROFILE != NULL)
+            n = RunProfiled(M, chunk);
+        else if (M->ENGINE == ENGINE_THREADED && M->TRACE == NULL && M->TIMING == NULL
+                 && M->HOOKS.TRAP == NULL)
+            n = RunThreaded(M, chunk);
+        else if (M->ENGINE == ENGINE_JIT && M->TRACE == NULL && M->TIMING == NULL
+                 && M->HOOKS.TRAP == NULL)
+            n = RunJit(M, chunk);
+        else {
+            for (n = 0; n < chunk && M->CURRENT_LATCHES.PC != 0x0000 && !M->EVENTS.DIRTY; n++)
+                cycle(M);
+        }
+        i += n;
+        if (M->BREAKPOINTS != NULL && M->BREAKPOINTS->STOP != STOP_NONE)
+            break;
+    }
+    KeyboardPark(M);
+    ConsoleFlush(M);
+    return i;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3_create / lc3_destroy                        */
+/*                                                             */
+/* Purpose   : Allocate and free one machine context. A new    */
+/*             one is initialized with no program. lc3_create  */
+/*             returns NULL if there is no memory for it.      */
+/*                                                             */
+/***************************************************************/
+Machine *lc3_create(int engine) {
+    Machine *M = calloc(1, sizeof(Machine));
+
+    if (M == NULL)
+        return NULL;
+    M->ENGINE = engine >= 0 && engine < ENGINE_COUNT ? engine : ENGINE_SWITCH;
+    M->RETURNS.ENABLE = TRUE;
+    M->CONSOLE.INPUT = stdin;
+    M->CONSOLE.OUTPUT = stdout;
+    M->CONSOLE.INTERACTIVE = isatty(STDIN_FILENO);
+    initialize(M, NULL, 0, FALSE);
+    return M;
+}
+
+void lc3_destroy(Machine *M) {
+    ConsoleFlush(M);
+    KeyboardStop(M);
+    if (M->CONSOLE.OWN_INPUT)
+        fclose(M->CONSOLE.INPUT);
+    JitFree(M);
+    free(M->PROFILE);
+    timing_free(M);
+    trace_free(M);
+    free(M->BREAKPOINTS);
+    free(M->RETURNS.ENTRY);
+    free(M);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : timing_free / trace_free                        */
+/*                                                             */
+/* Purpose   : Stop the timing model and the trace recorder,   */
+/*             and free them.                                  */
+/*                                                             */
+/***************************************************************/
+void timing_free(Machine *M) {
+    int level;
+
+    if (M->TIMING == NULL)
+        return;
+    for (level = 0; level < CACHE_LEVELS; level++)
+        free(M->TIMING->LEVEL[level].TAGS);
+    free(M->TIMING);
+    M->TIMING = NULL;
+}
+
+void trace_free(Machine *M) {
+    if (M->TRACE == NULL)
+        return;
+    if (M->TRACE->OUTPUT != NULL)
+        fclose(M->TRACE->OUTPUT);
+    free(M->TRACE->RING);
+    free(M->TRACE);
+    M->TRACE = NULL;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : init_memory                                     */
+/*                                                             */
+/* Purpose   : Zero out the memory array and decode cache      */
+/*                                                             */
+/***************************************************************/
+void init_memory(Machine *M) {
+    memset(M->MEMORY, 0, sizeof(M->MEMORY));
+    memset(M->DECODE_CACHE, 0, sizeof(M->DECODE_CACHE));
+    JitFlush(M);
+}
+
+/**************************************************************/
+/*                                                            */
+/* Procedure : load_hex                                       */
+/*                                                            */
+/* Purpose   : Parse a text image: the origin, then one hex   */
+/*             word per line ("3000", "x3000" or "0x3000").   */
+/*             Blank lines are skipped. Returns the number of */
+/*             words read, or -1 on a malformed line.         */
+/*                                                            */
+/**************************************************************/
+static const unsigned char HEX_DIGIT[256] = {   /* value + 1, 0 if not hex */
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6, ['6'] = 7,
+    ['7'] = 8, ['8'] = 9, ['9'] = 10, ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14,
+    ['E'] = 15, ['F'] = 16, ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15,
+    ['f'] = 16
+};
+
+int load_hex(Machine *M, const char *program_filename, const unsigned char *p, size_t size,
+             int *program_base) {
+    const unsigned char *end = p + size;
+    int line = 0, words = -1, word, digits, d;
+
+    while (p < end) {
+        line++;
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p++;
+        if (p < end && *p == '\n') {    /* blank line */
+            p++;
+            continue;
+        }
+        if (end - p > 1 && p[0] == '0' && (p[1] | 0x20) == 'x')
+            p += 2;
+        else if (p < end && (*p | 0x20) == 'x')
+            p++;
+
+        word = 0;
+        for (digits = 0; p < end && (d = HEX_DIGIT[*p]) != 0 && word <= 0xFFFF; digits++, p++)
+            word = (word << 4) | (d - 1);
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p++;
+        if (digits == 0 || word > 0xFFFF || (p < end && *p != '\n')) {
+            printf("Error: %s:%d: expected one 16-bit hex word per line\n",
+                   program_filename, line);
+            return -1;
+        }
+        p++;
+
+        if (words < 0) {                /* the first word is the origin */
+            *program_base = word;
+            words = 0;
+            continue;
+        }
+        /* Make sure it fits. */
+        if (*program_base + words >= WORDS_IN_MEM) {
+            printf("Error: Program file %s is too long to fit in memory. %x\n",
+                   program_filename, words);
+            return -1;
+        }
+        M->MEMORY[*program_base + words++] = (uint16_t)word;
+    }
+
+    if (words < 0) {
+        printf("Error: Program file is empty\n");
+        return -1;
+    }
+    return words;
+}
+
+/**************************************************************/
+/*                                                            */
+/* Procedure : load_object                                    */
+/*                                                            */
+/* Purpose   : Copy a binary image into memory: big-endian    */
+/*             origin, then big-endian words. Returns the     */
+/*             number of words read, or -1.                   */
+/*                                                            */
+/**************************************************************/
+int load_object(Machine *M, const char *program_filename, const unsigned char *data, size_t size,
+                int *program_base) {
+    int words, ii;
+
+    if (size < 2 || size % 2 != 0) {
+        printf("Error: %s: object file must hold an origin and whole 16-bit words\n",
+               program_filename);
+        return -1;
+    }
+    *program_base = (data[0] << 8) | data[1];
+    words = (int)(size / 2) - 1;
+    if (*program_base + words > WORDS_IN_MEM) {
+        printf("Error: Program file %s is too long to fit in memory. %x\n",
+               program_filename, WORDS_IN_MEM - *program_base);
+        return -1;
+    }
+
+    data += 2;
+    for (ii = 0; ii < words; ii++)
+        M->MEMORY[*program_base + ii] = (uint16_t)((data[2 * ii] << 8) | data[2 * ii + 1]);
+    return words;
+}
+
+/**************************************************************/
+/*                                                            */
+/* Procedure : load_image                                     */
+/*                                                            */
+/* Purpose   : Copy an image in data into memory, binary      */
+/*             (load_object) or hex text (load_hex), and      */
+/*             forget any decode or translation of what was   */
+/*             there. The first image sets the PC to its      */
+/*             origin. Returns the number of words read, or   */
+/*             -1.                                            */
+/*                                                            */
+/**************************************************************/
+int load_image(Machine *M, const char *name, const unsigned char *data, size_t size,
+               int object) {
+    int words, program_base = 0;
+
+    if (object)
+        words = load_object(M, name, data, size, &program_base);
+    else
+        words = load_hex(M, name, data, size, &program_base);
+    if (words < 0)
+        return -1;
+
+    /* The words are new: forget any decode of what was there */
+    memset(&M->DECODE_CACHE[program_base], 0, words * sizeof(Decoded_Instruction));
+    M->DECODE_CACHE[Low16bits(program_base - 1)].Handler = NULL;    /* may be fused */
+    JitFlush(M);
+
+    if (M->CURRENT_LATCHES.PC == 0)
+        M->CURRENT_LATCHES.PC = M->NEXT_LATCHES.PC = program_base;
+
+    return words;
+}
+
+/**************************************************************/
+/*                                                            */
+/* Procedure : load_program                                   */
+/*                                                            */
+/* Purpose   : Load program and service routines into mem.    */
+/*             Files ending in .obj are binary, anything else */
+/*             is hex text, see load_image. The file is       */
+/*             mapped rather than read.                       */
+/*             Returns the number of words read, or -1.       */
+/*                                                            */
+/**************************************************************/
+int load_program(Machine *M, const char *program_filename) {
+    int fd, words;
+    size_t length = strlen(program_filename);
+    struct stat info;
+    unsigned char *image;
+
+    /* Open program file. */
+    fd = open(program_filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        printf("Error: Can't open program file %s\n", program_filename);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if (info.st_size == 0) {
+        printf("Error: Program file is empty\n");
+        close(fd);
+        return -1;
+    }
+    image = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        printf("Error: Can't map program file %s\n", program_filename);
+        return -1;
+    }
+
+    /* Read in the program. */
+    words = load_image(M, program_filename, image, info.st_size,
+                       length >= 4 && strcmp(program_filename + length - 4, ".obj") == 0);
+    munmap(image, info.st_size);
+    return words;
+}
+
+/************************************************************/
+/*                                                          */
+/* Procedure : initialize                                   */
+/*                                                          */
+/* Purpose   : Load machine language program                */
+/*             and set up initial state of the machine.     */
+/*             Returns FALSE if a file could not be loaded. */
+/*                                                          */
+/************************************************************/
+int initialize(Machine *M, char *program_filenames[], int num_prog_files, int verbose) {
+    int i, words;
+
+    init_memory(M);
+    memset(&M->CURRENT_LATCHES, 0, sizeof(System_Latches));
+    M->CURRENT_LATCHES.SAVED_SSP = SSP_START;
+    memset(&M->EVENTS, 0, sizeof(Events));
+    memset(&M->TIMER, 0, sizeof(Timer));
+    M->CONSOLE.KEY_ENABLE = FALSE;
+    M->INSTRUCTION_COUNT = 0;
+    M->RETURNS.DEPTH = 0;
+    M->RUN_BIT = FALSE;
+
+    for ( i = 0; i < num_prog_files; i++ ) {
+        words = load_program(M, program_filenames[i]);
+        if (words < 0)
+            return FALSE;
+        if (verbose)
+            printf("Read %d words from program into memory.\n\n", words);
+    }
+    M->CURRENT_LATCHES.Z = 1;
+    M->NEXT_LATCHES = M->CURRENT_LATCHES;
+
+    M->RUN_BIT = TRUE;
+    return TRUE;
+}
+
+/***************************************************************/
+/* Do not modify the above code.
+   Every procedure below works on the Machine it is passed; use
+   its fields, e.g.
+
+   M->MEMORY
+
+   M->CURRENT_LATCHES
+   M->NEXT_LATCHES
+
+   You may define your own local variables and functions.
+   You may use the functions to get at the control bits defined
+   above.
+
+   Begin your code here 	  			       */
+
+/***************************************************************/
+
+#define Low16bits(x) ((x) & 0xFFFF)
+
+void WriteMemory(Machine *M, int Addr, int Value);  /* Store and invalidate */
+
+static inline int ReadMemory(Machine *M, int Addr){     /* Load, devices included */
+    return Addr >= IO_PAGE ? ReadDevice(M, Addr) : M->MEMORY[Addr];
+}
+
+static inline void TimeData(Machine *M, int Addr, int Kind){  /* ACCESS_LOAD or ACCESS_STORE */
+    if (M->TIMING != NULL)
+        TimeAccess(M, Addr, Kind);
+}
+
+/* Stack */
+/*
+ * The R7 save stack, see Return_Stack. A matched call and return
+ * cost one store and one load on the host; only growing the stack
+ * takes a call.
+ */
+static inline int IsEmpty(Machine *M){
+    return M->RETURNS.DEPTH == 0;
+}
+
+static inline int POP(Machine *M){
+    return M->RETURNS.ENTRY[--M->RETURNS.DEPTH] & 0xFFFF;
+}
+
+static inline void PUSH(Machine *M, int R7, int Target){
+    Return_Stack *S = &M->RETURNS;
+
+    if (!S->ENABLE)
+        return;
+    if (S->DEPTH == S->CAPACITY) {
+        GrowReturns(M);
+        if (S->DEPTH == S->CAPACITY)    /* no memory for a stack: RET uses R7 */
+            return;
+    }
+    S->ENTRY[S->DEPTH++] = (uint32_t)Target << 16 | R7;
+}
+
+int GrowReturns(Machine *M){    /* FALSE if it couldn't grow */
+    Return_Stack *S = &M->RETURNS;
+    int Capacity = S->CAPACITY ? 2 * S->CAPACITY : 256;
+    uint32_t *Entry = NULL;
+
+    if (S->CAPACITY < RETURN_STACK_MAX)
+        Entry = realloc(S->ENTRY, Capacity * sizeof(uint32_t));
+    if (Entry != NULL) {
+        S->ENTRY = Entry;
+        S->CAPACITY = Capacity;
+        return TRUE;
+    }
+    if (S->CAPACITY > 0) {      /* runaway recursion or no memory: forget the oldest calls */
+        memmove(S->ENTRY, S->ENTRY + S->CAPACITY / 2, S->CAPACITY / 2 * sizeof(uint32_t));
+        S->DEPTH -= S->CAPACITY / 2;
+        if (M->TRACE != NULL)
+            M->TRACE->AVAILABLE = 0;
+    }
+    return FALSE;
+}
+
+/* End of stack */
+
+int SetCC(Machine *M, int Result);  /* Update condition code */
+int SEXT(int num, int length);  /* Sign extension */
+int ADD(Machine *M, const Decoded_Instruction *D);      /* 0001 *//* SetCC */
+int ADDI(Machine *M, const Decoded_Instruction *D);     /* 0001 *//* SetCC */
+int AND(Machine *M, const Decoded_Instruction *D);      /* 0101 *//* SetCC */
+int ANDI(Machine *M, const Decoded_Instruction *D);     /* 0101 *//* SetCC */
+int BR(Machine *M, const Decoded_Instruction *D);       /* 0000 */
+int JMP(Machine *M, const Decoded_Instruction *D);      /* 1100 */
+int JSR(Machine *M, const Decoded_Instruction *D);      /* 0100 */
+int JSRR(Machine *M, const Decoded_Instruction *D);     /* 0100 */
+int LD(Machine *M, const Decoded_Instruction *D);       /* 0010 *//* SetCC */
+int LDI(Machine *M, const Decoded_Instruction *D);      /* 1010 *//* SetCC */
+int LDR(Machine *M, const Decoded_Instruction *D);      /* 0110 *//* SetCC */
+int LEA(Machine *M, const Decoded_Instruction *D);      /* 1110 */
+int NOT(Machine *M, const Decoded_Instruction *D);      /* 1001 *//* SetCC */
+int ST(Machine *M, const Decoded_Instruction *D);       /* 0011 */
+int STI(Machine *M, const Decoded_Instruction *D);      /* 1011 */
+int STR(Machine *M, const Decoded_Instruction *D);      /* 0111 */
+int TRAP(Machine *M, const Decoded_Instruction *D);     /* 1111 */
+int RTI(Machine *M, const Decoded_Instruction *D);      /* 1000 *//* PSR */
+int ILLEGAL(Machine *M, const Decoded_Instruction *D);  /* 1101 */
+
+void process_instruction(Machine *M){
+    /*  function: process_instruction
+     *
+     *    Process one instruction at a time
+     *       -Fetch one instruction from the decode cache
+     *       -Decode (only on the first visit to this word)
+     *       -Execute
+     *       -Update M->NEXT_LATCHES
+     */
+
+    /* Fetch */
+    Decoded_Instruction *D = &M->DECODE_CACHE[M->CURRENT_LATCHES.PC];
+
+    /* Decode */
+    if (D->Handler == NULL)
+        Decode(M->MEMORY[M->CURRENT_LATCHES.PC], D);
+    if (M->TIMING != NULL)
+        TimeInstruction(M, D);
+    M->Instruction = D->Raw;
+    M->CURRENT_LATCHES.PC = Low16bits(M->CURRENT_LATCHES.PC + 1);
+
+    /* Execute */
+    D->Handler(M, D);
+
+    /* Update NEXT_LATCHES */
+    M->NEXT_LATCHES = M->CURRENT_LATCHES;
+}
+
+void Decode(int Inst, Decoded_Instruction *D){
+    /* Extract every operand field once; the handlers only read them */
+
+    D->Raw = Inst;
+    D->DR = (Inst & 0x0E00) >> 9;       /* Instruction[11:9] */
+    D->SR1 = (Inst & 0x01C0) >> 6;      /* Instruction[8:6] */
+    D->SR2 = (Inst & 0x0007);           /* Instruction[2:0] */
+    D->Imm = 0;
+
+    switch (Inst & 0xF000) {
+        case 0x1000:    /* 0001 */
+            if((Inst & 0x0020) == 0){   /* Instruction[5] = 0 */
+                D->Handler = ADD;
+                D->Op = OP_ADD;
+            }
+            else{
+                D->Handler = ADDI;
+                D->Op = OP_ADDI;
+                D->Imm = SEXT(Inst & 0x001F, 5);
+            }
+            break;
+
+        case 0x5000:    /* 0101 */
+            if((Inst & 0x0020) == 0){
+                D->Handler = AND;
+                D->Op = OP_AND;
+            }
+            else{
+                D->Handler = ANDI;
+                D->Op = OP_ANDI;
+                D->Imm = SEXT(Inst & 0x001F, 5);
+            }
+            break;
+
+        case 0x0000:    /* 0000 */
+            D->Handler = BR;
+            D->Op = OP_BR;
+            D->Imm = SEXT(Inst & 0x01FF, 9);
+            break;
+
+        case 0xC000:    /* 1100 */
+            D->Handler = JMP;
+            D->Op = OP_JMP;
+            break;
+
+        case 0x4000:    /* 0100 */
+            if((Inst & 0x0800) >> 11){  /* Instruction[11] = 1 */
+                D->Handler = JSR;
+                D->Op = OP_JSR;
+                D->Imm = SEXT(Inst & 0x07FF, 11);
+            }
+            else{   /* Instruction[11] = 0 */
+                D->Handler = JSRR;
+                D->Op = OP_JSRR;
+            }
+            break;
+
+        case 0x2000:    /* 0010 */
+            D->Handler = LD;
+            D->Op = OP_LD;
+            D->Imm = SEXT(Inst & 0x01FF, 9);
+            break;
+
+        case 0xA000:    /* 1010 */
+            D->Handler = LDI;
+            D->Op = OP_LDI;
+            D->Imm = SEXT(Inst & 0x01FF, 9);
+            break;
+
+        case 0x6000:    /* 0110 */
+            D->Handler = LDR;
+            D->Op = OP_LDR;
+            D->Imm = SEXT(Inst & 0x003F, 6);
+            break;
+
+        case 0xE000:    /* 1110 */
+            D->Handler = LEA;
+            D->Op = OP_LEA;
+            D->Imm = SEXT(Inst & 0x01FF, 9);
+            break;
+
+        case 0x9000:    /* 1001 */
+            D->Handler = NOT;
+            D->Op = OP_NOT;
+            break;
+
+        case 0x3000:    /* 0011 */
+            D->Handler = ST;
+            D->Op = OP_ST;
+            D->Imm = SEXT(Inst & 0x01FF, 9);
+            break;
+
+        case 0xB000:    /* 1011 */
+            D->Handler = STI;
+            D->Op = OP_STI;
+            D->Imm = SEXT(Inst & 0x01FF, 9);
+            break;
+
+        case 0x7000:    /* 0111 */
+            D->Handler = STR;
+            D->Op = OP_STR;
+            D->Imm = SEXT(Inst & 0x003F, 6);
+            break;
+
+        case 0xF000:    /* 1111 */
+            D->Handler = TRAP;
+            D->Op = OP_TRAP;
+            break;
+
+        case 0x8000:    /* 1000 */
+            D->Handler = RTI;
+            D->Op = OP_RTI;
+            break;
+
+        default:        /* 1101 */
+            D->Handler = ILLEGAL;
+            D->Op = OP_ILLEGAL;
+            break;
+    }
+    D->Fused = D->Op;
+}
+
+void Fuse(Machine *M, int PC, Decoded_Instruction *D){
+    /*
+     * Turn D, just decoded at PC, into a superinstruction if it and
+     * the word after it form one of the OP_FUSED_* pairs. The second
+     * instruction is decoded into its own slot, where the fused code
+     * reads it; the pair is split again by any store to either word.
+     */
+    Decoded_Instruction *E = &M->DECODE_CACHE[Low16bits(PC + 1)];
+
+    if (PC == 0xFFFF)           /* the second word would wrap to 0x0000 */
+        return;
+    if (E->Handler == NULL)
+        Decode(M->MEMORY[PC + 1], E);
+
+    switch (D->Op) {
+        case OP_ADDI:
+            if (E->Op == OP_BR && M->FAST_FORWARD && D->DR == D->SR1
+                && Low16bits(E->Imm) == 0xFFFE)     /* branches back to D */
+                D->Fused = OP_FUSED_COUNTDOWN;
+            else if (E->Op == OP_BR)
+                D->Fused = OP_FUSED_ADDI_BR;
+            break;
+        case OP_ANDI:
+            if (D->Imm == 0 && E->Op == OP_ADDI && E->SR1 == D->DR)
+                D->Fused = OP_FUSED_CLEAR_ADDI;
+            break;
+        case OP_LDR:
+            if (E->Op == OP_ADD)
+                D->Fused = OP_FUSED_LDR_ADD;
+            else if (E->Op == OP_ADDI)
+                D->Fused = OP_FUSED_LDR_ADDI;
+            break;
+        case OP_LD:
+            if (E->Op == OP_STR)
+                D->Fused = OP_FUSED_LD_STR;
+            break;
+    }
+}
+
+static inline void StoreMemory(Machine *M, int Addr, int Value){  /* devices excluded */
+    M->MEMORY[Addr] = Value;
+    M->DECODE_CACHE[Addr].Handler = NULL;
+    M->DECODE_CACHE[Low16bits(Addr - 1)].Handler = NULL;    /* may be fused with Addr */
+    if (M->JIT_CODE[Addr])     /* translated code is now out of date */
+        M->JIT_STALE = TRUE;
+}
+
+void WriteMemory(Machine *M, int Addr, int Value){
+    /* Every store goes through here so a stale decode is never run */
+    if (Addr >= IO_PAGE && WriteDevice(M, Addr, Value))
+        return;
+    StoreMemory(M, Addr, Value);
+}
+
+
+int SetCC(Machine *M, int Result){      /* Set the condition code */
+
+    if(Result == 0){    /* Zero */
+        M->CURRENT_LATCHES.N = 0;
+        M->CURRENT_LATCHES.Z = 1;
+        M->CURRENT_LATCHES.P = 0;
+        return 0;
+    }
+
+    int Sign = Low16bits(Result) & 0x8000;  /* Sign bit */
+
+    if(Sign == 0){  /* Positive */
+        M->CURRENT_LATCHES.N = 0;
+        M->CURRENT_LATCHES.Z = 0;
+        M->CURRENT_LATCHES.P = 1;
+        return 0;
+    }
+
+    if(Sign > 0){   /* Negative */
+        M->CURRENT_LATCHES.N = 1;
+        M->CURRENT_LATCHES.Z = 0;
+        M->CURRENT_LATCHES.P = 0;
+        return 0;
+    }
+}
+
+int SEXT(int num, int length){  /* Sign extension */
+    int Sign;
+    switch (length) {
+        case 5:     /* imm5 */
+            Sign = (num & 0x0010) >> 4;
+            if(Sign)        /* Negative */
+                num += 0xFFE0;  /* Extend with 1 */
+            break;
+
+        case 6:     /* PCoffset6 */
+            Sign = (num & 0x0020) >> 5;
+            if(Sign)
+                num += 0xFFC0;
+            break;
+
+        case 9:     /* PCoffset9 */
+            Sign = (num & 0x0100) >> 8;
+            if(Sign)
+                num += 0xFE00;
+            break;
+
+        case 11:    /* PCoffset11 */
+            Sign = (num & 0x0400) >> 10;
+            if(Sign)
+                num += 0xF800;
+            break;
+
+        default:
+            break;
+    }
+    num = Low16bits(num);
+    return num;
+}
+
+int ADD(Machine *M, const Decoded_Instruction *D){      /* Instruction[5] = 0 */
+    M->CURRENT_LATCHES.REGS[D->DR]
+            = Low16bits(M->CURRENT_LATCHES.REGS[D->SR1] + M->CURRENT_LATCHES.REGS[D->SR2]);
+    SetCC(M, M->CURRENT_LATCHES.REGS[D->DR]);
+    return 0;
+}
+
+int ADDI(Machine *M, const Decoded_Instruction *D){     /* Instruction[5] = 1 */
+    M->CURRENT_LATCHES.REGS[D->DR] = Low16bits(M->CURRENT_LATCHES.REGS[D->SR1] + D->Imm);
+    SetCC(M, M->CURRENT_LATCHES.REGS[D->DR]);
+    return 0;
+}
+
+int AND(Machine *M, const Decoded_Instruction *D){      /* Instruction[5] = 0 */
+    M->CURRENT_LATCHES.REGS[D->DR]
+            = M->CURRENT_LATCHES.REGS[D->SR1] & M->CURRENT_LATCHES.REGS[D->SR2];
+    SetCC(M, M->CURRENT_LATCHES.REGS[D->DR]);
+    return 0;
+}
+
+int ANDI(Machine *M, const Decoded_Instruction *D){     /* Instruction[5] = 1 */
+    M->CURRENT_LATCHES.REGS[D->DR] = M->CURRENT_LATCHES.REGS[D->SR1] & D->Imm;
+    SetCC(M, M->CURRENT_LATCHES.REGS[D->DR]);
+    return 0;
+}
+
+int BR(Machine *M, const Decoded_Instruction *D){
+    int flag = ((D->DR >> 2) & M->CURRENT_LATCHES.N)
+            | ((D->DR >> 1) & M->CURRENT_LATCHES.Z)
+            | (D->DR & M->CURRENT_LATCHES.P);      /* Condition */
+
+    if(flag)
+        M->CURRENT_LATCHES.PC = Low16bits(M->CURRENT_LATCHES.PC + D->Imm);
+
+    return 0;
+}
+
+int JMP(Machine *M, const Decoded_Instruction *D){
+    int BaseR = D->SR1;
+    if(BaseR == 7 && !IsEmpty(M))        /* RET */
+        M->CURRENT_LATCHES.REGS[7] = POP(M);
+
+    M->CURRENT_LATCHES.PC = M->CURRENT_LATCHES.REGS[BaseR];
+    return 0;
+}
+
+int JSR(Machine *M, const Decoded_Instruction *D){
+    M->CURRENT_LATCHES.REGS[7] = M->CURRENT_LATCHES.PC;  /* Save R7 first */
+    PUSH(M, M->CURRENT_LATCHES.REGS[7], Low16bits(M->CURRENT_LATCHES.PC + D->Imm));
+
+    M->CURRENT_LATCHES.PC = Low16bits(M->CURRENT_LATCHES.PC + D->Imm);
+    return 0;
+}
+
+int JSRR(Machine *M, const Decoded_Instruction *D){
+    M->CURRENT_LATCHES.REGS[7] = M->CURRENT_LATCHES.PC;   /* Save R7 first */
+    PUSH(M, M->CURRENT_LATCHES.REGS[7], M->CURRENT_LATCHES.REGS[D->SR1]);
+
+    M->CURRENT_LATCHES.PC = M->CURRENT_LATCHES.REGS[D->SR1];
+    return 0;
+}
+
+int LD(Machine *M, const Decoded_Instruction *D){
+    int Addr = Low16bits(M->CURRENT_LATCHES.PC + D->Imm);
+    TimeData(M, Addr, ACCESS_LOAD);
+    M->CURRENT_LATCHES.REGS[D->DR] = ReadMemory(M, Addr);
+
+    SetCC(M, M->CURRENT_LATCHES.REGS[D->DR]);
+    return 0;
+}
+
+int LDI(Machine *M, const Decoded_Instruction *D){
+    int Addr = Low16bits(M->CURRENT_LATCHES.PC + D->Imm);
+    TimeData(M, Addr, ACCESS_LOAD);
+    Addr = ReadMemory(M, Addr);
+    TimeData(M, Addr, ACCESS_LOAD);
+    M->CURRENT_LATCHES.REGS[D->DR] = ReadMemory(M, Addr);
+
+    SetCC(M, M->CURRENT_LATCHES.REGS[D->DR]);
+    return 0;
+}
+
+int LDR(Machine *M, const Decoded_Instruction *D){
+    int Addr = Low16bits(M->CURRENT_LATCHES.REGS[D->SR1] + D->Imm);
+    TimeData(M, Addr, ACCESS_LOAD);
+    M->CURRENT_LATCHES.REGS[D->DR] = ReadMemory(M, Addr);
+
+    SetCC(M, M->CURRENT_LATCHES.REGS[D->DR]);
+    return 0;
+}
+
+
+int LEA(Machine *M, const Decoded_Instruction *D){
+    M->CURRENT_LATCHES.REGS[D->DR] = Low16bits(M->CURRENT_LATCHES.PC + D->Imm);
+    return 0;
+}
+
+int NOT(Machine *M, const Decoded_Instruction *D){
+    M->CURRENT_LATCHES.REGS[D->DR] = Low16bits(~ M->CURRENT_LATCHES.REGS[D->SR1]);
+
+    SetCC(M, M->CURRENT_LATCHES.REGS[D->DR]);
+    return 0;
+}
+
+int ST(Machine *M, const Decoded_Instruction *D){
+    int Addr = Low16bits(M->CURRENT_LATCHES.PC + D->Imm);
+    TimeData(M, Addr, ACCESS_STORE);
+    WriteMemory(M, Addr, M->CURRENT_LATCHES.REGS[D->DR]);
+
+    return 0;
+}
+
+int STI(Machine *M, const Decoded_Instruction *D){
+    int Addr = Low16bits(M->CURRENT_LATCHES.PC + D->Imm);
+    TimeData(M, Addr, ACCESS_LOAD);
+    Addr = ReadMemory(M, Addr);
+    TimeData(M, Addr, ACCESS_STORE);
+    WriteMemory(M, Addr, M->CURRENT_LATCHES.REGS[D->DR]);
+
+    return 0;
+}
+
+int STR(Machine *M, const Decoded_Instruction *D){
+    int Addr = Low16bits(M->CURRENT_LATCHES.REGS[D->SR1] + D->Imm);
+    TimeData(M, Addr, ACCESS_STORE);
+    WriteMemory(M, Addr, M->CURRENT_LATCHES.REGS[D->DR]);
+
+    return 0;
+}
+
+int TRAP(Machine *M, const Decoded_Instruction *D){
+    if (TrapService(M, D->Raw & 0x00FF, &M->CURRENT_LATCHES.REGS[0]))
+        M->CURRENT_LATCHES.REGS[7] = M->CURRENT_LATCHES.PC;
+    else
+        M->CURRENT_LATCHES.PC = 0x0000;    /* Halt */
+    return 0;
+}
+
+/* Trap service routines */
+/*
+ * The standard LC-3 traps are serviced here, natively, rather than by
+ * an operating system image. Like the real routines they return with
+ * R7 = the address after the TRAP; HALT, unknown vectors and reading
+ * past the end of the input halt the machine as TRAP always did.
+ */
+void ConsoleFlush(Machine *M){
+    Console *C = &M->CONSOLE;
+
+    if (C->OUTPUT != NULL && C->LENGTH > 0)
+        fwrite(C->BUFFER, 1, C->LENGTH, C->OUTPUT);
+    C->LENGTH = 0;
+}
+
+void ConsolePut(Machine *M, int Char){
+    Console *C = &M->CONSOLE;
+
+    if (C->LENGTH == CONSOLE_BUFFER_SIZE)
+        ConsoleFlush(M);
+    C->BUFFER[C->LENGTH++] = (char)Char;
+    C->WRITTEN++;
+}
+
+int ConsoleGet(Machine *M){     /* next input byte, or EOF */
+    Console *C = &M->CONSOLE;
+
+    if (C->KEYBOARD != NULL)    /* the reader has the input now */
+        return KeyboardTake(M, TRUE);
+    if (C->INPUT == NULL)
+        return EOF;
+    if (C->INTERACTIVE) {       /* show any prompt first */
+        ConsoleFlush(M);
+        fflush(C->OUTPUT != NULL ? C->OUTPUT : stdout);
+    }
+    return getc(C->INPUT);
+}
+
+int TrapService(Machine *M, int Vector, int *R0){
+    /* Returns FALSE if the machine halts */
+    const char *Prompt = "Input a character> ";
+    int Addr, Char, Handled;
+
+    if (M->HOOKS.TRAP != NULL) {        /* see lc3_set_trap_hook() */
+        ConsoleFlush(M);
+        Handled = M->HOOKS.TRAP(M->HOOKS.TRAP_CONTEXT, M, Vector);
+        if (Handled != LC3_TRAP_DEFAULT)
+            return Handled != LC3_TRAP_HALT;
+    }
+
+    switch (Vector) {
+        case 0x20:      /* GETC */
+            if ((Char = ConsoleGet(M)) == EOF)
+                return FALSE;
+            *R0 = Char & 0xFF;
+            return TRUE;
+
+        case 0x21:      /* OUT */
+            ConsolePut(M, *R0 & 0xFF);
+            return TRUE;
+
+        case 0x22:      /* PUTS: one character per word */
+            for (Addr = *R0; M->MEMORY[Addr] != 0; Addr = Low16bits(Addr + 1))
+                ConsolePut(M, M->MEMORY[Addr] & 0xFF);
+            return TRUE;
+
+        case 0x23:      /* IN: prompt, read and echo */
+            while (*Prompt)
+                ConsolePut(M, *Prompt++);
+            if ((Char = ConsoleGet(M)) == EOF)
+                return FALSE;
+            *R0 = Char & 0xFF;
+            ConsolePut(M, *R0);
+            ConsolePut(M, '\n');
+            return TRUE;
+
+        case 0x24:      /* PUTSP: two characters per word, low byte first */
+            for (Addr = *R0; M->MEMORY[Addr] != 0; Addr = Low16bits(Addr + 1)) {
+                ConsolePut(M, M->MEMORY[Addr] & 0xFF);
+                if ((M->MEMORY[Addr] >> 8) == 0)
+                    break;
+                ConsolePut(M, M->MEMORY[Addr] >> 8);
+            }
+            return TRUE;
+
+        case 0x25:      /* HALT */
+        default:
+            return FALSE;
+    }
+}
+
+/* Devices */
+/*
+ * The keyboard and display registers of the I/O page. The keyboard is
+ * fed by a reader thread, started by the first access to KBSR or KBDR,
+ * that copies the console input into a ring buffer: polling KBSR is an
+ * atomic load of the ring's HEAD, never a system call. Once it runs,
+ * GETC and IN take their input from the ring too.
+ *
+ * HEAD is written only by the reader and TAIL only by the machine, so
+ * the ring needs no lock; LOCK and CHANGED are for sleeping when it is
+ * full (reader) or empty (GETC), and for stopping the reader.
+ *
+ * The reader only runs while execute() does: KeyboardPark() stops it
+ * when execute() returns, so the shell never reads the same input at
+ * the same time, and pushes the keys the machine hasn't taken back
+ * into INPUT; the next execute() resumes it. The reader can be
+ * cancelled only inside getc(), where a read that hasn't returned has
+ * taken nothing from the input.
+ *
+ * Only a terminal gets a reader. Other input (a file, a pipe, a buffer)
+ * is read in step with the machine: a key is waiting whenever the
+ * input has one left, so the same input gives the same run every time.
+ */
+void *KeyboardReader(void *Arg){
+    Keyboard *K = Arg;
+    int Char = 0, Stop;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    while (Char != EOF) {
+        pthread_mutex_lock(&K->LOCK);
+        while (K->HEAD - __atomic_load_n(&K->TAIL, __ATOMIC_ACQUIRE) == KEYBOARD_RING_SIZE
+               && !K->STOP)
+            pthread_cond_wait(&K->CHANGED, &K->LOCK);
+        Stop = K->STOP;
+        pthread_mutex_unlock(&K->LOCK);
+        if (Stop)
+            break;
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        Char = getc(K->INPUT);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        pthread_mutex_lock(&K->LOCK);
+        if (Char == EOF)
+            K->DONE = TRUE;
+        else {
+            K->RING[K->HEAD % KEYBOARD_RING_SIZE] = (unsigned char)Char;
+            __atomic_store_n(&K->HEAD, K->HEAD + 1, __ATOMIC_RELEASE);
+        }
+        pthread_cond_broadcast(&K->CHANGED);
+        pthread_mutex_unlock(&K->LOCK);
+    }
+    return NULL;
+}
+
+void KeyboardResume(Machine *M){
+    Keyboard *K = M->CONSOLE.KEYBOARD;
+
+    if (K == NULL || K->RUNNING || K->DONE)
+        return;
+    K->STOP = FALSE;
+    if (pthread_create(&K->THREAD, NULL, KeyboardReader, K) != 0) {
+        printf("Warning: can't start keyboard thread, reading input in step instead\n\n");
+        M->CONSOLE.INTERACTIVE = FALSE;     /* see KeyWaiting() and ConsoleGet() */
+        KeyboardStop(M);
+        return;
+    }
+    K->RUNNING = TRUE;
+}
+
+void KeyboardPark(Machine *M){
+    /* Stop the reader until KeyboardResume(), keeping the ring */
+    Keyboard *K = M->CONSOLE.KEYBOARD;
+
+    if (K == NULL || !K->RUNNING)
+        return;
+    pthread_mutex_lock(&K->LOCK);
+    K->STOP = TRUE;
+    pthread_cond_broadcast(&K->CHANGED);
+    pthread_mutex_unlock(&K->LOCK);
+    pthread_cancel(K->THREAD);      /* if it is waiting in getc() */
+    pthread_join(K->THREAD, NULL);
+    K->RUNNING = FALSE;
+
+    /* Give back the keys the machine hasn't taken: the shell reads on from there */
+    if (K->HEAD != K->TAIL)
+        K->DONE = FALSE;
+    while (K->HEAD != K->TAIL)
+        ungetc(K->RING[--K->HEAD % KEYBOARD_RING_SIZE], K->INPUT);
+}
+
+Keyboard *KeyboardStart(Machine *M){     /* NULL if there is no input or no reader */
+    Keyboard *K;
+
+    if (M->CONSOLE.INPUT == NULL)
+        return NULL;
+    if ((K = calloc(1, sizeof(Keyboard))) == NULL) {
+        M->CONSOLE.INTERACTIVE = FALSE;     /* read in step instead */
+        return NULL;
+    }
+    pthread_mutex_init(&K->LOCK, NULL);
+    pthread_cond_init(&K->CHANGED, NULL);
+    K->INPUT = M->CONSOLE.INPUT;
+    M->CONSOLE.KEYBOARD = K;
+    KeyboardResume(M);
+    return M->CONSOLE.KEYBOARD;
+}
+
+void KeyboardStop(Machine *M){
+    /* Stop the reader for good: once this returns, INPUT is the caller's again */
+    Keyboard *K = M->CONSOLE.KEYBOARD;
+
+    if (K == NULL)
+        return;
+    KeyboardPark(M);
+    M->CONSOLE.KEYBOARD = NULL;
+    pthread_mutex_destroy(&K->LOCK);
+    pthread_cond_destroy(&K->CHANGED);
+    free(K);
+}
+
+int KeyboardTake(Machine *M, int Wait){
+    /* The next key, NO_KEY if none has arrived and !Wait, EOF at the end */
+    Keyboard *K = M->CONSOLE.KEYBOARD;
+    int Char;
+
+    if (__atomic_load_n(&K->HEAD, __ATOMIC_ACQUIRE) == K->TAIL) {
+        if (!Wait)
+            return NO_KEY;
+        if (M->CONSOLE.INTERACTIVE) {
+            ConsoleFlush(M);
+            fflush(M->CONSOLE.OUTPUT != NULL ? M->CONSOLE.OUTPUT : stdout);
+        }
+        pthread_mutex_lock(&K->LOCK);
+        while (K->HEAD == K->TAIL && !K->DONE)
+            pthread_cond_wait(&K->CHANGED, &K->LOCK);
+        pthread_mutex_unlock(&K->LOCK);
+        if (__atomic_load_n(&K->HEAD, __ATOMIC_ACQUIRE) == K->TAIL)
+            return EOF;
+    }
+    Char = K->RING[K->TAIL % KEYBOARD_RING_SIZE];
+    __atomic_store_n(&K->TAIL, K->TAIL + 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&K->LOCK);      /* the reader may wait for room */
+    pthread_cond_broadcast(&K->CHANGED);
+    pthread_mutex_unlock(&K->LOCK);
+    return Char;
+}
+
+int KeyWaiting(Machine *M){     /* KBSR[15] */
+    Keyboard *K = M->CONSOLE.KEYBOARD;
+    FILE *Input = M->CONSOLE.INPUT;
+    int Char;
+
+    if (K != NULL)
+        return __atomic_load_n(&K->HEAD, __ATOMIC_ACQUIRE) != K->TAIL;
+    if (M->CONSOLE.INTERACTIVE || Input == NULL || (Char = getc(Input)) == EOF)
+        return FALSE;
+    ungetc(Char, Input);
+    return TRUE;
+}
+
+int ReadDevice(Machine *M, int Addr){
+    Console *C = &M->CONSOLE;
+    int Char, Status, Value;
+
+    if (M->HOOKS.READ != NULL && M->HOOKS.READ(M->HOOKS.IO_CONTEXT, Addr, &Value))
+        return Low16bits(Value);
+    switch (Addr) {
+        case IO_KBSR:
+            if (C->KEYBOARD == NULL && C->INTERACTIVE)
+                KeyboardStart(M);
+            return (KeyWaiting(M) ? 0x8000 : 0) | (C->KEY_ENABLE ? 0x4000 : 0);
+        case IO_KBDR:           /* taking the key clears KBSR[15] */
+            if (C->KEYBOARD == NULL && C->INTERACTIVE)
+                KeyboardStart(M);
+            if (C->KEYBOARD != NULL) {
+                if ((Char = KeyboardTake(M, FALSE)) != NO_KEY)
+                    C->KEY = Char;
+            }
+            else if (C->INPUT != NULL && (Char = getc(C->INPUT)) != EOF)
+                C->KEY = Char;
+            return C->KEY;
+        case IO_DSR:            /* output never has to wait */
+            return 0x8000;
+        case IO_DDR:
+            return 0;
+        case IO_TMR:            /* reading it clears TMR[15] */
+            Status = (M->TIMER.EXPIRED ? 0x8000 : 0) | (M->TIMER.ENABLE ? 0x4000 : 0);
+            M->TIMER.EXPIRED = FALSE;
+            return Status;
+        case IO_TMI:
+            return M->TIMER.INTERVAL;
+    }
+    return M->MEMORY[Addr];
+}
+
+int WriteDevice(Machine *M, int Addr, int Value){
+    /* Returns FALSE if Addr is ordinary memory after all */
+    if (M->HOOKS.WRITE != NULL && M->HOOKS.WRITE(M->HOOKS.IO_CONTEXT, Addr, Value))
+        return TRUE;
+    switch (Addr) {
+        case IO_KBSR:
+            M->CONSOLE.KEY_ENABLE = (Value >> 14) & 1;
+            if (M->CONSOLE.KEY_ENABLE && M->CONSOLE.KEYBOARD == NULL && M->CONSOLE.INTERACTIVE)
+                KeyboardStart(M);
+            M->EVENTS.DIRTY = TRUE;
+            return TRUE;
+        case IO_TMR:
+            M->TIMER.ENABLE = (Value >> 14) & 1;
+            M->EVENTS.DIRTY = TRUE;
+            return TRUE;
+        case IO_TMI:
+            M->TIMER.INTERVAL = Value;
+            M->TIMER.RESTART = TRUE;
+            M->EVENTS.DIRTY = TRUE;
+            return TRUE;
+        case IO_DDR:
+            ConsolePut(M, Value & 0xFF);
+            return TRUE;
+        case IO_KBDR:
+        case IO_DSR:            /* read-only */
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* Interrupts */
+/*
+ * Interrupt() enters a handler the way the LC-3 does: switch to the
+ * supervisor stack if the machine was in user mode, push the PSR and
+ * the PC, raise the priority and jump through the vector table. RTI
+ * undoes it. Exceptions (RTI in user mode, opcode 1101) keep the
+ * priority and return to the instruction after the one that raised
+ * them. With no handler in the table the jump is to 0x0000, which
+ * halts.
+ *
+ * Interrupts are only taken by ServiceEvents(), between two runs of
+ * the engine, so their timing is the same on every engine.
+ */
+int GetPSR(Machine *M){
+    System_Latches *L = &M->CURRENT_LATCHES;
+
+    return (L->PRIV << 15) | (L->PRIORITY << 8) | (L->N << 2) | (L->Z << 1) | L->P;
+}
+
+void SetPSR(Machine *M, int PSR){     /* switches stacks on a change of mode */
+    System_Latches *L = &M->CURRENT_LATCHES;
+    int Priv = (PSR >> 15) & 1;
+
+    if (Priv != L->PRIV) {
+        if (Priv) {
+            L->SAVED_SSP = L->REGS[6];
+            L->REGS[6] = L->SAVED_USP;
+        }
+        else {
+            L->SAVED_USP = L->REGS[6];
+            L->REGS[6] = L->SAVED_SSP;
+        }
+    }
+    L->PRIV = Priv;
+    L->PRIORITY = (PSR >> 8) & 7;
+    L->Z = (PSR >> 1) & 1;      /* exactly one of N, Z, P, as the engines keep them */
+    L->N = !L->Z && ((PSR >> 2) & 1);
+    L->P = !L->Z && !L->N;
+}
+
+void Interrupt(Machine *M, int Vector, int Priority){
+    System_Latches *L = &M->CURRENT_LATCHES;
+    int PSR = GetPSR(M);
+
+    SetPSR(M, (Priority << 8) | (PSR & 0x0007));    /* supervisor mode */
+    L->REGS[6] = Low16bits(L->REGS[6] - 1);
+    WriteMemory(M, L->REGS[6], PSR);
+    L->REGS[6] = Low16bits(L->REGS[6] - 1);
+    WriteMemory(M, L->REGS[6], L->PC);
+    L->PC = M->MEMORY[IVT_BASE + Vector];
+    M->NEXT_LATCHES = *L;
+    if (M->TRACE != NULL)       /* rstep can't undo a change of stack */
+        M->TRACE->AVAILABLE = 0;
+}
+
+int RTI(Machine *M, const Decoded_Instruction *D){
+    System_Latches *L = &M->CURRENT_LATCHES;
+    int PC, PSR;
+
+    if (L->PRIV) {
+        Interrupt(M, VECTOR_PRIVILEGE, L->PRIORITY);
+        return 0;
+    }
+    PC = ReadMemory(M, L->REGS[6]);
+    PSR = ReadMemory(M, Low16bits(L->REGS[6] + 1));
+    L->REGS[6] = Low16bits(L->REGS[6] + 2);
+    SetPSR(M, PSR);             /* after the pops: R6 may change stacks */
+    L->PC = PC;
+    M->EVENTS.DIRTY = TRUE;     /* a lower priority may let an interrupt in */
+    return 0;
+}
+
+int ILLEGAL(Machine *M, const Decoded_Instruction *D){
+    Interrupt(M, VECTOR_ILLEGAL, M->CURRENT_LATCHES.PRIORITY);
+    return 0;
+}
+
+/* Events */
+/*
+ * The event queue: one slot per EVENT_* kind, each armed for the
+ * INSTRUCTION_COUNT it fires at. Counts are compared by difference,
+ * so they may wrap around.
+ */
+void EventPlan(Machine *M){     /* NEXT = the earliest AT armed */
+    Events *E = &M->EVENTS;
+    int k, Delay, Best = INT_MAX;
+
+    for (k = 0; k < EVENT_KINDS; k++) {
+        Delay = (int)((unsigned)E->AT[k] - (unsigned)M->INSTRUCTION_COUNT);
+        if ((E->ARMED & (1 << k)) && Delay < Best) {
+            Best = Delay;
+            E->NEXT = E->AT[k];
+        }
+    }
+}
+
+void EventArm(Machine *M, int Kind, int Delay){     /* Delay >= 1 */
+    M->EVENTS.AT[Kind] = (int)((unsigned)M->INSTRUCTION_COUNT + (unsigned)Delay);
+    M->EVENTS.ARMED |= 1 << Kind;
+    EventPlan(M);
+}
+
+void EventCancel(Machine *M, int Kind){
+    M->EVENTS.ARMED &= ~(1 << Kind);
+    EventPlan(M);
+}
+
+int EventDue(Machine *M, int Kind){
+    return (M->EVENTS.ARMED & (1 << Kind))
+           && (int)((unsigned)M->EVENTS.AT[Kind] - (unsigned)M->INSTRUCTION_COUNT) <= 0;
+}
+
+long long EventDelay(Machine *M){
+    /* Instructions until the next event, 0 if one is due, LLONG_MAX if none is armed */
+    int Delay;
+
+    if (M->EVENTS.ARMED == 0)
+        return LLONG_MAX;
+    Delay = (int)((unsigned)M->EVENTS.NEXT - (unsigned)M->INSTRUCTION_COUNT);
+    return Delay > 0 ? Delay : 0;
+}
+
+void ServiceEvents(Machine *M){
+    /*
+     * Fire the events that are due and act on what the devices changed,
+     * then take the most urgent interrupt requested if its priority is
+     * above the machine's.
+     */
+    Timer *T = &M->TIMER;
+    int Vector = -1, Priority = 0;
+
+    M->EVENTS.DIRTY = FALSE;
+    if (T->RESTART) {
+        T->RESTART = FALSE;
+        if (T->INTERVAL > 0)
+            EventArm(M, EVENT_TIMER, T->INTERVAL);
+        else
+            EventCancel(M, EVENT_TIMER);
+    }
+    else if (EventDue(M, EVENT_TIMER)) {
+        T->EXPIRED = TRUE;
+        EventArm(M, EVENT_TIMER, T->INTERVAL);
+    }
+    EventCancel(M, EVENT_POLL);
+
+    if (T->ENABLE && T->EXPIRED) {
+        Vector = VECTOR_TIMER;
+        Priority = PRIORITY_TIMER;
+    }
+    else if (M->CONSOLE.KEY_ENABLE && KeyWaiting(M)) {
+        Vector = VECTOR_KEYBOARD;
+        Priority = PRIORITY_KEYBOARD;
+    }
+    if (Vector >= 0 && Priority > M->CURRENT_LATCHES.PRIORITY)
+        Interrupt(M, Vector, Priority);
+
+    /* Keys arrive on their own: look for them while they interrupt */
+    if (M->CONSOLE.KEY_ENABLE)
+        EventArm(M, EVENT_POLL, POLL_INTERVAL);
+}
+
+/* Threaded engine */
+/*
+ * Same semantics as cycle()/process_instruction(), but the registers
+ * and PC live in locals for the whole run, each handler jumps straight
+ * to the next one (computed goto on GCC/Clang), and the condition
+ * codes are kept as the last result that would have gone to SetCC().
+ * N/Z/P are only derived from it when a BR needs them, and on exit.
+ */
+#define CC_FLAGS(Result) ((Result) == 0 ? 2 : ((Result) & 0x8000) ? 4 : 1)
+
+int PackCC(Machine *M){       /* N/Z/P -> a result that sets the same codes */
+    return M->CURRENT_LATCHES.Z ? 0 : M->CURRENT_LATCHES.N ? 0x8000 : 1;
+}
+
+void UnpackCC(Machine *M, int Result){  /* result -> N/Z/P */
+    M->CURRENT_LATCHES.N = CC_FLAGS(Result) >> 2;
+    M->CURRENT_LATCHES.Z = (CC_FLAGS(Result) >> 1) & 1;
+    M->CURRENT_LATCHES.P = CC_FLAGS(Result) & 1;
+}
+
+long long RunThreaded(Machine *M, long long Budget){
+    int R[LC_3_REGS];
+    uint16_t PC = M->CURRENT_LATCHES.PC;    /* wraps by itself */
+    int Result;             /* last value written by a SetCC instruction */
+    long long Left = Budget, Skip;
+    Decoded_Instruction *D = NULL, *E;
+    int k;
+
+#if defined(__GNUC__)
+    static void *Labels[OP_FUSED_COUNT] = {
+        &&L_ADD, &&L_ADDI, &&L_AND, &&L_ANDI, &&L_BR, &&L_JMP, &&L_JSR, &&L_JSRR,
+        &&L_LD, &&L_LDI, &&L_LDR, &&L_LEA, &&L_NOT, &&L_ST, &&L_STI, &&L_STR,
+        &&L_TRAP, &&L_RTI, &&L_ILLEGAL,
+        &&L_ADDI_BR, &&L_CLEAR_ADDI, &&L_LDR_ADD, &&L_LDR_ADDI, &&L_LD_STR,
+        &&L_COUNTDOWN
+    };
+#define THREADED_JUMP() goto *Labels[D->Fused]
+#define SINGLE_JUMP() goto *Labels[D->Op]
+#else
+#define THREADED_JUMP() goto L_SWITCH
+#define SINGLE_JUMP() goto L_SINGLE
+#endif
+
+#define NEXT() \
+    if (Left == 0 || PC == 0x0000) goto L_EXIT; \
+    Left--; \
+    D = &M->DECODE_CACHE[PC]; \
+    if (D->Handler == NULL) { Decode(M->MEMORY[PC], D); Fuse(M, PC, D); } \
+    PC++; \
+    THREADED_JUMP()
+
+/* NEXT(), unless the instruction left events for execute() */
+#define NEXT_OR_EVENT() \
+    if (M->EVENTS.DIRTY) goto L_EXIT; \
+    NEXT()
+
+/*
+  Start a superinstruction: run it as two only if the budget allows
+  the second, else run D alone. E is the second instruction; it is
+  counted and its word skipped here, so the code that follows only
+  has to do the work of both.
+*/
+#define FUSED() \
+    if (Left == 0) SINGLE_JUMP(); \
+    Left--; \
+    E = D + 1; \
+    PC++
+
+    for (k = 0; k < LC_3_REGS; k++)
+        R[k] = M->CURRENT_LATCHES.REGS[k];
+    Result = PackCC(M);
+
+    NEXT();
+
+#if !defined(__GNUC__)
+L_SWITCH:
+    switch (D->Fused) {
+        case OP_FUSED_ADDI_BR: goto L_ADDI_BR;
+        case OP_FUSED_CLEAR_ADDI: goto L_CLEAR_ADDI;
+        case OP_FUSED_LDR_ADD: goto L_LDR_ADD;
+        case OP_FUSED_LDR_ADDI: goto L_LDR_ADDI;
+        case OP_FUSED_LD_STR: goto L_LD_STR;
+        case OP_FUSED_COUNTDOWN: goto L_COUNTDOWN;
+    }
+L_SINGLE:
+    switch (D->Op) {
+        case OP_ADD: goto L_ADD;    case OP_ADDI: goto L_ADDI;
+        case OP_AND: goto L_AND;    case OP_ANDI: goto L_ANDI;
+        case OP_BR: goto L_BR;      case OP_JMP: goto L_JMP;
+        case OP_JSR: goto L_JSR;    case OP_JSRR: goto L_JSRR;
+        case OP_LD: goto L_LD;      case OP_LDI: goto L_LDI;
+        case OP_LDR: goto L_LDR;    case OP_LEA: goto L_LEA;
+        case OP_NOT: goto L_NOT;    case OP_ST: goto L_ST;
+        case OP_STI: goto L_STI;    case OP_STR: goto L_STR;
+        case OP_TRAP: goto L_TRAP;  case OP_RTI: goto L_RTI;
+        default: goto L_ILLEGAL;
+    }
+#endif
+
+L_ADD:
+    Result = R[D->DR] = Low16bits(R[D->SR1] + R[D->SR2]);
+    NEXT();
+L_ADDI:
+    Result = R[D->DR] = Low16bits(R[D->SR1] + D->Imm);
+    NEXT();
+L_AND:
+    Result = R[D->DR] = R[D->SR1] & R[D->SR2];
+    NEXT();
+L_ANDI:
+    Result = R[D->DR] = R[D->SR1] & D->Imm;
+    NEXT();
+L_BR:
+    if (D->DR & CC_FLAGS(Result))
+        PC += D->Imm;
+    NEXT();
+L_JMP:
+    if (D->SR1 == 7 && !IsEmpty(M))      /* RET */
+        R[7] = POP(M);
+    PC = R[D->SR1];
+    NEXT();
+L_JSR:
+    R[7] = PC;
+    PUSH(M, R[7], (uint16_t)(PC + D->Imm));
+    PC += D->Imm;
+    NEXT();
+L_JSRR:
+    R[7] = PC;
+    PUSH(M, R[7], R[D->SR1]);
+    PC = R[D->SR1];
+    NEXT();
+L_LD:
+    Result = R[D->DR] = ReadMemory(M, Low16bits(PC + D->Imm));
+    NEXT();
+L_LDI:
+    Result = R[D->DR] = ReadMemory(M, ReadMemory(M, Low16bits(PC + D->Imm)));
+    NEXT();
+L_LDR:
+    Result = R[D->DR] = ReadMemory(M, Low16bits(R[D->SR1] + D->Imm));
+    NEXT();
+L_LEA:
+    R[D->DR] = Low16bits(PC + D->Imm);
+    NEXT();
+L_NOT:
+    Result = R[D->DR] = Low16bits(~R[D->SR1]);
+    NEXT();
+L_ST:
+    WriteMemory(M, Low16bits(PC + D->Imm), R[D->DR]);
+    NEXT_OR_EVENT();
+L_STI:
+    WriteMemory(M, ReadMemory(M, Low16bits(PC + D->Imm)), R[D->DR]);
+    NEXT_OR_EVENT();
+L_STR:
+    WriteMemory(M, Low16bits(R[D->SR1] + D->Imm), R[D->DR]);
+    NEXT_OR_EVENT();
+L_TRAP:
+    if (TrapService(M, D->Raw & 0x00FF, &R[0]))
+        R[7] = PC;
+    else
+        PC = 0x0000;    /* Halt */
+    NEXT();
+L_RTI:
+L_ILLEGAL:
+    /* Rare, and they switch stacks: run the handler on the latches */
+    for (k = 0; k < LC_3_REGS; k++)
+        M->CURRENT_LATCHES.REGS[k] = R[k];
+    M->CURRENT_LATCHES.PC = PC;
+    UnpackCC(M, Result);
+    D->Handler(M, D);
+    for (k = 0; k < LC_3_REGS; k++)
+        R[k] = M->CURRENT_LATCHES.REGS[k];
+    PC = M->CURRENT_LATCHES.PC;
+    Result = PackCC(M);
+    NEXT_OR_EVENT();
+
+L_ADDI_BR:
+    FUSED();
+    Result = R[D->DR] = Low16bits(R[D->SR1] + D->Imm);
+    if (E->DR & CC_FLAGS(Result))
+        PC += E->Imm;
+    D = E;
+    NEXT();
+L_CLEAR_ADDI:
+    FUSED();
+    R[D->DR] = 0;
+    Result = R[E->DR] = E->Imm;
+    D = E;
+    NEXT();
+L_LDR_ADD:
+    FUSED();
+    R[D->DR] = ReadMemory(M, Low16bits(R[D->SR1] + D->Imm));
+    Result = R[E->DR] = Low16bits(R[E->SR1] + R[E->SR2]);
+    D = E;
+    NEXT();
+L_LDR_ADDI:
+    FUSED();
+    R[D->DR] = ReadMemory(M, Low16bits(R[D->SR1] + D->Imm));
+    Result = R[E->DR] = Low16bits(R[E->SR1] + E->Imm);
+    D = E;
+    NEXT();
+L_LD_STR:
+    FUSED();
+    Result = R[D->DR] = ReadMemory(M, Low16bits(PC - 1 + D->Imm));
+    WriteMemory(M, Low16bits(R[E->SR1] + E->Imm), R[E->DR]);
+    D = E;
+    NEXT_OR_EVENT();
+L_COUNTDOWN:
+    /* Skip all but the last iteration the budget allows, then run it */
+    FUSED();
+    Skip = CountdownIterations(R[D->DR], (short)D->Imm, E->DR) - 1;
+    if (Skip > Left / 2)
+        Skip = Left / 2;
+    if (Skip > 0) {
+        R[D->DR] = Low16bits(R[D->DR] + Skip * (short)D->Imm);
+        Left -= 2 * Skip;
+    }
+    Result = R[D->DR] = Low16bits(R[D->SR1] + D->Imm);
+    if (E->DR & CC_FLAGS(Result))
+        PC += E->Imm;
+    D = E;
+    NEXT();
+
+#undef NEXT
+#undef NEXT_OR_EVENT
+#undef FUSED
+#undef SINGLE_JUMP
+#undef THREADED_JUMP
+
+L_EXIT:
+    for (k = 0; k < LC_3_REGS; k++)
+        M->CURRENT_LATCHES.REGS[k] = R[k];
+    M->CURRENT_LATCHES.PC = PC;
+    UnpackCC(M, Result);
+    M->NEXT_LATCHES = M->CURRENT_LATCHES;
+    M->INSTRUCTION_COUNT += Budget - Left;
+    if (D != NULL)
+        M->Instruction = D->Raw;
+
+    return Budget - Left;
+}
+
+long long CountdownIterations(int Value, int Step, int Conditions){
+    /*
+     * How many times "L: ADD Rx,Rx,#Step; BR(Conditions) L" runs when
+     * entered with Rx = Value, or 0 for loops it does not solve:
+     * counting down while positive (BRp) or non-negative (BRzp), up
+     * while negative (BRn) or non-positive (BRnz), or by one either
+     * way while non-zero (BRnp). None of these can wrap around.
+     */
+    int S = (short)Value;
+
+    switch (Conditions) {
+        case 1:     /* p */
+            return Step < 0 && S > 0 ? (S - Step - 1) / -Step : 0;
+        case 3:     /* zp */
+            return Step < 0 && S >= 0 ? S / -Step + 1 : 0;
+        case 4:     /* n */
+            return Step > 0 && S < 0 ? (-S + Step - 1) / Step : 0;
+        case 6:     /* nz */
+            return Step > 0 && S <= 0 ? -S / Step + 1 : 0;
+        case 5:     /* np */
+            if (Value == 0 || (Step != 1 && Step != -1))
+                return 0;
+            return Step < 0 ? Value : 0x10000 - Value;
+    }
+    return 0;
+}
+
+long long RunProfiled(Machine *M, long long Budget){
+    /* cycle() plus the counters of M->PROFILE */
+    Profile *P = M->PROFILE;
+    Decoded_Instruction *D;
+    long long Executed;
+    int PC, CC;
+
+    for (Executed = 0; Executed < Budget && M->CURRENT_LATCHES.PC != 0x0000
+                       && !M->EVENTS.DIRTY; Executed++) {
+        PC = M->CURRENT_LATCHES.PC;
+        D = &M->DECODE_CACHE[PC];
+        if (D->Handler == NULL)
+            Decode(M->MEMORY[PC], D);
+        CC = (M->CURRENT_LATCHES.N << 2) | (M->CURRENT_LATCHES.Z << 1) | M->CURRENT_LATCHES.P;
+
+        P->PC_COUNT[PC]++;
+        P->OP_COUNT[D->Op]++;
+        if (D->Op == OP_BR && (D->DR & CC)) {
+            P->TAKEN[PC]++;
+            P->BR_TAKEN++;
+        }
+
+        cycle(M);
+
+        if (D->Op == OP_JSR || D->Op == OP_JSRR)
+            P->CALLS[M->CURRENT_LATCHES.PC]++;
+    }
+    return Executed;
+}
+
+
+/* Timing */
+/*
+ * While M->TIMING is set, execute() runs cycle(), and
+ * process_instruction() charges each instruction its cycles and its
+ * fetch, and LD, LDI, LDR, ST, STI and STR their loads and stores.
+ * The memory accesses of TRAPs, interrupts and RTI are not modelled.
+ */
+int CacheAccess(Cache *C, int Addr, int Write, int *Evicted){
+    /*
+     * Look Addr up in C, bringing its line in on a miss: TRUE on a
+     * hit. A dirty line evicted to make room is left in *Evicted (its
+     * first address), else -1. Sets are kept most recently used
+     * first, so a repeated hit costs one compare and LRU is the last.
+     */
+    uint32_t Line = (uint32_t)Addr >> C->SHIFT, Tag = (Line + 1) << 1, Found;
+    uint32_t *Set = C->TAGS + (Line & (C->SETS - 1)) * C->WAYS;
+    int Way, Hit;
+
+    C->ACCESSES++;
+    *Evicted = -1;
+    if ((Set[0] & ~1u) == Tag) {
+        Set[0] |= Write;
+        return TRUE;
+    }
+    for (Way = 1; Way < C->WAYS && (Set[Way] & ~1u) != Tag; Way++)
+        ;
+    Hit = Way < C->WAYS;
+    if (Hit)
+        Found = Set[Way];
+    else {
+        C->MISSES++;
+        Way = C->WAYS - 1;
+        if (Set[Way] & 1) {
+            C->WRITEBACKS++;
+            *Evicted = (int)((Set[Way] >> 1) - 1) << C->SHIFT;
+        }
+        Found = Tag;
+    }
+    memmove(Set + 1, Set, Way * sizeof(uint32_t));
+    Set[0] = Found | Write;
+    return Hit;
+}
+
+void TimeAccess(Machine *M, int Addr, int Kind){
+    /* Send one access down the hierarchy and charge its stall */
+    Timing *T = M->TIMING;
+    int Level = Kind == ACCESS_FETCH ? CACHE_L1I : CACHE_L1D;
+    Cache *L1 = &T->LEVEL[Level], *L2 = &T->LEVEL[CACHE_L2];
+    int Write = Kind == ACCESS_STORE, Stall = 0, Evicted, Dropped;
+
+    if (Addr >= IO_PAGE) {              /* device registers are not cached */
+        T->STALLS[Kind][CACHE_MEMORY] += T->MEMORY_LATENCY;
+        return;
+    }
+    if (L1->WORDS > 0) {
+        Stall += L1->LATENCY;
+        if (CacheAccess(L1, Addr, Write, &Evicted)) {
+            T->STALLS[Kind][Level] += Stall;
+            return;
+        }
+        if (Evicted >= 0 && L2->WORDS > 0)  /* the write-back; L2's own goes to memory */
+            CacheAccess(L2, Evicted, TRUE, &Dropped);
+        Write = FALSE;                  /* L2 only supplies the line */
+    }
+    if (L2->WORDS > 0) {
+        Stall += L2->LATENCY;
+        if (CacheAccess(L2, Addr, Write, &Evicted)) {
+            T->STALLS[Kind][CACHE_L2] += Stall;
+            return;
+        }
+    }
+    T->STALLS[Kind][CACHE_MEMORY] += Stall + T->MEMORY_LATENCY;
+}
+
+void TimeInstruction(Machine *M, const Decoded_Instruction *D){
+    /* The instruction at the current PC, about to run */
+    Timing *T = M->TIMING;
+    int CC = (M->CURRENT_LATCHES.N << 2) | (M->CURRENT_LATCHES.Z << 1) | M->CURRENT_LATCHES.P;
+
+    T->INSTRUCTIONS++;
+    T->BASE += T->CYCLES[D->Op];
+    if (D->Op == OP_BR && (D->DR & CC))
+        T->BASE += T->TAKEN;
+    TimeAccess(M, M->CURRENT_LATCHES.PC, ACCESS_FETCH);
+}
+
+
+/* Breakpoints */
+int StoreAddress(Machine *M, const Decoded_Instruction *D){
+    /* The memory word D at the current PC is about to write, or -1 */
+    int PC = M->CURRENT_LATCHES.PC;
+
+    switch (D->Op) {
+        case OP_ST:
+            return Low16bits(PC + 1 + D->Imm);
+        case OP_STI:
+            return M->MEMORY[Low16bits(PC + 1 + D->Imm)];
+        case OP_STR:
+            return Low16bits(M->CURRENT_LATCHES.REGS[D->SR1] + D->Imm);
+    }
+    return -1;
+}
+
+long long RunChecked(Machine *M, long long Budget){
+    /*
+     * The dispatch loop used while any breakpoint or watchpoint is set:
+     * stop before an instruction at a breakpoint (but not the first
+     * one of a go or run, so they resume from a breakpoint) and after
+     * a store to a watched word.
+     */
+    Breakpoints *B = M->BREAKPOINTS;
+    Decoded_Instruction *D;
+    long long Executed;
+    int PC, Addr;
+
+    B->STOP = STOP_NONE;
+    for (Executed = 0; Executed < Budget && M->CURRENT_LATCHES.PC != 0x0000
+                       && !M->EVENTS.DIRTY; Executed++) {
+        PC = M->CURRENT_LATCHES.PC;
+        if (!B->RESUME && BIT_TEST(B->BREAK, PC)) {
+            B->STOP = STOP_BREAK;
+            B->STOP_PC = PC;
+            break;
+        }
+
+        Addr = -1;
+        if (B->WATCHES > 0) {
+            D = &M->DECODE_CACHE[PC];
+            if (D->Handler == NULL)
+                Decode(M->MEMORY[PC], D);
+            Addr = StoreAddress(M, D);
+            if (Addr >= 0 && BIT_TEST(B->WATCH, Addr))
+                B->OLD_VALUE = M->MEMORY[Addr];
+            else
+                Addr = -1;
+        }
+
+        if (M->PROFILE != NULL)
+            RunProfiled(M, 1);
+        else
+            cycle(M);
+        B->RESUME = FALSE;
+
+        if (Addr >= 0) {
+            B->STOP = STOP_WATCH;
+            B->STOP_PC = PC;
+            B->STOP_ADDR = Addr;
+            Executed++;
+            break;
+        }
+    }
+    return Executed;
+}
+
+/* Trace */
+/*
+ * While M->TRACE is set, cycle() brackets every instruction with
+ * TraceBegin()/TraceEnd(). TraceBegin() works out from the decoded
+ * instruction which register and which memory word it is about to
+ * overwrite and saves their old values, the PC and the condition
+ * codes; TraceEnd() notes any move of the R7 save stack. TraceUndo()
+ * puts all of that back, newest record first. A store to KBSR, TMR or
+ * TMI saves the device register, not the memory word behind it, and
+ * is undone without the device noticing; console output stays out.
+ */
+int TraceDevice(Machine *M, int Addr){     /* the register undo restores, -1 if none */
+    switch (Addr) {
+        case IO_KBSR:
+            return M->CONSOLE.KEY_ENABLE ? 0x4000 : 0;
+        case IO_TMR:
+            return M->TIMER.ENABLE ? 0x4000 : 0;
+        case IO_TMI:
+            return M->TIMER.INTERVAL;
+    }
+    return -1;
+}
+
+Trace_Record *TraceBegin(Machine *M){
+    Trace *T = M->TRACE;
+    Trace_Record *R = &T->RING[T->HEAD];
+    Decoded_Instruction *D = &M->DECODE_CACHE[M->CURRENT_LATCHES.PC];
+    int PC = M->CURRENT_LATCHES.PC, Reg = -1, Addr;
+
+    if (D->Handler == NULL)
+        Decode(M->MEMORY[PC], D);
+
+    switch (D->Op) {
+        case OP_ADD: case OP_ADDI: case OP_AND: case OP_ANDI: case OP_NOT:
+        case OP_LD: case OP_LDI: case OP_LDR: case OP_LEA:
+            Reg = D->DR;
+            break;
+        case OP_JMP:
+            if (D->SR1 == 7)        /* RET may pop into R7 */
+                Reg = 7;
+            break;
+        case OP_JSR: case OP_JSRR: case OP_TRAP:
+            Reg = 7;
+            break;
+    }
+    Addr = StoreAddress(M, D);
+
+    R->PC = (uint16_t)PC;
+    R->RAW = D->Raw;
+    R->FLAGS = (uint16_t)((M->CURRENT_LATCHES.N << 2) | (M->CURRENT_LATCHES.Z << 1)
+                          | M->CURRENT_LATCHES.P);
+    if (Reg >= 0) {
+        R->FLAGS |= TRACE_REG | (Reg << 3);
+        R->OLD_REG = (uint16_t)M->CURRENT_LATCHES.REGS[Reg];
+    }
+    if (Addr >= 0) {
+        R->FLAGS |= TRACE_MEM;
+        R->ADDR = (uint16_t)Addr;
+        R->OLD_MEM = TraceDevice(M, Addr) >= 0 ? TraceDevice(M, Addr) : M->MEMORY[Addr];
+    }
+    if (D->Op == OP_TRAP) {     /* GETC and IN also write R0 */
+        R->FLAGS |= TRACE_R0;
+        R->OLD_MEM = (uint16_t)M->CURRENT_LATCHES.REGS[0];
+    }
+    if ((D->Op == OP_JSR || D->Op == OP_JSRR) && M->RETURNS.DEPTH < M->RETURNS.CAPACITY) {
+        R->ADDR = (uint16_t)(M->RETURNS.ENTRY[M->RETURNS.DEPTH] >> 16);
+        R->OLD_MEM = (uint16_t)M->RETURNS.ENTRY[M->RETURNS.DEPTH];
+    }
+    T->DEPTH = M->RETURNS.DEPTH;
+    return R;
+}
+
+void TraceEnd(Machine *M, Trace_Record *R){
+    Trace *T = M->TRACE;
+
+    if (M->RETURNS.DEPTH != T->DEPTH)
+        R->FLAGS |= M->RETURNS.DEPTH > T->DEPTH ? TRACE_PUSH : TRACE_POP;
+    T->HEAD = T->HEAD + 1 == T->CAPACITY ? 0 : T->HEAD + 1;
+    if (T->AVAILABLE < T->CAPACITY)
+        T->AVAILABLE++;
+    T->RECORDED++;
+    if (T->OUTPUT != NULL)
+        fwrite(R, sizeof(Trace_Record), 1, T->OUTPUT);
+    if ((R->RAW & 0xF000) == 0x8000 || (R->RAW & 0xF000) == 0xD000)
+        T->AVAILABLE = 0;       /* RTI and exceptions switch stacks: no undo */
+}
+
+int TraceUndo(Machine *M){
+    Trace *T = M->TRACE;
+    Trace_Record *R;
+
+    if (T == NULL || T->AVAILABLE == 0)
+        return FALSE;
+    T->HEAD = (T->HEAD == 0 ? T->CAPACITY : T->HEAD) - 1;
+    T->AVAILABLE--;
+    R = &T->RING[T->HEAD];
+
+    if ((R->FLAGS & TRACE_MEM) && TraceDevice(M, R->ADDR) >= 0) {
+        if (R->ADDR == IO_KBSR)
+            M->CONSOLE.KEY_ENABLE = (R->OLD_MEM >> 14) & 1;
+        else if (R->ADDR == IO_TMR)
+            M->TIMER.ENABLE = (R->OLD_MEM >> 14) & 1;
+        else
+            M->TIMER.INTERVAL = R->OLD_MEM;
+        M->EVENTS.DIRTY = TRUE;
+    }
+    else if (R->FLAGS & TRACE_MEM)
+        StoreMemory(M, R->ADDR, R->OLD_MEM);
+    if (R->FLAGS & TRACE_REG)
+        M->CURRENT_LATCHES.REGS[(R->FLAGS >> 3) & 7] = R->OLD_REG;
+    if (R->FLAGS & TRACE_R0)
+        M->CURRENT_LATCHES.REGS[0] = R->OLD_MEM;
+    if (R->FLAGS & TRACE_PUSH)
+        M->RETURNS.ENTRY[--M->RETURNS.DEPTH] = (uint32_t)R->ADDR << 16 | R->OLD_MEM;
+    if (R->FLAGS & TRACE_POP)
+        M->RETURNS.DEPTH++;
+    M->CURRENT_LATCHES.N = (R->FLAGS >> 2) & 1;
+    M->CURRENT_LATCHES.Z = (R->FLAGS >> 1) & 1;
+    M->CURRENT_LATCHES.P = R->FLAGS & 1;
+    M->CURRENT_LATCHES.PC = R->PC;
+    M->NEXT_LATCHES = M->CURRENT_LATCHES;
+    M->INSTRUCTION_COUNT--;
+    return TRUE;
+}
+
+/* JIT */
+/*
+ * RunJit() translates basic blocks into x86-64 code. A block starts at
+ * the current PC and runs up to and including the first BR, JMP, JSR,
+ * JSRR or TRAP (or JIT_MAX_BLOCK instructions), stopping short of RTI
+ * and opcode 1101, which RunJit() interprets. While native code runs:
+ *
+ *   rbx -> Jit_State    (LC-3 registers, PC, lazy CC result, budget)
+ *   r12 -> M->MEMORY
+ *   r13 -> J->ENTRY     (native entry of each translated address)
+ *
+ * Each block starts by charging its length against the budget, and
+ * gives up before executing anything if the budget is too small, so
+ * "run n" stops on exactly the right instruction. A block leaves through
+ * an exit stub that stores the next PC and returns the stub's address;
+ * RunJit() then patches the stub into a direct jump to the next block,
+ * so hot paths run from block to block without coming back to C.
+ * Indirect jumps look the target up in J->ENTRY directly. J->ENTRY[0]
+ * is never filled in, so reaching PC == 0x0000 always returns to
+ * RunJit(), which stops just like go().
+ *
+ * Stores go through WriteMemory(). When one hits a translated word, all
+ * blocks are thrown away: the native code returns right after the store
+ * and RunJit() calls JitFlush() before translating again.
+ *
+ * Loads read M->MEMORY directly after one compare against IO_PAGE;
+ * device registers are read through a stub placed after the block.
+ *
+ * Anything RunJit() cannot run natively (no x86-64, mmap refused, a
+ * budget smaller than the block) is stepped through process_instruction()
+ * instead.
+ *
+ * Code buffer and tables live in the machine's own Jit_Cache, allocated
+ * the first time it runs on the JIT, so machines on separate threads
+ * never share translated code.
+ */
+typedef struct Jit_State_Struct{
+    int REGS[LC_3_REGS];    /* register file */
+    int PC;                 /* next PC, written on every exit */
+    int Result;             /* lazy condition codes, see RunThreaded() */
+    long long Left;         /* instructions left in the budget */
+    Machine *M;             /* for the C helpers */
+} Jit_State;
+
+#define JIT_BUFFER_SIZE     (4 << 20)   /* bytes of native code */
+#define JIT_MAX_BLOCK       64          /* LC-3 instructions per block */
+#define JIT_MAX_BLOCK_BYTES (JIT_MAX_BLOCK * 96 + 128)
+
+struct Jit_Cache_Struct{
+    void *ENTRY[WORDS_IN_MEM];          /* native entry point, or NULL */
+    unsigned char LENGTH[WORDS_IN_MEM]; /* instructions in that block */
+    int STARTS[WORDS_IN_MEM];           /* translated start addresses */
+    int BLOCK_COUNT;                /* entries used in STARTS */
+    unsigned char *BUFFER;          /* mmap'd, read/write/execute */
+    unsigned char *PTR;             /* next free byte in BUFFER */
+    unsigned char *BLOCKS;          /* first byte after the trampoline */
+    unsigned char *EPILOGUE;        /* pops and returns rax */
+    int FAILED;                     /* mmap refused, always interpret */
+    unsigned char *DEVICE_LOADS[2 * JIT_MAX_BLOCK];     /* jae rel32 to patch */
+    unsigned char *DEVICE_RESUME[2 * JIT_MAX_BLOCK];    /* where each stub returns */
+    int DEVICE_LOAD_COUNT;          /* in the block being compiled */
+};
+
+#if defined(JIT_AVAILABLE)
+
+typedef unsigned char *(*Jit_Enter)(Jit_State *S, uint16_t *Memory, void **Entry, void *Block);
+
+/* Host registers, as encoded in ModRM */
+#define EAX 0
+#define ECX 1
+#define EDX 2
+#define ESI 6
+#define EDI 7
+
+/* Jit_State fields, as [rbx + disp8] */
+#define JIT_REG(r)  ((int)offsetof(Jit_State, REGS) + 4 * (r))
+#define JIT_PC      ((int)offsetof(Jit_State, PC))
+#define JIT_RESULT  ((int)offsetof(Jit_State, Result))
+#define JIT_LEFT    ((int)offsetof(Jit_State, Left))
+
+void Emit8(Jit_Cache *J, int Byte){
+    *J->PTR++ = (unsigned char)Byte;
+}
+
+void Emit32(Jit_Cache *J, unsigned int Value){
+    memcpy(J->PTR, &Value, 4);
+    J->PTR += 4;
+}
+
+void Emit32At(unsigned char *At, unsigned int Value){
+    memcpy(At, &Value, 4);
+}
+
+void EmitRel32(Jit_Cache *J, const unsigned char *Target){    /* relative to the next byte */
+    Emit32(J, (unsigned int)(Target - (J->PTR + 4)));
+}
+
+void EmitState(Jit_Cache *J, int Opcode, int Reg, int Disp){  /* op reg, [rbx + disp8] */
+    Emit8(J, Opcode);
+    Emit8(J, 0x40 | (Reg << 3) | 3);
+    Emit8(J, Disp);
+}
+
+void EmitCall(Jit_Cache *J, void *Function){      /* mov rax, imm64 ; call rax */
+    unsigned long long Address = (unsigned long long)(size_t)Function;
+
+    Emit8(J, 0x48); Emit8(J, 0xB8);
+    memcpy(J->PTR, &Address, 8);
+    J->PTR += 8;
+    Emit8(J, 0xFF); Emit8(J, 0xD0);
+}
+
+void EmitResult(Jit_Cache *J, int DR){    /* REGS[DR] = Result = eax */
+    EmitState(J, 0x89, EAX, JIT_REG(DR));
+    EmitState(J, 0x89, EAX, JIT_RESULT);
+}
+
+int JitLoad(Jit_State *S, int Addr);
+
+void EmitLoad(Jit_Cache *J){
+    /*
+     * eax = MEMORY[eax]. Device loads jump to a stub after the block
+     * (see EmitDeviceLoads()), so ordinary ones never take a branch.
+     */
+    Emit8(J, 0x3D); Emit32(J, IO_PAGE);                                   /* cmp eax, IO_PAGE */
+    Emit8(J, 0x0F); Emit8(J, 0x83);                                       /* jae stub */
+    J->DEVICE_LOADS[J->DEVICE_LOAD_COUNT] = J->PTR;
+    Emit32(J, 0);
+    Emit8(J, 0x41); Emit8(J, 0x0F); Emit8(J, 0xB7); Emit8(J, 0x04); Emit8(J, 0x44);  /* movzx eax, word [r12+rax*2] */
+    J->DEVICE_RESUME[J->DEVICE_LOAD_COUNT++] = J->PTR;
+}
+
+void EmitDeviceLoads(Jit_Cache *J){     /* the stubs: eax = JitLoad(S, eax) */
+    int k;
+
+    for (k = 0; k < J->DEVICE_LOAD_COUNT; k++) {
+        Emit32At(J->DEVICE_LOADS[k], (unsigned int)(J->PTR - (J->DEVICE_LOADS[k] + 4)));
+        Emit8(J, 0x48); Emit8(J, 0x89); Emit8(J, 0xDF);                      /* mov rdi, rbx */
+        Emit8(J, 0x89); Emit8(J, 0xC6);                                   /* mov esi, eax */
+        EmitCall(J, JitLoad);
+        Emit8(J, 0xE9); EmitRel32(J, J->DEVICE_RESUME[k]);
+    }
+    J->DEVICE_LOAD_COUNT = 0;
+}
+
+void EmitLoadAt(Jit_Cache *J, int Addr){    /* eax = MEMORY[Addr] */
+    if (Addr < IO_PAGE) {                   /* movzx eax, word [r12+Addr*2] */
+        Emit8(J, 0x41); Emit8(J, 0x0F); Emit8(J, 0xB7); Emit8(J, 0x84); Emit8(J, 0x24);
+        Emit32(J, 2 * Addr);
+        return;
+    }
+    Emit8(J, 0xB8); Emit32(J, Addr);        /* mov eax, Addr */
+    EmitLoad(J);
+}
+
+void EmitSetCC(Jit_Cache *J, int DR){     /* movzx eax, ax ; EmitResult() */
+    Emit8(J, 0x0F); Emit8(J, 0xB7); Emit8(J, 0xC0);
+    EmitResult(J, DR);
+}
+
+void EmitExit(Jit_Cache *J, int PC, int Refund){  /* leave for RunJit(), no chaining */
+    Emit8(J, 0xC7); Emit8(J, 0x43); Emit8(J, JIT_PC); Emit32(J, PC);
+    if (Refund > 0) {               /* add qword [rbx+Left], imm32 */
+        Emit8(J, 0x48); Emit8(J, 0x81); Emit8(J, 0x43); Emit8(J, JIT_LEFT); Emit32(J, Refund);
+    }
+    Emit8(J, 0x31); Emit8(J, 0xC0);       /* xor eax, eax */
+    Emit8(J, 0xE9); EmitRel32(J, J->EPILOGUE);
+}
+
+void EmitChainExit(Jit_Cache *J, int PC){         /* exit RunJit() can patch into a jmp */
+    unsigned char *Stub = J->PTR;
+
+    if (PC == 0x0000) {             /* halt: always go back to RunJit() */
+        EmitExit(J, PC, 0);
+        return;
+    }
+    Emit8(J, 0xC7); Emit8(J, 0x43); Emit8(J, JIT_PC); Emit32(J, PC);
+    Emit8(J, 0x48); Emit8(J, 0x8D); Emit8(J, 0x05); EmitRel32(J, Stub);    /* lea rax, [Stub] */
+    Emit8(J, 0xE9); EmitRel32(J, J->EPILOGUE);
+}
+
+void EmitStaleCheck(Jit_Cache *J, int PC, int Refund){    /* eax != 0: a block was overwritten */
+    unsigned char *Skip;
+
+    Emit8(J, 0x85); Emit8(J, 0xC0);       /* test eax, eax */
+    Emit8(J, 0x74); Skip = J->PTR++;  /* jz over the exit */
+    EmitExit(J, PC, Refund);
+    *Skip = (unsigned char)(J->PTR - Skip - 1);
+}
+
+void EmitIndirect(Jit_Cache *J){    /* eax = target PC: store it, follow J->ENTRY */
+    EmitState(J, 0x89, EAX, JIT_PC);
+    Emit8(J, 0x49); Emit8(J, 0x8B); Emit8(J, 0x4C); Emit8(J, 0xC5); Emit8(J, 0x00);  /* mov rcx, [r13+rax*8] */
+    Emit8(J, 0x48); Emit8(J, 0x85); Emit8(J, 0xC9);                          /* test rcx, rcx */
+    Emit8(J, 0x74); Emit8(J, 0x02);                                       /* jz +2 */
+    Emit8(J, 0xFF); Emit8(J, 0xE1);                                       /* jmp rcx */
+    Emit8(J, 0x31); Emit8(J, 0xC0);                                       /* xor eax, eax */
+    Emit8(J, 0xE9); EmitRel32(J, J->EPILOGUE);
+}
+
+/* Called from native code */
+
+int JitStore(Jit_State *S, int Addr, int Value){
+    WriteMemory(S->M, Addr, Value);
+    return S->M->JIT_STALE || S->M->EVENTS.DIRTY;
+}
+
+void JitPush(Jit_State *S, int R7, int Target){
+    PUSH(S->M, R7, Target);
+}
+
+int JitRet(Jit_State *S){
+    if (!IsEmpty(S->M))
+        S->REGS[7] = POP(S->M);
+    return S->REGS[7];
+}
+
+int JitLoad(Jit_State *S, int Addr){
+    return ReadDevice(S->M, Addr);
+}
+
+int JitTrap(Jit_State *S, int Vector, int Next){    /* returns the next PC */
+    if (!TrapService(S->M, Vector, &S->REGS[0]))
+        return 0x0000;      /* Halt */
+    S->REGS[7] = Next;
+    return Next;
+}
+
+int JitInit(Machine *M){
+    Jit_Cache *J = M->JIT;
+
+    if (J == NULL) {
+        J = M->JIT = calloc(1, sizeof(Jit_Cache));
+        if (J == NULL) {
+            printf("Warning: can't allocate JIT tables, interpreting instead\n\n");
+            return FALSE;
+        }
+    }
+    if (J->BUFFER != NULL || J->FAILED)
+        return J->BUFFER != NULL;
+
+    J->BUFFER = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (J->BUFFER == MAP_FAILED) {
+        J->BUFFER = NULL;
+        J->FAILED = TRUE;
+        printf("Warning: can't map JIT buffer, interpreting instead\n\n");
+        return FALSE;
+    }
+
+    /* Trampoline: save callee-saved registers, load the pointers, jump */
+    J->PTR = J->BUFFER;
+    Emit8(J, 0x53);                            /* push rbx */
+    Emit8(J, 0x41); Emit8(J, 0x54);               /* push r12 */
+    Emit8(J, 0x41); Emit8(J, 0x55);               /* push r13 */
+    Emit8(J, 0x48); Emit8(J, 0x89); Emit8(J, 0xFB);  /* mov rbx, rdi */
+    Emit8(J, 0x49); Emit8(J, 0x89); Emit8(J, 0xF4);  /* mov r12, rsi */
+    Emit8(J, 0x49); Emit8(J, 0x89); Emit8(J, 0xD5);  /* mov r13, rdx */
+    Emit8(J, 0xFF); Emit8(J, 0xE1);               /* jmp rcx */
+    J->EPILOGUE = J->PTR;
+    Emit8(J, 0x41); Emit8(J, 0x5D);               /* pop r13 */
+    Emit8(J, 0x41); Emit8(J, 0x5C);               /* pop r12 */
+    Emit8(J, 0x5B);                            /* pop rbx */
+    Emit8(J, 0xC3);                            /* ret */
+    J->BLOCKS = J->PTR;
+
+    JitFlush(M);
+    return TRUE;
+}
+
+void *JitCompile(Machine *M, int Start){
+    Jit_Cache *J = M->JIT;
+    int PC = Start, Length = 0, Done = FALSE;
+    unsigned char *Bail = J->PTR, *Entry, *Left;
+    Decoded_Instruction *D;
+
+    if (Start == 0x0000)    /* halt */
+        return NULL;
+
+    /* Count the block first: its length is charged up front. Blocks
+       never wrap past 0xFFFF, so every translated word is in one range */
+    while (!Done && Length < JIT_MAX_BLOCK && PC < WORDS_IN_MEM) {
+        D = &M->DECODE_CACHE[PC];
+        if (D->Handler == NULL)
+            Decode(M->MEMORY[PC], D);
+        if (D->Op == OP_RTI || D->Op == OP_ILLEGAL)
+            break;          /* left to process_instruction() */
+        Done = D->Op == OP_BR || D->Op == OP_JMP || D->Op == OP_JSR
+            || D->Op == OP_JSRR || D->Op == OP_TRAP;
+        Length++;
+        PC++;
+    }
+    if (Length == 0)
+        return NULL;
+
+    /* Bail: not enough budget, give the block back to RunJit() */
+    EmitExit(J, Start, 0);
+
+    /* Entry: cmp qword [rbx+Left], Length ; jl Bail ; sub ... */
+    Entry = J->PTR;
+    Emit8(J, 0x48); Emit8(J, 0x81); Emit8(J, 0x7B); Emit8(J, JIT_LEFT); Emit32(J, Length);
+    Emit8(J, 0x0F); Emit8(J, 0x8C); EmitRel32(J, Bail);
+    Emit8(J, 0x48); Emit8(J, 0x81); Emit8(J, 0x6B); Emit8(J, JIT_LEFT); Emit32(J, Length);
+
+    for (PC = Start; PC < Start + Length; PC++) {
+        int Next = Low16bits(PC + 1), Refund = Start + Length - (PC + 1);
+        D = &M->DECODE_CACHE[PC];
+        M->JIT_CODE[PC] = TRUE;
+
+        switch (D->Op) {
+            case OP_ADD:
+                EmitState(J, 0x8B, EAX, JIT_REG(D->SR1));      /* mov eax, SR1 */
+                EmitState(J, 0x03, EAX, JIT_REG(D->SR2));      /* add eax, SR2 */
+                EmitSetCC(J, D->DR);
+                break;
+
+            case OP_ADDI:
+                EmitState(J, 0x8B, EAX, JIT_REG(D->SR1));
+                Emit8(J, 0x05); Emit32(J, D->Imm);                /* add eax, imm */
+                EmitSetCC(J, D->DR);
+                break;
+
+            case OP_AND:
+                EmitState(J, 0x8B, EAX, JIT_REG(D->SR1));
+                EmitState(J, 0x23, EAX, JIT_REG(D->SR2));      /* and eax, SR2 */
+                EmitResult(J, D->DR);
+                break;
+
+            case OP_ANDI:
+                EmitState(J, 0x8B, EAX, JIT_REG(D->SR1));
+                Emit8(J, 0x25); Emit32(J, D->Imm);                /* and eax, imm */
+                EmitResult(J, D->DR);
+                break;
+
+            case OP_NOT:
+                EmitState(J, 0x8B, EAX, JIT_REG(D->SR1));
+                Emit8(J, 0xF7); Emit8(J, 0xD0);                   /* not eax */
+                EmitSetCC(J, D->DR);
+                break;
+
+            case OP_LEA:                                    /* mov REGS[DR], imm */
+                Emit8(J, 0xC7); Emit8(J, 0x43); Emit8(J, JIT_REG(D->DR));
+                Emit32(J, Low16bits(Next + D->Imm));
+                break;
+
+            case OP_LD:
+                EmitLoadAt(J, Low16bits(Next + D->Imm));
+                EmitResult(J, D->DR);
+                break;
+
+            case OP_LDI:
+                EmitLoadAt(J, Low16bits(Next + D->Imm));
+                EmitLoad(J);
+                EmitResult(J, D->DR);
+                break;
+
+            case OP_LDR:
+                EmitState(J, 0x8B, EAX, JIT_REG(D->SR1));
+                Emit8(J, 0x05); Emit32(J, D->Imm);
+                Emit8(J, 0x0F); Emit8(J, 0xB7); Emit8(J, 0xC0);                 /* movzx eax, ax */
+                EmitLoad(J);
+                EmitResult(J, D->DR);
+                break;
+
+            case OP_ST:
+                Emit8(J, 0x48); Emit8(J, 0x89); Emit8(J, 0xDF);         /* mov rdi, rbx */
+                Emit8(J, 0xBE); Emit32(J, Low16bits(Next + D->Imm));    /* mov esi, Addr */
+                EmitState(J, 0x8B, EDX, JIT_REG(D->DR));
+                EmitCall(J, JitStore);
+                EmitStaleCheck(J, Next, Refund);
+                break;
+
+            case OP_STI:
+                EmitLoadAt(J, Low16bits(Next + D->Imm));
+                Emit8(J, 0x89); Emit8(J, 0xC6);                                 /* mov esi, eax */
+                Emit8(J, 0x48); Emit8(J, 0x89); Emit8(J, 0xDF);
+                EmitState(J, 0x8B, EDX, JIT_REG(D->DR));
+                EmitCall(J, JitStore);
+                EmitStaleCheck(J, Next, Refund);
+                break;
+
+            case OP_STR:
+                Emit8(J, 0x48); Emit8(J, 0x89); Emit8(J, 0xDF);
+                EmitState(J, 0x8B, ESI, JIT_REG(D->SR1));
+                Emit8(J, 0x81); Emit8(J, 0xC6); Emit32(J, D->Imm);              /* add esi, imm */
+                Emit8(J, 0x0F); Emit8(J, 0xB7); Emit8(J, 0xF6);                 /* movzx esi, si */
+                EmitState(J, 0x8B, EDX, JIT_REG(D->DR));
+                EmitCall(J, JitStore);
+                EmitStaleCheck(J, Next, Refund);
+                break;
+
+            case OP_BR:
+                if (D->DR == 0) {           /* never taken */
+                    EmitChainExit(J, Next);
+                    break;
+                }
+                if (D->DR != 7) {           /* jcc on the sign-extended result */
+                    static const unsigned char Jcc[8] = {
+                        0, 0x8F, 0x84, 0x89, 0x88, 0x85, 0x8E, 0
+                    };  /* p: jg, z: je, zp: jns, n: js, np: jne, nz: jle */
+                    Emit8(J, 0x0F); Emit8(J, 0xBF); Emit8(J, 0x43); Emit8(J, JIT_RESULT);  /* movsx eax, word */
+                    Emit8(J, 0x85); Emit8(J, 0xC0);
+                    Emit8(J, 0x0F); Emit8(J, Jcc[D->DR] ^ 1);     /* inverted: skip the taken exit */
+                    Left = J->PTR;
+                    Emit32(J, 0);
+                    EmitChainExit(J, Low16bits(Next + D->Imm));
+                    Emit32At(Left, (unsigned int)(J->PTR - (Left + 4)));
+                    EmitChainExit(J, Next);
+                }
+                else
+                    EmitChainExit(J, Low16bits(Next + D->Imm));
+                break;
+
+            case OP_JMP:
+                if (D->SR1 == 7) {          /* RET may pop the save stack */
+                    Emit8(J, 0x48); Emit8(J, 0x89); Emit8(J, 0xDF);          /* mov rdi, rbx */
+                    EmitCall(J, JitRet);
+                }
+                else
+                    EmitState(J, 0x8B, EAX, JIT_REG(D->SR1));
+                EmitIndirect(J);
+                break;
+
+            case OP_JSR:
+                Emit8(J, 0xC7); Emit8(J, 0x43); Emit8(J, JIT_REG(7)); Emit32(J, Next);
+                Emit8(J, 0x48); Emit8(J, 0x89); Emit8(J, 0xDF);
+                Emit8(J, 0xBE); Emit32(J, Next);                          /* mov esi, R7 */
+                Emit8(J, 0xBA); Emit32(J, Low16bits(Next + D->Imm));     /* mov edx, target */
+                EmitCall(J, JitPush);
+                EmitChainExit(J, Low16bits(Next + D->Imm));
+                break;
+
+            case OP_JSRR:
+                Emit8(J, 0xC7); Emit8(J, 0x43); Emit8(J, JIT_REG(7)); Emit32(J, Next);
+                Emit8(J, 0x48); Emit8(J, 0x89); Emit8(J, 0xDF);
+                Emit8(J, 0xBE); Emit32(J, Next);
+                EmitState(J, 0x8B, EDX, JIT_REG(D->SR1));              /* BaseR, after R7 */
+                EmitCall(J, JitPush);
+                EmitState(J, 0x8B, EAX, JIT_REG(D->SR1));
+                EmitState(J, 0x89, EAX, JIT_PC);
+                EmitIndirect(J);
+                break;
+
+            case OP_TRAP:
+                Emit8(J, 0x48); Emit8(J, 0x89); Emit8(J, 0xDF);          /* mov rdi, rbx */
+                Emit8(J, 0xBE); Emit32(J, D->Raw & 0x00FF);               /* mov esi, vector */
+                Emit8(J, 0xBA); Emit32(J, Next);                          /* mov edx, Next */
+                EmitCall(J, JitTrap);
+                EmitIndirect(J);
+                break;
+
+            default:
+                break;
+        }
+    }
+    if (!Done)
+        EmitChainExit(J, Low16bits(Start + Length));
+    EmitDeviceLoads(J);
+
+    J->ENTRY[Start] = Entry;
+    J->LENGTH[Start] = Length;
+    J->STARTS[J->BLOCK_COUNT++] = Start;
+    return Entry;
+}
+
+void JitFlush(Machine *M){     /* forget every block, cheap when there are few */
+    Jit_Cache *J = M->JIT;
+    int Start;
+
+    M->JIT_STALE = FALSE;
+    if (J == NULL)
+        return;
+
+    while (J->BLOCK_COUNT > 0) {
+        Start = J->STARTS[--J->BLOCK_COUNT];
+        J->ENTRY[Start] = NULL;
+        memset(&M->JIT_CODE[Start], 0, J->LENGTH[Start]);
+    }
+    J->PTR = J->BLOCKS;
+}
+
+void JitFree(Machine *M){
+    if (M->JIT != NULL && M->JIT->BUFFER != NULL)
+        munmap(M->JIT->BUFFER, JIT_BUFFER_SIZE);
+    free(M->JIT);
+    M->JIT = NULL;
+}
+
+void JitPatch(unsigned char *Stub, void *Block){   /* stub -> jmp Block */
+    unsigned int Rel = (unsigned int)((unsigned char *)Block - (Stub + 5));
+
+    Stub[0] = 0xE9;
+    memcpy(Stub + 1, &Rel, 4);
+}
+
+#else   /* !JIT_AVAILABLE */
+
+int JitInit(Machine *M){
+    return FALSE;
+}
+
+void JitFlush(Machine *M){
+    memset(M->JIT_CODE, 0, sizeof(M->JIT_CODE));
+    M->JIT_STALE = FALSE;
+}
+
+void JitFree(Machine *M){
+}
+
+#endif
+
+long long RunJit(Machine *M, long long Budget){
+    Jit_State S;
+    unsigned char *Stub = NULL;
+    void *Block;
+    int Native = JitInit(M), k;
+#if defined(JIT_AVAILABLE)
+    Jit_Cache *J = M->JIT;
+#endif
+
+    for (k = 0; k < LC_3_REGS; k++)
+        S.REGS[k] = M->CURRENT_LATCHES.REGS[k];
+    S.PC = M->CURRENT_LATCHES.PC;
+    S.Result = PackCC(M);
+    S.Left = Budget;
+    S.M = M;
+
+    while (S.Left > 0 && S.PC != 0x0000 && !M->EVENTS.DIRTY) {
+        Block = NULL;
+#if defined(JIT_AVAILABLE)
+        if (Native) {
+            if (M->JIT_STALE || J->PTR + JIT_MAX_BLOCK_BYTES > J->BUFFER + JIT_BUFFER_SIZE) {
+                JitFlush(M);
+                Stub = NULL;
+            }
+            Block = J->ENTRY[S.PC];
+            if (Block == NULL)
+                Block = JitCompile(M, S.PC);
+        }
+        if (Block != NULL && J->LENGTH[S.PC] <= S.Left) {
+            if (Stub != NULL)
+                JitPatch(Stub, Block);
+            Stub = ((Jit_Enter)(void *)J->BUFFER)(&S, M->MEMORY, J->ENTRY, Block);
+            continue;
+        }
+#endif
+        /* One instruction through the interpreter */
+        for (k = 0; k < LC_3_REGS; k++)
+            M->CURRENT_LATCHES.REGS[k] = S.REGS[k];
+        M->CURRENT_LATCHES.PC = S.PC;
+        UnpackCC(M, S.Result);
+        process_instruction(M);
+        M->CURRENT_LATCHES = M->NEXT_LATCHES;
+        for (k = 0; k < LC_3_REGS; k++)
+            S.REGS[k] = M->CURRENT_LATCHES.REGS[k];
+        S.PC = M->CURRENT_LATCHES.PC;
+        S.Result = PackCC(M);
+        S.Left--;
+        Stub = NULL;
+    }
+
+    for (k = 0; k < LC_3_REGS; k++)
+        M->CURRENT_LATCHES.REGS[k] = S.REGS[k];
+    M->CURRENT_LATCHES.PC = S.PC;
+    UnpackCC(M, S.Result);
+    M->NEXT_LATCHES = M->CURRENT_LATCHES;
+    M->INSTRUCTION_COUNT += Budget - S.Left;
+
+    return Budget - S.Left;
+}
+
+/* Lockstep engine */
+/*
+ * Runs up to LOCKSTEP_LANES machines loaded with the same program as
+ * one. Their registers are kept lane by lane in vectors (struct of
+ * arrays), and every lane at the current PC executes the instruction
+ * together: with GCC vector extensions, one SSE2 or AVX2 operation per
+ * register update. Where a BR or JMP sends lanes different ways, the
+ * lanes at the lowest PC run next, masked, while the others wait; the
+ * stragglers catch up and the lanes merge again after an if/else or a
+ * loop. Loads, stores and TRAPs go lane by lane to each lane's own
+ * memory. Each lane executes exactly its own instruction stream.
+ *
+ * A lane leaves for good, written back to its machine, when it halts,
+ * uses up its budget, reaches RTI or 1101, or leaves events for
+ * execute() (a store to a device register). The caller finishes the
+ * ones still running on a scalar engine.
+ */
+#if defined(__GNUC__)
+
+typedef uint16_t Lane_Vector __attribute__((vector_size(2 * LOCKSTEP_LANES)));
+typedef int16_t Lane_Mask __attribute__((vector_size(2 * LOCKSTEP_LANES)));
+
+#define LANE_BLEND(Mask, A, B) \
+    (((A) & (Lane_Vector)(Mask)) | ((B) & ~(Lane_Vector)(Mask)))
+
+/* Masks go between vectors and bit l = lane l; by pointer, as vectors this wide change the ABI */
+#define LANE_BITS(Mask) LaneBits((Lane_Mask[]){ Mask })
+#define LANE_MASK(Bits) LaneMask(Bits, (Lane_Mask[1]){{0}})
+
+typedef struct Lockstep_Struct{
+    Lane_Vector R[LC_3_REGS];   /* R[r][lane] */
+    Lane_Vector RESULT;         /* condition codes, as in RunThreaded() */
+    Lane_Vector PC;
+    Lane_Vector STEPS;          /* executed since LockstepFlush() */
+    int LIVE;                   /* lanes still in the group */
+    Machine **LANES;
+    long long *EXECUTED;
+    uint64_t SHARED[WORDS_IN_MEM / 64];     /* word equal in every lane */
+} Lockstep;
+
+static const uint16_t Lane_Bit[16] __attribute__((aligned(32))) = {   /* lane l: 1 << l */
+    0x0001, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0040, 0x0080,
+    0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x2000, 0x4000, 0x8000
+};
+#define LANE_BIT (*(const Lane_Vector *)Lane_Bit)
+
+int LaneBits(const Lane_Mask *Mask){
+    uint64_t Words[sizeof(Lane_Mask) / 8], Bits = 0;
+    Lane_Vector Lane = LANE_BIT & (Lane_Vector)*Mask;
+    int k;
+
+    memcpy(Words, &Lane, sizeof(Lane));
+    for (k = 0; k < (int)(sizeof(Lane_Mask) / 8); k++)
+        Bits |= Words[k];
+    Bits |= Bits >> 32;
+    Bits |= Bits >> 16;
+    return (int)(Bits & 0xFFFF);
+}
+
+Lane_Mask *LaneMask(int Bits, Lane_Mask *Mask){
+    *Mask = (Lane_Mask)((LANE_BIT & (uint16_t)Bits) != 0);
+    return Mask;
+}
+
+void LockstepFlush(Lockstep *S, int Lane){
+    S->LANES[Lane]->INSTRUCTION_COUNT += S->STEPS[Lane];
+    S->EXECUTED[Lane] += S->STEPS[Lane];
+    S->STEPS[Lane] = 0;
+}
+
+void LockstepRetire(Lockstep *S, int Lane){
+    Machine *M = S->LANES[Lane];
+    int k;
+
+    LockstepFlush(S, Lane);
+    for (k = 0; k < LC_3_REGS; k++)
+        M->CURRENT_LATCHES.REGS[k] = S->R[k][Lane];
+    M->CURRENT_LATCHES.PC = S->PC[Lane];
+    UnpackCC(M, S->RESULT[Lane]);
+    M->NEXT_LATCHES = M->CURRENT_LATCHES;
+    S->LIVE &= ~(1 << Lane);
+}
+
+long long RunLockstep(Machine *Lanes[], int Count, long long Budget, long long Executed[]){
+    Lockstep Group, *S = &Group;        /* on the stack, which keeps vectors aligned */
+    Lane_Mask Exec = {0}, Taken, Sign;
+    Lane_Vector Next, Target;
+    Decoded_Instruction *D;
+    Machine *M;
+    long long Slack = 0, Total = 0;
+    int Pc = 0, Leader = 0, Run = 0, Leave, Split, m, l, k, a, Addr, R0;
+
+    assert(Count <= LOCKSTEP_LANES);
+    memset(S, 0, sizeof(Lockstep));
+    S->LANES = Lanes;
+    S->EXECUTED = Executed;
+    for (l = 0; l < Count; l++) {
+        for (k = 0; k < LC_3_REGS; k++)
+            S->R[k][l] = Lanes[l]->CURRENT_LATCHES.REGS[k];
+        S->RESULT[l] = PackCC(Lanes[l]);
+        S->PC[l] = Lanes[l]->CURRENT_LATCHES.PC;
+        Executed[l] = 0;
+        if (S->PC[l] != 0x0000 && !Lanes[l]->EVENTS.ARMED && !Lanes[l]->EVENTS.DIRTY)
+            S->LIVE |= 1 << l;
+    }
+
+    /* Words the same in every lane need no check when fetched */
+    for (a = 0; a < WORDS_IN_MEM; a += 64) {
+        S->SHARED[a >> 6] = ~0ULL;
+        for (l = 1; l < Count; l++)
+            if (memcmp(&Lanes[0]->MEMORY[a], &Lanes[l]->MEMORY[a],
+                       64 * sizeof(Lanes[0]->MEMORY[0])) != 0)
+                for (k = a; k < a + 64; k++)
+                    if (Lanes[0]->MEMORY[k] != Lanes[l]->MEMORY[k])
+                        BIT_CLEAR(S->SHARED, k);
+    }
+
+    /* Run is the lanes executing this step; all of S->LIVE while converged */
+    while (S->LIVE) {
+        /* STEPS is 16 bits: account for it before any lane could wrap it */
+        if (Slack == 0) {
+            Slack = 0xFFFF;
+            for (l = 0; l < Count; l++) {
+                if (!(S->LIVE >> l & 1))
+                    continue;
+                LockstepFlush(S, l);
+                if (Executed[l] >= Budget)
+                    LockstepRetire(S, l);
+                else if (Budget - Executed[l] < Slack)
+                    Slack = Budget - Executed[l];
+            }
+            Run = 0;
+            continue;
+        }
+
+        /* Diverged: run the lanes at the lowest PC */
+        if (Run != S->LIVE) {
+            Pc = WORDS_IN_MEM;
+            for (m = S->LIVE; m; m &= m - 1) {
+                l = __builtin_ctz(m);
+                Pc = S->PC[l] < Pc ? S->PC[l] : Pc;
+            }
+            Run = S->LIVE & LANE_BITS((Lane_Mask)(S->PC == (Lane_Vector){0} + (uint16_t)Pc));
+            Leader = __builtin_ctz(Run);
+            Exec = *LANE_MASK(Run);
+        }
+        M = Lanes[Leader];
+        D = &M->DECODE_CACHE[Pc];
+        if (D->Handler == NULL)
+            Decode(M->MEMORY[Pc], D);
+        if (!BIT_TEST(S->SHARED, Pc)) {
+            for (m = Run; m; m &= m - 1) {
+                l = __builtin_ctz(m);
+                if (Lanes[l]->MEMORY[Pc] != D->Raw)
+                    Run &= ~(1 << l);   /* its own word: it runs on a later step */
+            }
+            Exec = *LANE_MASK(Run);
+        }
+
+        Next = (Lane_Vector){0} + (uint16_t)(Pc + 1);
+        Target = Next;
+        Leave = 0;
+        Split = FALSE;      /* the lanes may go to different PCs */
+        switch (D->Op) {
+            case OP_ADD:
+                S->R[D->DR] = LANE_BLEND(Exec, S->R[D->SR1] + S->R[D->SR2], S->R[D->DR]);
+                S->RESULT = LANE_BLEND(Exec, S->R[D->DR], S->RESULT);
+                break;
+            case OP_ADDI:
+                S->R[D->DR] = LANE_BLEND(Exec, S->R[D->SR1] + (uint16_t)D->Imm, S->R[D->DR]);
+                S->RESULT = LANE_BLEND(Exec, S->R[D->DR], S->RESULT);
+                break;
+            case OP_AND:
+                S->R[D->DR] = LANE_BLEND(Exec, S->R[D->SR1] & S->R[D->SR2], S->R[D->DR]);
+                S->RESULT = LANE_BLEND(Exec, S->R[D->DR], S->RESULT);
+                break;
+            case OP_ANDI:
+                S->R[D->DR] = LANE_BLEND(Exec, S->R[D->SR1] & (uint16_t)D->Imm, S->R[D->DR]);
+                S->RESULT = LANE_BLEND(Exec, S->R[D->DR], S->RESULT);
+                break;
+            case OP_NOT:
+                S->R[D->DR] = LANE_BLEND(Exec, ~S->R[D->SR1], S->R[D->DR]);
+                S->RESULT = LANE_BLEND(Exec, S->R[D->DR], S->RESULT);
+                break;
+            case OP_LEA:
+                S->R[D->DR] = LANE_BLEND(Exec, Next + (uint16_t)D->Imm, S->R[D->DR]);
+                break;
+            case OP_BR:
+                Sign = (Lane_Mask)S->RESULT;
+                Taken = (Lane_Mask){0};
+                if (D->DR & 4)
+                    Taken |= Sign < 0;
+                if (D->DR & 2)
+                    Taken |= Sign == 0;
+                if (D->DR & 1)
+                    Taken |= Sign > 0;
+                k = LANE_BITS(Taken) & Run;
+                if (k == Run)
+                    Target = Next + (uint16_t)D->Imm;
+                else if (k != 0) {
+                    Target = LANE_BLEND(Taken, Next + (uint16_t)D->Imm, Next);
+                    Split = TRUE;
+                }
+                break;
+            case OP_JMP:
+                if (D->SR1 == 7)        /* RET */
+                    for (m = Run; m; m &= m - 1) {
+                        l = __builtin_ctz(m);
+                        if (!IsEmpty(Lanes[l]))
+                            S->R[7][l] = POP(Lanes[l]);
+                    }
+                Target = S->R[D->SR1];
+                Split = TRUE;
+                break;
+            case OP_JSR:
+            case OP_JSRR:
+                S->R[7] = LANE_BLEND(Exec, Next, S->R[7]);
+                for (m = Run; m; m &= m - 1) {
+                    l = __builtin_ctz(m);
+                    PUSH(Lanes[l], Pc + 1, D->Op == OP_JSR ? Low16bits(Pc + 1 + D->Imm)
+                                                           : S->R[D->SR1][l]);
+                }
+                if (D->Op == OP_JSR)
+                    Target = Next + (uint16_t)D->Imm;
+                else {
+                    Target = S->R[D->SR1];
+                    Split = TRUE;
+                }
+                break;
+            case OP_LD:
+            case OP_LDI:
+            case OP_LDR:
+                for (m = Run; m; m &= m - 1) {
+                    l = __builtin_ctz(m);
+                    Addr = D->Op == OP_LDR ? Low16bits(S->R[D->SR1][l] + D->Imm)
+                                           : Low16bits(Pc + 1 + D->Imm);
+                    if (D->Op == OP_LDI)
+                        Addr = ReadMemory(Lanes[l], Addr);
+                    S->RESULT[l] = S->R[D->DR][l] = ReadMemory(Lanes[l], Addr);
+                }
+                break;
+            case OP_ST:
+            case OP_STI:
+            case OP_STR:
+                for (m = Run; m; m &= m - 1) {
+                    l = __builtin_ctz(m);
+                    Addr = D->Op == OP_STR ? Low16bits(S->R[D->SR1][l] + D->Imm)
+                                           : Low16bits(Pc + 1 + D->Imm);
+                    if (D->Op == OP_STI)
+                        Addr = ReadMemory(Lanes[l], Addr);
+                    WriteMemory(Lanes[l], Addr, S->R[D->DR][l]);
+                    BIT_CLEAR(S->SHARED, Addr);
+                    if (Lanes[l]->EVENTS.DIRTY)
+                        Leave |= 1 << l;
+                }
+                break;
+            case OP_TRAP:
+                for (m = Run; m; m &= m - 1) {
+                    l = __builtin_ctz(m);
+                    R0 = S->R[0][l];
+                    if (TrapService(Lanes[l], D->Raw & 0x00FF, &R0))
+                        S->R[7][l] = Pc + 1;
+                    else {
+                        Target[l] = 0x0000;     /* Halt */
+                        Split = TRUE;
+                    }
+                    S->R[0][l] = R0;
+                    if (Lanes[l]->EVENTS.DIRTY)
+                        Leave |= 1 << l;
+                }
+                break;
+            default:
+                /* RTI and 1101 switch stacks: leave them to the scalar engine */
+                for (m = Run; m; m &= m - 1)
+                    LockstepRetire(S, __builtin_ctz(m));
+                Run = 0;
+                continue;
+        }
+
+        /* Count the step and move the lanes on; a lane at 0x0000 has halted */
+        S->STEPS -= (Lane_Vector)Exec;
+        Slack--;
+        S->PC = LANE_BLEND(Exec, Target, S->PC);
+        Pc = Target[Leader];
+        if (Split) {
+            Leave |= Run & LANE_BITS((Lane_Mask)(Target == (Lane_Vector){0}));
+            if (Run & LANE_BITS((Lane_Mask)(Target != (Lane_Vector){0} + (uint16_t)Pc)))
+                Run = 0;
+        }
+        else if (Pc == 0x0000)
+            Leave |= Run;
+        if (Leave) {
+            for (m = Leave; m; m &= m - 1)
+                LockstepRetire(S, __builtin_ctz(m));
+            Run = 0;
+        }
+    }
+
+    for (l = 0; l < Count; l++)
+        Total += Executed[l];
+    return Total;
+}
+
+#else   /* !__GNUC__ */
+
+long long RunLockstep(Machine *Lanes[], int Count, long long Budget, long long Executed[]){
+    /* No vector types: leave every lane to the scalar engine */
+    int l;
+
+    for (l = 0; l < Count; l++)
+        Executed[l] = 0;
+    return 0;
+}
+
+#endif
+
+/* Ahead-of-time translation */
+/*
+ * AotTranslate() writes the program reachable from the current PC out
+ * as a standalone C file. Starting from the entry, it follows every
+ * static edge (BR targets and fall-throughs, JSR targets, the return
+ * address after JSR, JSRR and the TRAPs that come back) to find the
+ * instructions reachable and the leaders that start basic blocks.
+ * All the blocks become one function, run(), with a label per block,
+ * the LC-3 registers in locals and direct gotos for static branches.
+ * JMP, RET and JSRR go through dispatch: a table of label addresses
+ * (a switch without GCC) indexed by the target. A target that is not
+ * a leader, or a block a store has since overwritten, goes to
+ * interpret(), a plain interpreter carried in the file, which runs
+ * until it reaches a current block again; RTI and opcode 1101 take
+ * one step() of it.
+ *
+ * The file has the memory image, the registers, the condition codes,
+ * the PSR, the instruction count and the R7 save stack as they are
+ * now, and the native TRAPs and console registers on stdin and
+ * stdout. Interrupts and the timer are not modelled: enabling either
+ * makes the translated program stop with status 3.
+ */
+#define AOT_REACHED 1
+#define AOT_LEADER  2
+#define AOT_TARGET  4       /* a static goto jumps here: it needs a B_ label */
+#define AOT_MAX_BLOCKS 4096 /* past this C compilers slow down badly; the rest is interpreted */
+
+typedef struct Aot_State_Struct{
+
+    Machine *M;
+    FILE *OUT;              /* NULL on the first pass, which only sets AOT_TARGET */
+    unsigned char FLAGS[WORDS_IN_MEM];
+    int BLOCKS, INSTRUCTIONS;
+    int LOW, HIGH;          /* the lowest and highest leader */
+} Aot_State;
+
+/* Copied into every translated file ahead of run() */
+const char AOT_RUNTIME[] =
+    "static uint32_t OWNER[65536];       /* leader + 1 of the block holding each word, 0 if none */\n"
+    "static unsigned char STALE[65536];  /* a store changed the block that starts here */\n"
+    "static uint32_t *RETURNS;           /* the R7 save stack: subroutine << 16 | return address */\n"
+    "static int DEPTH, CAPACITY;\n"
+    "static uint16_t KEY;                /* KBDR */\n"
+    "\n"
+    "static void unsupported(const char *what) {\n"
+    "    fflush(stdout);\n"
+    "    fprintf(stderr, \"aot: %s is not supported (PC x%04X)\\n\", what, PC);\n"
+    "    exit(3);\n"
+    "}\n"
+    "\n"
+    "static void push(unsigned r7, unsigned target) {\n"
+    "    if (DEPTH == CAPACITY && CAPACITY == 1 << 22) {     /* forget the oldest half */\n"
+    "        memmove(RETURNS, RETURNS + CAPACITY / 2, CAPACITY / 2 * sizeof(uint32_t));\n"
+    "        DEPTH -= CAPACITY / 2;\n"
+    "    }\n"
+    "    else if (DEPTH == CAPACITY) {\n"
+    "        CAPACITY = CAPACITY ? 2 * CAPACITY : 256;\n"
+    "        if ((RETURNS = realloc(RETURNS, CAPACITY * sizeof(uint32_t))) == NULL) {\n"
+    "            perror(\"aot\");\n"
+    "            exit(1);\n"
+    "        }\n"
+    "    }\n"
+    "    RETURNS[DEPTH++] = (uint32_t)target << 16 | r7;\n"
+    "}\n"
+    "\n"
+    "static int get(void) {              /* next input byte, or EOF */\n"
+    "    if (isatty(STDIN_FILENO))\n"
+    "        fflush(stdout);\n"
+    "    return getchar();\n"
+    "}\n"
+    "\n"
+    "static unsigned device_read(unsigned a) {\n"
+    "    int c;\n"
+    "\n"
+    "    switch (a) {\n"
+    "        case 0xFE00:                /* KBSR: a key is waiting */\n"
+    "            if ((c = get()) == EOF)\n"
+    "                return 0;\n"
+    "            ungetc(c, stdin);\n"
+    "            return 0x8000;\n"
+    "        case 0xFE02:                /* KBDR */\n"
+    "            if ((c = get()) != EOF)\n"
+    "                KEY = c & 0xFF;\n"
+    "            return KEY;\n"
+    "        case 0xFE04:                /* DSR */\n"
+    "            return 0x8000;\n"
+    "        case 0xFE06: case 0xFE08: case 0xFE0A:\n"
+    "            return 0;\n"
+    "    }\n"
+    "    return MEM[a];\n"
+    "}\n"
+    "\n"
+    "static int device_write(unsigned a, unsigned v) {   /* 0: a is ordinary memory */\n"
+    "    switch (a) {\n"
+    "        case 0xFE00:\n"
+    "        case 0xFE08:\n"
+    "            if (v & 0x4000)\n"
+    "                unsupported(\"an interrupt\");\n"
+    "            return 1;\n"
+    "        case 0xFE0A:\n"
+    "            if (v != 0)\n"
+    "                unsupported(\"the timer\");\n"
+    "            return 1;\n"
+    "        case 0xFE06:\n"
+    "            putchar(v & 0xFF);\n"
+    "            return 1;\n"
+    "        case 0xFE02: case 0xFE04:\n"
+    "            return 1;\n"
+    "    }\n"
+    "    return 0;\n"
+    "}\n"
+    "\n"
+    "static inline unsigned load(unsigned a) {\n"
+    "    return a >= 0xFE00 ? device_read(a) : MEM[a];\n"
+    "}\n"
+    "\n"
+    "static inline int store(unsigned a, unsigned v) {   /* nonzero if a held translated code */\n"
+    "    if (a >= 0xFE00 && device_write(a, v))\n"
+    "        return 0;\n"
+    "    MEM[a] = v;\n"
+    "    if (OWNER[a] == 0)\n"
+    "        return 0;\n"
+    "    STALE[OWNER[a] - 1] = 1;\n"
+    "    return 1;\n"
+    "}\n"
+    "\n"
+    "static int trap(unsigned vector) {  /* on R[0]; 0 if the machine halts */\n"
+    "    const char *prompt = \"Input a character> \";\n"
+    "    unsigned a;\n"
+    "    int c;\n"
+    "\n"
+    "    switch (vector) {\n"
+    "        case 0x20:                  /* GETC */\n"
+    "            if ((c = get()) == EOF)\n"
+    "                return 0;\n"
+    "            R[0] = c & 0xFF;\n"
+    "            return 1;\n"
+    "        case 0x21:                  /* OUT */\n"
+    "            putchar(R[0] & 0xFF);\n"
+    "            return 1;\n"
+    "        case 0x22:                  /* PUTS */\n"
+    "            for (a = R[0]; MEM[a] != 0; a = (a + 1) & 0xFFFF)\n"
+    "                putchar(MEM[a] & 0xFF);\n"
+    "            return 1;\n"
+    "        case 0x23:                  /* IN */\n"
+    "            fputs(prompt, stdout);\n"
+    "            if ((c = get()) == EOF)\n"
+    "                return 0;\n"
+    "            R[0] = c & 0xFF;\n"
+    "            putchar(R[0]);\n"
+    "            putchar('\\n');\n"
+    "            return 1;\n"
+    "        case 0x24:                  /* PUTSP */\n"
+    "            for (a = R[0]; MEM[a] != 0; a = (a + 1) & 0xFFFF) {\n"
+    "                putchar(MEM[a] & 0xFF);\n"
+    "                if ((MEM[a] >> 8) == 0)\n"
+    "                    break;\n"
+    "                putchar(MEM[a] >> 8);\n"
+    "            }\n"
+    "            return 1;\n"
+    "    }\n"
+    "    return 0;                       /* HALT */\n"
+    "}\n"
+    "\n"
+    "static unsigned sext(unsigned inst, int bits) {\n"
+    "    unsigned sign = 1u << (bits - 1);\n"
+    "\n"
+    "    return (((inst & (2 * sign - 1)) ^ sign) - sign) & 0xFFFF;\n"
+    "}\n"
+    "\n"
+    "static int taken(unsigned nzp, unsigned cc) {\n"
+    "    return ((nzp & 4) && (cc & 0x8000)) || ((nzp & 2) && cc == 0)\n"
+    "           || ((nzp & 1) && cc != 0 && !(cc & 0x8000));\n"
+    "}\n"
+    "\n"
+    "static void setpsr(unsigned psr) {  /* switches stacks on a change of mode */\n"
+    "    if ((psr >> 15) != PRIV) {\n"
+    "        if (psr >> 15) {\n"
+    "            SAVED_SSP = R[6];\n"
+    "            R[6] = SAVED_USP;\n"
+    "        }\n"
+    "        else {\n"
+    "            SAVED_USP = R[6];\n"
+    "            R[6] = SAVED_SSP;\n"
+    "        }\n"
+    "    }\n"
+    "    PRIV = psr >> 15;\n"
+    "    PRIORITY = psr >> 8 & 7;\n"
+    "    CC = psr & 2 ? 0 : psr & 4 ? 0x8000 : 1;\n"
+    "}\n"
+    "\n"
+    "static unsigned getpsr(void) {\n"
+    "    return PRIV << 15 | PRIORITY << 8 | (CC == 0 ? 2 : CC & 0x8000 ? 4 : 1);\n"
+    "}\n"
+    "\n"
+    "static void exception(unsigned vector) {    /* PC is the address after the instruction */\n"
+    "    unsigned psr = getpsr();\n"
+    "\n"
+    "    setpsr(PRIORITY << 8 | (psr & 7));\n"
+    "    R[6]--;\n"
+    "    store(R[6], psr);\n"
+    "    R[6]--;\n"
+    "    store(R[6], PC);\n"
+    "    PC = MEM[0x0100 + vector];\n"
+    "}\n"
+    "\n"
+    "static void step(void) {            /* the instruction at PC */\n"
+    "    unsigned inst = MEM[PC], dr = inst >> 9 & 7, sr1 = inst >> 6 & 7, a;\n"
+    "\n"
+    "    PC++;\n"
+    "    switch (inst >> 12) {\n"
+    "        case 0x1: CC = R[dr] = R[sr1] + (inst & 0x20 ? sext(inst, 5) : R[inst & 7]); break;\n"
+    "        case 0x5: CC = R[dr] = R[sr1] & (inst & 0x20 ? sext(inst, 5) : R[inst & 7]); break;\n"
+    "        case 0x9: CC = R[dr] = ~R[sr1]; break;\n"
+    "        case 0xE: R[dr] = PC + sext(inst, 9); break;\n"
+    "        case 0x0:\n"
+    "            if (taken(dr, CC))\n"
+    "                PC += sext(inst, 9);\n"
+    "            break;\n"
+    "        case 0xC:\n"
+    "            if (sr1 == 7 && DEPTH > 0)\n"
+    "                R[7] = RETURNS[--DEPTH] & 0xFFFF;\n"
+    "            PC = R[sr1];\n"
+    "            break;\n"
+    "        case 0x4:\n"
+    "            R[7] = PC;\n"
+    "            a = inst & 0x800 ? (PC + sext(inst, 11)) & 0xFFFF : R[sr1];\n"
+    "            if (RETURN_STACK)\n"
+    "                push(R[7], a);\n"
+    "            PC = a;\n"
+    "            break;\n"
+    "        case 0x2: CC = R[dr] = load((PC + sext(inst, 9)) & 0xFFFF); break;\n"
+    "        case 0xA: CC = R[dr] = load(load((PC + sext(inst, 9)) & 0xFFFF)); break;\n"
+    "        case 0x6: CC = R[dr] = load((R[sr1] + sext(inst, 6)) & 0xFFFF); break;\n"
+    "        case 0x3: store((PC + sext(inst, 9)) & 0xFFFF, R[dr]); break;\n"
+    "        case 0xB: store(load((PC + sext(inst, 9)) & 0xFFFF), R[dr]); break;\n"
+    "        case 0x7: store((R[sr1] + sext(inst, 6)) & 0xFFFF, R[dr]); break;\n"
+    "        case 0xF:\n"
+    "            if (trap(inst & 0xFF))\n"
+    "                R[7] = PC;\n"
+    "            else\n"
+    "                PC = 0;\n"
+    "            break;\n"
+    "        case 0x8:                   /* RTI */\n"
+    "            if (PRIV) {\n"
+    "                exception(0x00);\n"
+    "                break;\n"
+    "            }\n"
+    "            PC = load(R[6]);\n"
+    "            a = load((R[6] + 1) & 0xFFFF);\n"
+    "            R[6] += 2;\n"
+    "            setpsr(a);\n"
+    "            break;\n"
+    "        default:                    /* 1101 */\n"
+    "            exception(0x01);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static void interpret(void) {\n"
+    "    /* The fallback: run from PC up to a block that is still current, or HALT */\n"
+    "    while (PC != 0 && (OWNER[PC] != PC + 1u || STALE[PC])) {\n"
+    "        COUNT++;\n"
+    "        step();\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "#define SAVE()    (R[0] = r0, R[1] = r1, R[2] = r2, R[3] = r3, R[4] = r4, R[5] = r5, \\\n"
+    "                   R[6] = r6, R[7] = r7, CC = cc, PC = pc, COUNT = count)\n"
+    "#define RESTORE() (r0 = R[0], r1 = R[1], r2 = R[2], r3 = R[3], r4 = R[4], r5 = R[5], \\\n"
+    "                   r6 = R[6], r7 = R[7], cc = CC, pc = PC, count = COUNT)\n";
+
+/* and after it */
+const char AOT_MAIN[] =
+    "\n"
+    "static void rdump(void) {           /* as the simulator's rdump */\n"
+    "    unsigned psr = getpsr();\n"
+    "    int k;\n"
+    "\n"
+    "    printf(\"\\nCurrent register/bus values :\\n-------------------------------------\\n\");\n"
+    "    printf(\"Instruction Count : %lld\\n\", COUNT);\n"
+    "    printf(\"PC                : 0x%.4x\\n\", PC);\n"
+    "    printf(\"CCs: N = %d  Z = %d  P = %d\\n\", psr >> 2 & 1, psr >> 1 & 1, psr & 1);\n"
+    "    printf(\"PSR               : 0x%.4x (%s, priority %d)\\n\", psr,\n"
+    "           PRIV ? \"user\" : \"supervisor\", PRIORITY);\n"
+    "    printf(\"Registers:\\n\");\n"
+    "    for (k = 0; k < 8; k++)\n"
+    "        printf(\"%d: 0x%.4x\\n\", k, R[k]);\n"
+    "    printf(\"\\n\");\n"
+    "}\n"
+    "\n"
+    "int main(int argc, char *argv[]) {\n"
+    "    static char buffer[64 * 1024];\n"
+    "    unsigned a;\n"
+    "    int k;\n"
+    "\n"
+    "    setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));\n"
+    "    for (k = 0; k < (int)(sizeof(BLOCKS) / sizeof(BLOCKS[0])); k++)\n"
+    "        for (a = BLOCKS[k][0]; a < (unsigned)BLOCKS[k][0] + BLOCKS[k][1]; a++)\n"
+    "            OWNER[a] = BLOCKS[k][0] + 1u;\n"
+    "    for (k = 0; k < START_DEPTH; k++)\n"
+    "        push(START_RETURNS[k] & 0xFFFF, START_RETURNS[k] >> 16);\n"
+    "    run();\n"
+    "    if (argc > 1 && strcmp(argv[1], \"--rdump\") == 0)\n"
+    "        rdump();\n"
+    "    return 0;\n"
+    "}\n";
+
+void AotEmit(Aot_State *S, const char *Format, ...){
+    va_list Args;
+
+    if (S->OUT == NULL)
+        return;
+    va_start(Args, Format);
+    vfprintf(S->OUT, Format, Args);
+    va_end(Args);
+}
+
+void AotGoto(Aot_State *S, int Target){
+    /* Go on at Target: straight to its block if it starts one */
+    if (Target == 0x0000)
+        AotEmit(S, "pc = 0; goto halt;");
+    else if (S->FLAGS[Target] & AOT_LEADER) {
+        S->FLAGS[Target] |= AOT_TARGET;
+        AotEmit(S, "goto B_%04x;", Target);
+    }
+    else
+        AotEmit(S, "pc = 0x%04x; goto dispatch;", Target);
+}
+
+int AotEnds(const Decoded_Instruction *D){     /* D is the last of its block */
+    switch (D->Op) {
+        case OP_BR:
+            return D->DR != 0;      /* BR with no nzp (a zero word) is a no-op */
+        case OP_JMP: case OP_JSR: case OP_JSRR:
+        case OP_TRAP: case OP_RTI: case OP_ILLEGAL:
+            return TRUE;
+    }
+    return FALSE;
+}
+
+void AotLeader(Aot_State *S, int PC, int *Work, int *Count){
+    if (PC == 0x0000 || PC >= IO_PAGE)     /* halts, or left to interpret() */
+        return;
+    if (!(S->FLAGS[PC] & AOT_LEADER)) {
+        if (S->BLOCKS == AOT_MAX_BLOCKS)
+            return;
+        S->BLOCKS++;
+    }
+    S->FLAGS[PC] |= AOT_LEADER;
+    if (!(S->FLAGS[PC] & AOT_REACHED))
+        Work[(*Count)++] = PC;
+}
+
+int AotDiscover(Aot_State *S, int Entry){
+    /* Mark what is reachable from Entry by static edges, and the leaders */
+    int *Work = malloc((2 * WORDS_IN_MEM + 1) * sizeof(int)), Count = 0, PC, Next;
+    Decoded_Instruction D;
+
+    if (Work == NULL)
+        return FALSE;
+    AotLeader(S, Entry, Work, &Count);
+    while (Count > 0) {
+        for (PC = Work[--Count]; PC != 0x0000 && PC < IO_PAGE && !(S->FLAGS[PC] & AOT_REACHED);
+             PC = Next) {
+            S->FLAGS[PC] |= AOT_REACHED;
+            Decode(S->M->MEMORY[PC], &D);
+            Next = Low16bits(PC + 1);
+            switch (D.Op) {
+                case OP_BR:
+                    if (D.DR == 0)
+                        break;
+                    AotLeader(S, Low16bits(Next + D.Imm), Work, &Count);
+                    if (D.DR != 7)
+                        AotLeader(S, Next, Work, &Count);
+                    break;
+                case OP_JSR:
+                    AotLeader(S, Low16bits(Next + D.Imm), Work, &Count);
+                    AotLeader(S, Next, Work, &Count);
+                    break;
+                case OP_JSRR:
+                    AotLeader(S, Next, Work, &Count);
+                    break;
+                case OP_TRAP:
+                    if ((D.Raw & 0xFF) >= 0x20 && (D.Raw & 0xFF) <= 0x24)
+                        AotLeader(S, Next, Work, &Count);
+                    break;
+            }
+            if (AotEnds(&D))
+                break;
+        }
+    }
+    free(Work);
+    return TRUE;
+}
+
+void AotInstruction(Aot_State *S, int PC, const Decoded_Instruction *D, int Remaining){
+    static const char *CONDITIONS[8] = {
+        "0", "(int16_t)cc > 0", "cc == 0", "(int16_t)cc >= 0",
+        "(int16_t)cc < 0", "cc != 0", "(int16_t)cc <= 0", "1"
+    };
+    int Next = Low16bits(PC + 1), Addr = Low16bits(Next + D->Imm), Vector = D->Raw & 0xFF;
+    int Stack = S->M->RETURNS.ENABLE;
+    char Pointer[32];
+
+    /* LD and LDI/STI pointers read MEMORY directly unless Addr is a device */
+    snprintf(Pointer, sizeof(Pointer), Addr < IO_PAGE ? "MEM[0x%04x]" : "load(0x%04x)", Addr);
+
+    AotEmit(S, "    /* x%04x %-8s */ ", PC, OP_NAMES[D->Op]);
+    switch (D->Op) {
+        case OP_ADD:
+            AotEmit(S, "r%d = r%d + r%d; cc = r%d;", D->DR, D->SR1, D->SR2, D->DR);
+            break;
+        case OP_ADDI:
+            AotEmit(S, "r%d = r%d + 0x%04x; cc = r%d;", D->DR, D->SR1, D->Imm, D->DR);
+            break;
+        case OP_AND:
+            AotEmit(S, "r%d = r%d & r%d; cc = r%d;", D->DR, D->SR1, D->SR2, D->DR);
+            break;
+        case OP_ANDI:
+            AotEmit(S, "r%d = r%d & 0x%04x; cc = r%d;", D->DR, D->SR1, D->Imm, D->DR);
+            break;
+        case OP_NOT:
+            AotEmit(S, "r%d = ~r%d; cc = r%d;", D->DR, D->SR1, D->DR);
+            break;
+        case OP_LEA:
+            AotEmit(S, "r%d = 0x%04x;", D->DR, Addr);
+            break;
+        case OP_LD:
+            AotEmit(S, "cc = r%d = %s;", D->DR, Pointer);
+            break;
+        case OP_LDI:
+            AotEmit(S, "cc = r%d = load(%s);", D->DR, Pointer);
+            break;
+        case OP_LDR:
+            AotEmit(S, "cc = r%d = load((uint16_t)(r%d + 0x%04x));", D->DR, D->SR1, D->Imm);
+            break;
+        case OP_ST:
+            if (Addr < IO_PAGE && !(S->FLAGS[Addr] & AOT_REACHED)) {    /* data, not code */
+                AotEmit(S, "MEM[0x%04x] = r%d;", Addr, D->DR);
+                break;
+            }
+            AotEmit(S, "if (store(0x%04x, r%d)) ", Addr, D->DR);
+            AotEmit(S, "{ count -= %d; pc = 0x%04x; goto dispatch; }", Remaining, Next);
+            break;
+        case OP_STI:
+            AotEmit(S, "if (store(%s, r%d)) ", Pointer, D->DR);
+            AotEmit(S, "{ count -= %d; pc = 0x%04x; goto dispatch; }", Remaining, Next);
+            break;
+        case OP_STR:
+            AotEmit(S, "if (store((uint16_t)(r%d + 0x%04x), r%d)) ", D->SR1, D->Imm, D->DR);
+            AotEmit(S, "{ count -= %d; pc = 0x%04x; goto dispatch; }", Remaining, Next);
+            break;
+        case OP_BR:
+            if (D->DR == 0) {
+                AotEmit(S, ";");
+                break;
+            }
+            if (D->DR != 7) {
+                AotEmit(S, "if (%s) ", CONDITIONS[D->DR]);
+                AotGoto(S, Addr);
+                AotEmit(S, " ");
+            }
+            AotGoto(S, D->DR == 7 ? Addr : Next);
+            break;
+        case OP_JMP:
+            if (D->SR1 == 7)        /* RET */
+                AotEmit(S, "if (DEPTH > 0) r7 = RETURNS[--DEPTH] & 0xFFFF; ");
+            AotEmit(S, "pc = r%d; goto dispatch;", D->SR1);
+            break;
+        case OP_JSR:
+            AotEmit(S, "r7 = 0x%04x; ", Next);
+            if (Stack)
+                AotEmit(S, "push(0x%04x, 0x%04x); ", Next, Addr);
+            AotGoto(S, Addr);
+            break;
+        case OP_JSRR:           /* R7 first: JSRR R7 jumps to the return address */
+            AotEmit(S, "r7 = 0x%04x; pc = r%d; ", Next, D->SR1);
+            if (Stack)
+                AotEmit(S, "push(0x%04x, pc); ", Next);
+            AotEmit(S, "goto dispatch;");
+            break;
+        case OP_TRAP:
+            if (Vector >= 0x20 && Vector <= 0x24) {
+                AotEmit(S, "R[0] = r0; if (!trap(0x%02x)) { pc = 0; goto halt; } ", Vector);
+                AotEmit(S, "r0 = R[0]; r7 = 0x%04x; ", Next);
+                AotGoto(S, Next);
+            }
+            else
+                AotEmit(S, "pc = 0; goto halt;");
+            break;
+        default:                /* RTI, 1101: change mode, by step() */
+            AotEmit(S, "pc = 0x%04x; SAVE(); step(); RESTORE(); goto dispatch;", PC);
+            break;
+    }
+    AotEmit(S, "\n");
+}
+
+void AotBlock(Aot_State *S, int Leader){
+    /* The block starting at Leader: up to its last instruction, or the next leader */
+    Decoded_Instruction D;
+    int PC, Length = 1, k;
+
+    for (PC = Leader; ; PC++, Length++) {
+        Decode(S->M->MEMORY[PC], &D);
+        if (AotEnds(&D) || PC + 1 == WORDS_IN_MEM || !(S->FLAGS[PC + 1] & AOT_REACHED)
+            || (S->FLAGS[PC + 1] & AOT_LEADER))
+            break;
+    }
+
+    if (S->FLAGS[Leader] & AOT_TARGET)     /* gotos check that no store changed it */
+        AotEmit(S, "B_%04x: if (STALE[0x%04x]) { pc = 0x%04x; goto fallback; }\n",
+                Leader, Leader, Leader);
+    AotEmit(S, "E_%04x:\n    count += %d;\n", Leader, Length);
+    for (k = 0, PC = Leader; k < Length; k++, PC++) {
+        Decode(S->M->MEMORY[PC], &D);
+        AotInstruction(S, PC, &D, Length - 1 - k);
+    }
+    if (!AotEnds(&D)) {
+        AotEmit(S, "    ");
+        AotGoto(S, Low16bits(PC));
+        AotEmit(S, "\n");
+    }
+}
+
+int AotTranslate(Machine *M, FILE *Out, int *Instructions){
+    /* Returns the number of blocks written, 0 if there is no code at PC, -1 out of memory */
+    Aot_State *S = calloc(1, sizeof(Aot_State));
+    System_Latches *L = &M->CURRENT_LATCHES;
+    int PC, k, Run, Blocks;
+
+    if (S == NULL)
+        return -1;
+    S->M = M;
+    S->LOW = WORDS_IN_MEM;
+    if (!AotDiscover(S, L->PC)) {
+        free(S);
+        return -1;
+    }
+    for (PC = 0; PC < WORDS_IN_MEM; PC++) {
+        if (S->FLAGS[PC] & AOT_REACHED)
+            S->INSTRUCTIONS++;
+        if (S->FLAGS[PC] & AOT_LEADER) {
+            if (S->LOW == WORDS_IN_MEM)
+                S->LOW = PC;
+            S->HIGH = PC;
+        }
+    }
+    if (S->BLOCKS == 0) {
+        free(S);
+        return 0;
+    }
+
+    fprintf(Out, "/*\n * Translated by the LC-3 simulator's aot command: %d instructions in\n"
+            " * %d blocks, reachable from x%04x. Build it with  cc -O2 -o program <this file>\n"
+            " * and run  ./program [--rdump].\n */\n", S->INSTRUCTIONS, S->BLOCKS, L->PC);
+    fprintf(Out, "#include <stdint.h>\n#include <stdio.h>\n#include <stdlib.h>\n"
+            "#include <string.h>\n#include <unistd.h>\n\n");
+    fprintf(Out, "#define RETURN_STACK %d\n#define START_DEPTH %d\n\n",
+            M->RETURNS.ENABLE, M->RETURNS.DEPTH);
+
+    fprintf(Out, "static uint16_t MEM[65536] = {");
+    for (PC = 0, Run = 0; PC < WORDS_IN_MEM; PC++) {
+        if (M->MEMORY[PC] == 0) {
+            Run = 0;
+            continue;
+        }
+        if (Run == 0)
+            fprintf(Out, "\n    [0x%04x] =", PC);
+        else if (Run % 8 == 0)
+            fprintf(Out, "\n   ");
+        fprintf(Out, " 0x%04x,", M->MEMORY[PC]);
+        Run++;
+    }
+    fprintf(Out, "\n};\nstatic uint16_t R[8] = {");
+    for (k = 0; k < LC_3_REGS; k++)
+        fprintf(Out, k ? ", 0x%04x" : " 0x%04x", L->REGS[k]);
+    fprintf(Out, " }, CC = 0x%04x, PC = 0x%04x;\nstatic long long COUNT = %lld;\n",
+            L->Z ? 0 : L->N ? 0x8000 : 1, L->PC, M->INSTRUCTION_COUNT);
+    fprintf(Out, "static unsigned PRIV = %d, PRIORITY = %d;\n", L->PRIV, L->PRIORITY);
+    fprintf(Out, "static uint16_t SAVED_SSP = 0x%04x, SAVED_USP = 0x%04x;\n",
+            L->SAVED_SSP, L->SAVED_USP);
+    fprintf(Out, "static const uint32_t START_RETURNS[] = {");
+    for (k = 0; k < M->RETURNS.DEPTH; k++)
+        fprintf(Out, k % 6 == 5 ? "\n    0x%08x," : " 0x%08x,", M->RETURNS.ENTRY[k]);
+    fprintf(Out, " 0 };\n");
+    fprintf(Out, "static const uint16_t BLOCKS[][2] = {    /* leader, length */\n");
+    for (PC = 0, k = 0; PC < WORDS_IN_MEM; PC++) {
+        if (!(S->FLAGS[PC] & AOT_LEADER))
+            continue;
+        for (Run = 1; PC + Run < WORDS_IN_MEM && (S->FLAGS[PC + Run] & AOT_REACHED)
+                      && !(S->FLAGS[PC + Run] & AOT_LEADER); Run++)
+            ;
+        fprintf(Out, ++k % 6 == 0 ? " { 0x%04x, %d },\n" : " { 0x%04x, %d },", PC, Run);
+    }
+    fprintf(Out, "\n};\n\n");
+    fputs(AOT_RUNTIME, Out);
+
+    /* First pass: which blocks are jumped to directly */
+    for (PC = 0; PC < WORDS_IN_MEM; PC++)
+        if (S->FLAGS[PC] & AOT_LEADER)
+            AotBlock(S, PC);
+
+    S->OUT = Out;
+    AotEmit(S, "\nstatic void run(void) {\n"
+            "    uint16_t r0, r1, r2, r3, r4, r5, r6, r7, cc, pc;\n    long long count;\n");
+    AotEmit(S, "#if defined(__GNUC__)\n    static void *const TABLE[%d] = {\n",
+            S->HIGH - S->LOW + 1);
+    for (PC = S->LOW; PC <= S->HIGH; PC++)
+        if (S->FLAGS[PC] & AOT_LEADER)
+            AotEmit(S, "        [%d] = &&E_%04x,\n", PC - S->LOW, PC);
+    AotEmit(S, "    };\n#endif\n\n    RESTORE();\ndispatch:\n    if (pc == 0)\n        goto halt;\n"
+            "    if (OWNER[pc] != pc + 1u || STALE[pc])\n        goto fallback;\n"
+            "#if defined(__GNUC__)\n    goto *TABLE[pc - 0x%04x];\n#else\n    switch (pc) {\n",
+            S->LOW);
+    for (PC = S->LOW; PC <= S->HIGH; PC++)
+        if (S->FLAGS[PC] & AOT_LEADER)
+            AotEmit(S, "        case 0x%04x: goto E_%04x;\n", PC, PC);
+    AotEmit(S, "    }\n#endif\nfallback:\n    SAVE();\n    interpret();\n    RESTORE();\n"
+            "    goto dispatch;\nhalt:\n    SAVE();\n    return;\n\n");
+    for (PC = 0; PC < WORDS_IN_MEM; PC++)
+        if (S->FLAGS[PC] & AOT_LEADER)
+            AotBlock(S, PC);
+    AotEmit(S, "}\n");
+    fputs(AOT_MAIN, Out);
+
+    *Instructions = S->INSTRUCTIONS;
+    Blocks = S->BLOCKS;
+    free(S);
+    return Blocks;
+}
+
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : lc3_* (lc3sim.h)                                */
+/*                                                             */
+/* Purpose   : The library interface: loading, running, the    */
+/*             registers and memory, the console and hooks.    */
+/*             lc3_create, lc3_destroy and the loaders are     */
+/*             above.                                          */
+/*                                                             */
+/***************************************************************/
+void lc3_reset(Machine *M) {
+    initialize(M, NULL, 0, FALSE);
+}
+
+int lc3_load_file(Machine *M, const char *filename) {
+    return load_program(M, filename);
+}
+
+int lc3_load_buffer(Machine *M, const void *data, size_t size, int format) {
+    return load_image(M, "buffer", data, size, format == LC3_FORMAT_OBJECT);
+}
+
+long long lc3_step(Machine *M, long long n) {
+    return n > 0 ? execute(M, n) : 0;
+}
+
+long long lc3_run_until_halt(Machine *M, long long budget) {
+    return execute(M, budget > 0 ? budget : LLONG_MAX);
+}
+
+int lc3_halted(Machine *M) {
+    return M->CURRENT_LATCHES.PC == 0x0000;
+}
+
+long long lc3_instruction_count(Machine *M) {
+    return M->INSTRUCTION_COUNT;
+}
+
+long long lc3_output_count(Machine *M) {
+    return M->CONSOLE.WRITTEN;
+}
+
+int lc3_get_register(Machine *M, int n) {
+    return n >= 0 && n < LC_3_REGS ? M->CURRENT_LATCHES.REGS[n] : -1;
+}
+
+void lc3_set_register(Machine *M, int n, int value) {
+    if (n >= 0 && n < LC_3_REGS)
+        M->CURRENT_LATCHES.REGS[n] = M->NEXT_LATCHES.REGS[n] = Low16bits(value);
+}
+
+int lc3_get_pc(Machine *M) {
+    return M->CURRENT_LATCHES.PC;
+}
+
+void lc3_set_pc(Machine *M, int pc) {
+    M->CURRENT_LATCHES.PC = M->NEXT_LATCHES.PC = Low16bits(pc);
+}
+
+int lc3_get_psr(Machine *M) {
+    return GetPSR(M);
+}
+
+void lc3_set_psr(Machine *M, int psr) {
+    SetPSR(M, psr);
+    M->NEXT_LATCHES = M->CURRENT_LATCHES;
+    M->EVENTS.DIRTY = TRUE;     /* a lower priority may let an interrupt in */
+}
+
+int lc3_read_memory(Machine *M, int address) {
+    return M->MEMORY[Low16bits(address)];
+}
+
+void lc3_write_memory(Machine *M, int address, int value) {
+    StoreMemory(M, Low16bits(address), Low16bits(value));
+}
+
+void lc3_set_console(Machine *M, FILE *input, FILE *output) {
+    ConsoleFlush(M);
+    KeyboardStop(M);
+    if (M->CONSOLE.OWN_INPUT)
+        fclose(M->CONSOLE.INPUT);
+    M->CONSOLE.INPUT = input;
+    M->CONSOLE.OWN_INPUT = FALSE;
+    M->CONSOLE.INTERACTIVE = input != NULL && isatty(fileno(input));
+    M->CONSOLE.OUTPUT = output;
+    M->CONSOLE.WRITTEN = 0;
+}
+
+int lc3_open_input(Machine *M, const char *filename) {
+    FILE *input = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
+
+    if (input == NULL) {
+        printf("Error: Can't open input file %s\n", filename);
+        return -1;
+    }
+    lc3_set_console(M, input, M->CONSOLE.OUTPUT);
+    M->CONSOLE.OWN_INPUT = input != stdin;
+    return 0;
+}
+
+void lc3_set_trap_hook(Machine *M, lc3_trap_hook hook, void *context) {
+    M->HOOKS.TRAP = hook;
+    M->HOOKS.TRAP_CONTEXT = context;
+}
+
+void lc3_set_io_hooks(Machine *M, lc3_read_hook read, lc3_write_hook write, void *context) {
+    M->HOOKS.READ = read;
+    M->HOOKS.WRITE = write;
+    M->HOOKS.IO_CONTEXT = context;
+}
@@ -0,0 +1,126 @@
+/*
+ * lc3sim.h: the LC-3 simulator as a library.
+ *
+ * A program links liblc3sim.a (make lib) and runs any number of
+ * machines in-process: create one, load a program, step or run it and
+ * read the registers and memory back, with no shell and no output to
+ * parse. Each machine is independent; calls on one machine must not
+ * overlap, calls on different machines may run in different threads.
+ *
+ * Addresses, words and register values are 16-bit, passed as int.
+ * The loaders return -1 on error and report it on stdout, as the
+ * simulate shell does.
+ */
+#ifndef LC3SIM_H
+#define LC3SIM_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LC3SIM_VERSION 1        /* bumped when anything below changes incompatibly */
+
+typedef struct Machine_Struct lc3_machine;
+
+/* Engines, as --engine= of the shell */
+#define LC3_ENGINE_SWITCH   0   /* one instruction at a time */
+#define LC3_ENGINE_THREADED 1   /* direct-threaded interpreter */
+#define LC3_ENGINE_JIT      2   /* x86-64 translation, else the switch engine */
+
+/* Image formats of lc3_load_buffer() */
+#define LC3_FORMAT_HEX      0   /* text: the origin, then one hex word per line */
+#define LC3_FORMAT_OBJECT   1   /* binary: big-endian origin, then big-endian words */
+
+/*
+ * A new machine: memory cleared, PC 0x0000, supervisor mode, the
+ * console on stdin and stdout. NULL if it can't be allocated.
+ */
+lc3_machine *lc3_create(int engine);
+void lc3_destroy(lc3_machine *M);
+void lc3_reset(lc3_machine *M);             /* back to the state lc3_create() gives */
+
+/*
+ * Load an image into memory. The first image loaded after create or
+ * reset sets the PC to its origin. Return the number of words, or -1.
+ */
+int lc3_load_file(lc3_machine *M, const char *filename);   /* .obj is binary, else hex */
+int lc3_load_buffer(lc3_machine *M, const void *data, size_t size, int format);
+
+/*
+ * Run. lc3_step() executes up to n instructions and
+ * lc3_run_until_halt() up to budget (0: no limit), both stopping at
+ * HALT; they return the number executed. Console output is written
+ * out before they return.
+ */
+long long lc3_step(lc3_machine *M, long long n);
+long long lc3_run_until_halt(lc3_machine *M, long long budget);
+int lc3_halted(lc3_machine *M);             /* PC is 0x0000 */
+long long lc3_instruction_count(lc3_machine *M);
+long long lc3_output_count(lc3_machine *M);  /* console bytes written since it was set */
+
+/* Registers: R0-R7, the PC and the PSR (privilege, priority, N Z P) */
+#define LC3_REGISTERS       8
+
+int lc3_get_register(lc3_machine *M, int n);
+void lc3_set_register(lc3_machine *M, int n, int value);
+int lc3_get_pc(lc3_machine *M);
+void lc3_set_pc(lc3_machine *M, int pc);
+int lc3_get_psr(lc3_machine *M);
+void lc3_set_psr(lc3_machine *M, int psr);  /* switches R6 to the other stack on a change of mode */
+
+/*
+ * Memory, without the device side effects a program's loads and
+ * stores have. A write replaces any decoded or translated code there.
+ */
+int lc3_read_memory(lc3_machine *M, int address);
+void lc3_write_memory(lc3_machine *M, int address, int value);
+
+/*
+ * The console seen by GETC, IN, OUT, PUTS, PUTSP and the keyboard and
+ * display registers. input NULL: reading finds end of input, which
+ * halts GETC and IN. output NULL: output is dropped. The machine
+ * doesn't close either, and stops using them before lc3_set_console()
+ * or lc3_destroy() returns: they may be closed from then on.
+ */
+void lc3_set_console(lc3_machine *M, FILE *input, FILE *output);
+
+/*
+ * Console input from a file ("-" is stdin), the output unchanged. The
+ * machine opens the file and closes it when the console is next set
+ * or the machine destroyed. Returns -1 if it can't be opened.
+ */
+int lc3_open_input(lc3_machine *M, const char *filename);
+
+/*
+ * Hooks. A TRAP hook is called for every TRAP before the built-in
+ * service routines, with the registers up to date (lc3_get_register()
+ * and lc3_set_register() may be used). It returns LC3_TRAP_CONTINUE
+ * (handled: go on after the TRAP), LC3_TRAP_HALT, or LC3_TRAP_DEFAULT
+ * for the built-in routine. While one is set the machine runs on the
+ * switch engine.
+ *
+ * I/O hooks see the loads and stores of the device page (0xFE00 up)
+ * before the built-in devices. The read hook returns nonzero and sets
+ * *value if it handled the load; the write hook returns nonzero if it
+ * handled the store. They may be called from any engine, in the
+ * middle of an instruction: they must not use the machine.
+ */
+#define LC3_TRAP_DEFAULT    (-1)
+#define LC3_TRAP_HALT       0
+#define LC3_TRAP_CONTINUE   1
+
+typedef int (*lc3_trap_hook)(void *context, lc3_machine *M, int vector);
+typedef int (*lc3_read_hook)(void *context, int address, int *value);
+typedef int (*lc3_write_hook)(void *context, int address, int value);
+
+void lc3_set_trap_hook(lc3_machine *M, lc3_trap_hook hook, void *context);
+void lc3_set_io_hooks(lc3_machine *M, lc3_read_hook read, lc3_write_hook write, void *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* LC3SIM_H */
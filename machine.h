@@ -0,0 +1,466 @@
+/*
+ * machine.h: the simulator's internals, shared by the library
+ * (lc3sim.c) and the simulate shell (main.c). Programs embedding the
+ * simulator include lc3sim.h only.
+ */
+#ifndef MACHINE_H
+#define MACHINE_H
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lc3sim.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+#define JIT_AVAILABLE 1
+#endif
+
+/***************************************************************/
+/*                                                             */
+/* Files: isaprogram   LC-3 machine language program file     */
+/*                                                             */
+/***************************************************************/
+
+/***************************************************************/
+/* A couple of useful definitions.                             */
+/***************************************************************/
+#define FALSE 0
+#define TRUE  1
+
+/***************************************************************/
+/* Use this to avoid overflowing 16 bits on the bus.           */
+/***************************************************************/
+#define Low16bits(x) ((x) & 0xFFFF)
+
+/***************************************************************/
+/* Main memory.                                                */
+/***************************************************************/
+/*
+  MEMORY[A] stores the word address A. It covers the whole 16-bit
+  address space, so any address computed with Low16bits is valid.
+*/
+
+#define WORDS_IN_MEM    0x10000
+
+/*
+  Loads and stores from IO_PAGE up go through ReadDevice() and
+  WriteDevice(), which implement the keyboard, display and timer
+  registers; the other words of the page are ordinary memory.
+*/
+#define IO_PAGE 0xFE00
+#define IO_KBSR 0xFE00      /* [15] a key is waiting, [14] interrupt enable */
+#define IO_KBDR 0xFE02      /* the last key; reading it takes the next one */
+#define IO_DSR  0xFE04      /* [15] display ready, always set */
+#define IO_DDR  0xFE06      /* a store prints its low byte */
+#define IO_TMR  0xFE08      /* [15] the timer expired since the last read, [14] interrupt enable */
+#define IO_TMI  0xFE0A      /* timer interval in instructions; a store restarts it, 0 stops it */
+
+/***************************************************************/
+/* Interrupts and exceptions.                                  */
+/***************************************************************/
+/*
+  Both save the PSR and PC on the supervisor stack and jump through
+  the vector table at IVT_BASE; RTI returns. The PSR holds the
+  privilege in [15] (1 = user), the priority in [10:8] and N, Z, P
+  in [2:0]. Programs start in supervisor mode at priority 0, with
+  SSP_START as the saved supervisor stack pointer.
+*/
+#define IVT_BASE            0x0100
+#define SSP_START           0x3000
+#define VECTOR_PRIVILEGE    0x00    /* RTI in user mode */
+#define VECTOR_ILLEGAL      0x01    /* opcode 1101 */
+#define VECTOR_KEYBOARD     0x80
+#define VECTOR_TIMER        0x81
+#define PRIORITY_KEYBOARD   4
+#define PRIORITY_TIMER      6
+
+/***************************************************************/
+/* Decoded instruction cache.                                  */
+/***************************************************************/
+/*
+  DECODE_CACHE[A] holds MEMORY[A] already decoded into its handler
+  and operand fields. Handler == NULL means the word has not been
+  decoded yet, or has been overwritten since it was. A store to A
+  also clears A - 1, which the threaded engine may have fused with
+  A into one superinstruction (see Fuse()).
+*/
+
+struct Machine_Struct;
+
+typedef struct Decoded_Instruction_Struct{
+
+    int (*Handler)(struct Machine_Struct *M, const struct Decoded_Instruction_Struct *D);
+    unsigned short Raw,     /* instruction word */
+    Imm;                    /* imm5 / offset, already sign-extended */
+    unsigned char DR,       /* DR, SR for ST/STI/STR, nzp for BR */
+    SR1,                    /* SR1 / BaseR */
+    SR2,                    /* SR2 */
+    Op,                     /* OP_* index */
+    Fused;                  /* OP_* or OP_FUSED_* for the threaded engine */
+} Decoded_Instruction;
+
+enum {
+    OP_ADD, OP_ADDI, OP_AND, OP_ANDI, OP_BR, OP_JMP, OP_JSR, OP_JSRR,
+    OP_LD, OP_LDI, OP_LDR, OP_LEA, OP_NOT, OP_ST, OP_STI, OP_STR,
+    OP_TRAP, OP_RTI, OP_ILLEGAL, OP_COUNT,
+
+    /* an instruction and the next one, run by the threaded engine */
+    OP_FUSED_ADDI_BR = OP_COUNT,    /* ADD Rx,Rx,#-1; BRp loop */
+    OP_FUSED_CLEAR_ADDI,            /* AND Rx,Rx,#0; ADD Rx,Rx,#imm */
+    OP_FUSED_LDR_ADD,               /* LDR; ADD */
+    OP_FUSED_LDR_ADDI,              /* LDR; ADD imm */
+    OP_FUSED_LD_STR,                /* LD; STR */
+    OP_FUSED_COUNTDOWN,             /* L: ADD Rx,Rx,#k; BRp L, with --fast-forward */
+    OP_FUSED_COUNT
+};
+
+extern const char *OP_NAMES[OP_COUNT];
+
+/***************************************************************/
+/* LC-3 State info.                                           */
+/***************************************************************/
+#define LC_3_REGS 8
+
+typedef struct System_Latches_Struct{
+
+    int PC,		/* program counter */
+    N,		/* n condition bit */
+    Z,		/* z condition bit */
+    P;		/* p condition bit */
+    int REGS[LC_3_REGS]; /* register file. */
+    int PRIV,       /* PSR[15]: 1 in user mode */
+    PRIORITY,       /* PSR[10:8] */
+    SAVED_SSP,      /* R6 of the other mode */
+    SAVED_USP;
+} System_Latches;
+
+/***************************************************************/
+/* Execution engines, chosen with --engine= at startup.        */
+/***************************************************************/
+#define ENGINE_SWITCH   LC3_ENGINE_SWITCH   /* cycle() -> process_instruction() */
+#define ENGINE_THREADED LC3_ENGINE_THREADED /* RunThreaded(): locals, lazy CCs */
+#define ENGINE_JIT      LC3_ENGINE_JIT      /* RunJit(): x86-64 basic blocks */
+#define ENGINE_COUNT    3
+
+extern const char *ENGINE_NAMES[ENGINE_COUNT];
+
+/***************************************************************/
+/* Machine context.                                            */
+/***************************************************************/
+/*
+  Everything one simulated LC-3 owns. Every procedure takes the
+  machine it works on, so one process can simulate any number of
+  them, e.g. one per worker thread in batch mode.
+*/
+
+typedef struct Jit_Cache_Struct Jit_Cache;     /* see RunJit() */
+
+/*
+  Counters kept by RunProfiled() while the profiler is on.
+*/
+typedef struct Profile_Struct{
+
+    unsigned long long PC_COUNT[WORDS_IN_MEM];  /* executions of each address */
+    unsigned long long TAKEN[WORDS_IN_MEM];     /* taken BRs at each address */
+    unsigned long long CALLS[WORDS_IN_MEM];     /* JSR/JSRR calls to each address */
+    unsigned long long OP_COUNT[OP_COUNT];      /* executions of each OP_* */
+    unsigned long long BR_TAKEN;                /* taken BRs in OP_COUNT[OP_BR] */
+} Profile;
+
+/*
+  The timing model kept while timing is on, see TimeAccess(). An
+  instruction costs CYCLES[its OP_*] (plus TAKEN for a taken BR)
+  when its fetch and its loads and stores hit in the first-level
+  caches; an access that misses stalls for the LATENCY of every level
+  it goes down to, and MEMORY_LATENCY at the bottom. The caches are
+  set-associative with LRU replacement, write-back and
+  write-allocate; L1I and L1D share L2.
+*/
+#define CACHE_L1I       0
+#define CACHE_L1D       1
+#define CACHE_L2        2
+#define CACHE_LEVELS    3
+#define CACHE_MEMORY    3       /* STALLS[][CACHE_MEMORY]: memory and devices */
+
+#define ACCESS_FETCH    0
+#define ACCESS_LOAD     1
+#define ACCESS_STORE    2
+#define ACCESS_KINDS    3
+
+typedef struct Cache_Struct{
+
+    uint32_t *TAGS;         /* SETS x WAYS, most recently used first:
+                               (line + 1) << 1 | dirty, 0 if empty */
+    int WORDS, WAYS, LINE;  /* WORDS == 0: no such cache */
+    int LATENCY;            /* cycles stalled by an access reaching this level */
+    int SHIFT, SETS;        /* log2(LINE); SETS is a power of two */
+    unsigned long long ACCESSES, MISSES, WRITEBACKS;
+} Cache;
+
+typedef struct Timing_Struct{
+
+    Cache LEVEL[CACHE_LEVELS];
+    int MEMORY_LATENCY;
+    int CYCLES[OP_COUNT];
+    int TAKEN;
+    unsigned long long INSTRUCTIONS;
+    unsigned long long BASE;    /* cycles without stalls */
+    unsigned long long STALLS[ACCESS_KINDS][CACHE_LEVELS + 1];  /* by the level that served it */
+} Timing;
+
+/*
+  One traced instruction, 12 bytes, enough to undo it: see
+  TraceBegin(). Trace files are these records back to back, in host
+  byte order.
+*/
+#define TRACE_REG   0x0040  /* OLD_REG is the old value of R[FLAGS >> 3 & 7] */
+#define TRACE_MEM   0x0080  /* OLD_MEM is the old MEMORY[ADDR] or device register */
+#define TRACE_PUSH  0x0100  /* the R7 save stack grew by one; ADDR:OLD_MEM was the
+                               entry it overwrote */
+#define TRACE_POP   0x0200  /* the R7 save stack shrank by one */
+#define TRACE_R0    0x0400  /* TRAP: OLD_MEM is the old value of R0 */
+
+typedef struct Trace_Record_Struct{
+
+    uint16_t PC;            /* address of the instruction */
+    uint16_t RAW;           /* the instruction */
+    uint16_t OLD_REG;
+    uint16_t ADDR;
+    uint16_t OLD_MEM;
+    uint16_t FLAGS;         /* old N Z P in bits 2..0, TRACE_* */
+} Trace_Record;
+
+typedef struct Trace_Struct{
+
+    Trace_Record *RING;     /* the last CAPACITY records */
+    long long CAPACITY;
+    long long HEAD;         /* next slot to fill */
+    long long AVAILABLE;    /* records that can still be undone */
+    long long RECORDED;     /* records written since trace on */
+    int DEPTH;              /* R7 save stack depth before the current instruction */
+    FILE *OUTPUT;           /* trace file, or NULL */
+} Trace;
+
+/*
+  Breakpoints and watchpoints, one bit per address. While any is
+  set, execute() runs RunChecked(), which records in STOP why it
+  returned early.
+*/
+#define BIT_TEST(map, a)    ((map)[(a) >> 6] >> ((a) & 63) & 1)
+#define BIT_SET(map, a)     ((map)[(a) >> 6] |= 1ULL << ((a) & 63))
+#define BIT_CLEAR(map, a)   ((map)[(a) >> 6] &= ~(1ULL << ((a) & 63)))
+
+#define STOP_NONE   0
+#define STOP_BREAK  1       /* before the instruction at STOP_PC */
+#define STOP_WATCH  2       /* after STOP_PC wrote MEMORY[STOP_ADDR] */
+
+typedef struct Breakpoints_Struct{
+
+    uint64_t BREAK[WORDS_IN_MEM / 64];
+    uint64_t WATCH[WORDS_IN_MEM / 64];
+    int BREAKS, WATCHES;    /* bits set in each */
+    int STOP, STOP_PC, STOP_ADDR, OLD_VALUE;
+    int RESUME;             /* execute() just started: no stop at the first PC */
+} Breakpoints;
+
+/*
+  The console seen by the TRAP service routines and the keyboard and
+  display registers. Output collects in
+  BUFFER and is written in one go when it fills and whenever
+  execute() returns; input is read from INPUT (stdin, a file given
+  with --input, or NULL for none).
+*/
+#define CONSOLE_BUFFER_SIZE (64 * 1024)
+#define KEYBOARD_RING_SIZE  4096
+#define NO_KEY              (-2)    /* KeyboardTake(): nothing typed yet */
+
+typedef struct Keyboard_Struct{
+
+    pthread_t THREAD;       /* KeyboardReader() */
+    pthread_mutex_t LOCK;
+    pthread_cond_t CHANGED; /* a key was pushed or taken, or STOP set */
+    FILE *INPUT;
+    unsigned char RING[KEYBOARD_RING_SIZE];
+    unsigned int HEAD;      /* keys pushed, written by the reader only */
+    unsigned int TAIL;      /* keys taken, written by the machine only */
+    int DONE;               /* the reader reached the end of INPUT */
+    int RUNNING;            /* between KeyboardResume() and KeyboardPark() */
+    int STOP;               /* see KeyboardPark() */
+} Keyboard;
+
+typedef struct Console_Struct{
+
+    FILE *INPUT;            /* NULL: GETC and IN see end of input */
+    int OWN_INPUT;          /* INPUT was opened for the machine: it closes it */
+    FILE *OUTPUT;           /* NULL: output is counted, then dropped */
+    int INTERACTIVE;        /* INPUT is a terminal: flush before reading */
+    int LENGTH;             /* bytes waiting in BUFFER */
+    long long WRITTEN;      /* bytes written by the program */
+    char BUFFER[CONSOLE_BUFFER_SIZE];
+    Keyboard *KEYBOARD;     /* started by the first KBSR/KBDR access */
+    int KEY;                /* KBDR */
+    int KEY_ENABLE;         /* KBSR[14] */
+} Console;
+
+/*
+  Things that happen at a set INSTRUCTION_COUNT: the timer expiring,
+  and polling for interrupts while one could arrive. execute() runs
+  the engine no further than NEXT, the earliest event armed, and then
+  calls ServiceEvents(), so no engine ever looks at a device. DIRTY
+  asks for that call right away: a device register or an RTI changed
+  what is pending, and every engine stops after the instruction that
+  set it.
+*/
+#define EVENT_TIMER     0
+#define EVENT_POLL      1
+#define EVENT_KINDS     2
+#define POLL_INTERVAL   1024    /* instructions between interrupt polls */
+
+typedef struct Events_Struct{
+
+    int AT[EVENT_KINDS];    /* INSTRUCTION_COUNT at which each fires */
+    int ARMED;              /* 1 << EVENT_* */
+    int NEXT;               /* the earliest AT armed */
+    int DIRTY;
+} Events;
+
+typedef struct Timer_Struct{
+
+    int INTERVAL;           /* TMI */
+    int ENABLE;             /* TMR[14] */
+    int EXPIRED;            /* TMR[15] */
+    int RESTART;            /* TMI was written since ServiceEvents() */
+} Timer;
+
+/*
+  The R7 save stack: JSR and JSRR push the return address (and the
+  subroutine they jumped to, for callstack), RET pops it back into
+  R7, so a subroutine may reuse R7. It is kept on the host, outside
+  MEMORY, and grows as deep as the calls go. With ENABLE off, JSR and
+  RET are the plain LC-3 ones.
+*/
+#define RETURN_STACK_MAX (1 << 22)  /* entries; past this the oldest half is dropped */
+
+typedef struct Return_Stack_Struct{
+
+    uint32_t *ENTRY;        /* subroutine << 16 | return address */
+    int DEPTH;
+    int CAPACITY;
+    int ENABLE;
+} Return_Stack;
+
+/*
+  Callbacks set through lc3sim.h, see lc3_set_trap_hook() and
+  lc3_set_io_hooks(). While TRAP is set execute() runs cycle().
+*/
+typedef struct Hooks_Struct{
+
+    lc3_trap_hook TRAP;
+    void *TRAP_CONTEXT;
+    lc3_read_hook READ;
+    lc3_write_hook WRITE;
+    void *IO_CONTEXT;
+} Hooks;
+
+typedef struct Machine_Struct{
+
+    uint16_t MEMORY[WORDS_IN_MEM];  /* main memory */
+    Decoded_Instruction DECODE_CACHE[WORDS_IN_MEM];
+
+    /*
+      JIT_CODE[A] is set while the word at A is part of a block
+      translated by the JIT; a store there sets JIT_STALE.
+    */
+    unsigned char JIT_CODE[WORDS_IN_MEM];
+    int JIT_STALE;
+    Jit_Cache *JIT;                 /* allocated on first use */
+    Profile *PROFILE;               /* NULL unless profiling */
+    Timing *TIMING;                 /* NULL unless timing */
+    Trace *TRACE;                   /* NULL unless tracing */
+    Breakpoints *BREAKPOINTS;       /* NULL unless any is set */
+
+    System_Latches CURRENT_LATCHES, NEXT_LATCHES;
+    int RUN_BIT;                    /* run bit */
+    long long INSTRUCTION_COUNT;    /* a cycle counter */
+    int Instruction;                /* last instruction executed */
+    Return_Stack RETURNS;           /* R7 save stack, see PUSH() */
+    int ENGINE;                     /* ENGINE_* used by execute() */
+    int QUIET;                      /* shell prints results and errors only */
+    int FAST_FORWARD;               /* skip countdown loops, see Fuse() */
+    Console CONSOLE;
+    Events EVENTS;
+    Timer TIMER;
+    Hooks HOOKS;
+} Machine;
+
+/***************************************************************/
+/* The machine's procedures, in lc3sim.c.                      */
+/***************************************************************/
+
+void cycle(Machine *M);
+long long execute(Machine *M, long long budget);
+void init_memory(Machine *M);
+int load_image(Machine *M, const char *name, const unsigned char *data, size_t size,
+               int object);
+int load_program(Machine *M, const char *program_filename);
+int initialize(Machine *M, char *program_filenames[], int num_prog_files, int verbose);
+void timing_free(Machine *M);
+void trace_free(Machine *M);
+
+/***************************************************************/
+/* These are the functions you'll have to write.               */
+/***************************************************************/
+
+void process_instruction(Machine *M);
+int GrowReturns(Machine *M);
+void Decode(int Inst, Decoded_Instruction *D);
+void Fuse(Machine *M, int PC, Decoded_Instruction *D);
+long long RunThreaded(Machine *M, long long Budget);
+long long CountdownIterations(int Value, int Step, int Conditions);
+long long RunProfiled(Machine *M, long long Budget);
+void TimeInstruction(Machine *M, const Decoded_Instruction *D);
+void TimeAccess(Machine *M, int Addr, int Kind);
+long long RunChecked(Machine *M, long long Budget);
+int StoreAddress(Machine *M, const Decoded_Instruction *D);
+Trace_Record *TraceBegin(Machine *M);
+void TraceEnd(Machine *M, Trace_Record *R);
+int TraceUndo(Machine *M);
+long long RunJit(Machine *M, long long Budget);
+void JitFlush(Machine *M);
+void JitFree(Machine *M);
+#if defined(__AVX2__)          /* machines run as one by RunLockstep(): a vector of */
+#define LOCKSTEP_LANES 16       /* 16-bit registers, one per machine */
+#else
+#define LOCKSTEP_LANES 8
+#endif
+long long RunLockstep(Machine *Lanes[], int Count, long long Budget, long long Executed[]);
+int TrapService(Machine *M, int Vector, int *R0);
+void ConsoleFlush(Machine *M);
+void KeyboardResume(Machine *M);
+void KeyboardPark(Machine *M);
+void KeyboardStop(Machine *M);
+int KeyboardTake(Machine *M, int Wait);
+int ReadDevice(Machine *M, int Addr);
+int WriteDevice(Machine *M, int Addr, int Value);
+int GetPSR(Machine *M);
+void Interrupt(Machine *M, int Vector, int Priority);
+long long EventDelay(Machine *M);
+void ServiceEvents(Machine *M);
+int AotTranslate(Machine *M, FILE *Out, int *Instructions);
+
+#endif  /* MACHINE_H */
@@ -1,70 +1,53 @@
-#include <assert.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-/***************************************************************/
-/*                                                             */
-/* Files: isaprogram   LC-3 machine language program file     */
-/*                                                             */
-/***************************************************************/
-
-/***************************************************************/
-/* These are the functions you'll have to write.               */
-/***************************************************************/
-
-void process_instruction();
-
-/***************************************************************/
-/* A couple of useful definitions.                             */
-/***************************************************************/
-#define FALSE 0
-#define TRUE  1
-
-/***************************************************************/
-/* Use this to avoid overflowing 16 bits on the bus.           */
-/***************************************************************/
-#define Low16bits(x) ((x) & 0xFFFF)
-
-/***************************************************************/
-/* Main memory.                                                */
-/***************************************************************/
 /*
-  MEMORY[A] stores the word address A
-*/
-
-#define WORDS_IN_MEM    0x08000
-int MEMORY[WORDS_IN_MEM];
-
-/***************************************************************/
+ * main.c: the simulate shell, a client of lc3sim.c: the command line,
+ * the interactive commands, dumps, batch runs, the socket server,
+ * benchmarks and the fuzzer.
+ */
+#include "machine.h"
 
-/***************************************************************/
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 /***************************************************************/
-/* LC-3 State info.                                           */
+/* Dump output for mdump and rdump, see dump_flush().          */
 /***************************************************************/
-#define LC_3_REGS 8
+#define DUMP_TEXT    0      /* the classic dumpsim layout */
+#define DUMP_CSV     1
+#define DUMP_JSON    2
+#define DUMP_BINARY  3      /* big-endian 16-bit words */
+#define DUMP_FORMATS 4
 
-int RUN_BIT;	/* run bit */
+const char *DUMP_FORMAT_NAMES[DUMP_FORMATS] = { "text", "csv", "json", "binary" };
 
+typedef struct Dump_Struct{
 
-typedef struct System_Latches_Struct{
-
-    int PC,		/* program counter */
-    N,		/* n condition bit */
-    Z,		/* z condition bit */
-    P;		/* p condition bit */
-    int REGS[LC_3_REGS]; /* register file. */
-} System_Latches;
-
-/* Data Structure for Latch */
-
-System_Latches CURRENT_LATCHES, NEXT_LATCHES;
+    FILE *OUTPUT;                   /* dump file, or NULL */
+    int SCREEN;                     /* copy dumps to stdout (not binary ones) */
+    int FORMAT;                     /* DUMP_* used when a command names none */
+    int ECHO;                       /* this dump goes to stdout */
+    int LENGTH;                     /* bytes waiting in BUFFER */
+    char BUFFER[1 << 16];
+} Dump;
 
 /***************************************************************/
-/* A cycle counter.                                            */
+/*                                                             */
+/* Procedure : message                                         */
+/*                                                             */
+/* Purpose   : printf for shell chatter (prompt, banners,      */
+/*             progress and timing), dropped with --quiet.     */
+/*                                                             */
 /***************************************************************/
-int INSTRUCTION_COUNT;
+void message(Machine *M, const char *format, ...) {
+    va_list args;
+
+    if (M->QUIET)
+        return;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
 
 /***************************************************************/
 /*                                                             */
@@ -79,22 +62,169 @@ void help() {
     printf("run n            -  execute program for n instructions\n");
     printf("mdump low high   -  dump memory from low to high      \n");
     printf("rdump            -  dump the register & bus values    \n");
+    printf("  (either can end with text, csv, json or binary)     \n");
+    printf("compare          -  go on every engine, report MIPS   \n");
+    printf("callstack [n]    -  show the n innermost calls        \n");
+    printf("profile on|off   -  count instructions while running  \n");
+    printf("profile [n]      -  show the n hottest addresses,     \n");
+    printf("                    loops and calls (default 10)      \n");
+    printf("profile reset    -  zero the profile counters         \n");
+    printf("break [addr]     -  stop before addr, or list         \n");
+    printf("watch low [high] -  stop after a store to low..high   \n");
+    printf("delete [addr]    -  delete a break/watch, or all      \n");
+    printf("trace on [n]     -  record the last n instructions    \n");
+    printf("trace file f     -  also write every record to f      \n");
+    printf("trace off        -  stop recording                    \n");
+    printf("rstep [n]        -  undo the last n instructions      \n");
+    printf("timing on [spec] -  model cycles and caches for rdump \n");
+    printf("timing reset|off -  zero the model, or stop it        \n");
+    printf("snapshot file    -  save the machine state to file    \n");
+    printf("restore file     -  load a state saved by snapshot    \n");
+    printf("aot file.c       -  translate the program to C        \n");
     printf("?                -  display this help menu            \n");
     printf("quit             -  exit the program                  \n\n");
 }
 
 /***************************************************************/
 /*                                                             */
-/* Procedure : cycle                                           */
+/* Procedure : seconds / report_speed                          */
 /*                                                             */
-/* Purpose   : Execute a cycle                                 */
+/* Purpose   : Time a simulation and print its speed in MIPS.  */
 /*                                                             */
 /***************************************************************/
-void cycle() {
+double seconds() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void report_speed(Machine *M, long long executed, double elapsed) {
+    message(M, "%lld instructions in %.6f s: %.2f MIPS (%s engine)\n\n",
+           executed, elapsed, elapsed > 0 ? executed / elapsed / 1e6 : 0.0,
+           M->BREAKPOINTS != NULL ? "checking" : M->PROFILE != NULL ? "profiling"
+           : M->TRACE != NULL ? "tracing" : M->TIMING != NULL ? "timing"
+           : ENGINE_NAMES[M->ENGINE]);
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : breakpoint_set / breakpoint_delete /            */
+/*             breakpoint_list / breakpoint_report             */
+/*                                                             */
+/* Purpose   : Maintain the breakpoint and watchpoint bitmaps. */
+/*             M->BREAKPOINTS is freed when the last one is    */
+/*             deleted, so execute() is back on the unchecked  */
+/*             engines.                                        */
+/*             break addr      stop before executing addr      */
+/*             watch lo [hi]   stop after a store to lo..hi    */
+/*             delete [addr]   delete one, or all              */
+/*                                                             */
+/***************************************************************/
+int breakpoint_set(Machine *M, int watch, char *arguments) {
+    Breakpoints *B;
+    int start, stop, address;
+
+    switch (sscanf(arguments, "%i %i", &start, &stop)) {
+        case 1:
+            stop = start;
+            break;
+        case 2:
+            if (watch)
+                break;
+            /* fall through */
+        default:
+            return FALSE;
+    }
+    if (start < 0 || stop >= WORDS_IN_MEM || start > stop)
+        return FALSE;
+
+    if (M->BREAKPOINTS == NULL)
+        M->BREAKPOINTS = calloc(1, sizeof(Breakpoints));
+    assert(M->BREAKPOINTS != NULL);
+    B = M->BREAKPOINTS;
+
+    for (address = start; address <= stop; address++) {
+        if (watch && !BIT_TEST(B->WATCH, address)) {
+            BIT_SET(B->WATCH, address);
+            B->WATCHES++;
+        }
+        if (!watch && !BIT_TEST(B->BREAK, address)) {
+            BIT_SET(B->BREAK, address);
+            B->BREAKS++;
+        }
+    }
+    return TRUE;
+}
+
+int breakpoint_delete(Machine *M, char *arguments) {
+    Breakpoints *B = M->BREAKPOINTS;
+    int address, parsed;
+    char extra;
+
+    parsed = sscanf(arguments, "%i %c", &address, &extra);
+    if (parsed == EOF) {            /* no argument: all of them */
+        free(B);
+        M->BREAKPOINTS = NULL;
+        return TRUE;
+    }
+    if (parsed != 1 || B == NULL || address < 0 || address >= WORDS_IN_MEM
+        || !(BIT_TEST(B->BREAK, address) || BIT_TEST(B->WATCH, address)))
+        return FALSE;
+
+    if (BIT_TEST(B->BREAK, address)) {
+        BIT_CLEAR(B->BREAK, address);
+        B->BREAKS--;
+    }
+    if (BIT_TEST(B->WATCH, address)) {
+        BIT_CLEAR(B->WATCH, address);
+        B->WATCHES--;
+    }
+    if (B->BREAKS == 0 && B->WATCHES == 0) {
+        free(B);
+        M->BREAKPOINTS = NULL;
+    }
+    return TRUE;
+}
+
+void breakpoint_list(Machine *M) {
+    Breakpoints *B = M->BREAKPOINTS;
+    int address, end;
+
+    if (B == NULL) {
+        printf("No breakpoints or watchpoints\n\n");
+        return;
+    }
+    for (address = 0; address < WORDS_IN_MEM; address++)
+        if (BIT_TEST(B->BREAK, address))
+            printf("break  0x%.4x\n", address);
+    for (address = 0; address < WORDS_IN_MEM; address = end + 1) {
+        if (!BIT_TEST(B->WATCH, address)) {
+            end = address;
+            continue;
+        }
+        for (end = address; end + 1 < WORDS_IN_MEM && BIT_TEST(B->WATCH, end + 1); end++)
+            ;
+        if (end == address)
+            printf("watch  0x%.4x\n", address);
+        else
+            printf("watch  0x%.4x..0x%.4x\n", address, end);
+    }
+    printf("\n");
+}
 
-    process_instruction();
-    CURRENT_LATCHES = NEXT_LATCHES;
-    INSTRUCTION_COUNT++;
+int breakpoint_report(Machine *M) {
+    /* Returns TRUE if the last execute() stopped at a break or watch */
+    Breakpoints *B = M->BREAKPOINTS;
+
+    if (B == NULL || B->STOP == STOP_NONE)
+        return FALSE;
+    if (B->STOP == STOP_BREAK)
+        printf("Breakpoint at 0x%.4x\n\n", B->STOP_PC);
+    else
+        printf("Watchpoint 0x%.4x: 0x%.4x -> 0x%.4x, written by the instruction at 0x%.4x\n\n",
+               B->STOP_ADDR, B->OLD_VALUE, M->MEMORY[B->STOP_ADDR], B->STOP_PC);
+    return TRUE;
 }
 
 /***************************************************************/
@@ -104,23 +234,25 @@ void cycle() {
 /* Purpose   : Simulate the LC-3 for n cycles                 */
 /*                                                             */
 /***************************************************************/
-void run(int num_cycles) {
-    int i;
+void run(Machine *M, int num_cycles) {
+    long long executed;
+    double start;
 
-    if (RUN_BIT == FALSE) {
-        printf("Can't simulate, Simulator is halted\n\n");
+    if (M->RUN_BIT == FALSE) {
+        message(M, "Can't simulate, Simulator is halted\n\n");
         return;
     }
 
-    printf("Simulating for %d cycles...\n\n", num_cycles);
-    for (i = 0; i < num_cycles; i++) {
-        if (CURRENT_LATCHES.PC == 0x0000) {
-            RUN_BIT = FALSE;
-            printf("Simulator halted\n\n");
-            break;
-        }
-        cycle();
+    message(M, "Simulating for %d cycles...\n\n", num_cycles);
+    start = seconds();
+    executed = lc3_step(M, num_cycles);
+    if (breakpoint_report(M))
+        ;
+    else if (executed < num_cycles) {   /* stopped at PC == 0x0000 */
+        M->RUN_BIT = FALSE;
+        message(M, "Simulator halted\n\n");
     }
+    report_speed(M, executed, seconds() - start);
 }
 
 /***************************************************************/
@@ -130,623 +262,2634 @@ void run(int num_cycles) {
 /* Purpose   : Simulate the LC-3 until HALTed                 */
 /*                                                             */
 /***************************************************************/
-void go() {
-    if (RUN_BIT == FALSE) {
-        printf("Can't simulate, Simulator is halted\n\n");
+void go(Machine *M) {
+    long long executed;
+    double start;
+
+    if (M->RUN_BIT == FALSE) {
+        message(M, "Can't simulate, Simulator is halted\n\n");
         return;
     }
 
-    printf("Simulating...\n\n");
-    while (CURRENT_LATCHES.PC != 0x0000)
-        cycle();
-    RUN_BIT = FALSE;
-    printf("Simulator halted\n\n");
+    message(M, "Simulating...\n\n");
+    start = seconds();
+    executed = lc3_run_until_halt(M, 0);
+    if (!breakpoint_report(M)) {
+        M->RUN_BIT = FALSE;
+        message(M, "Simulator halted\n\n");
+    }
+    report_speed(M, executed, seconds() - start);
 }
 
 /***************************************************************/
 /*                                                             */
-/* Procedure : mdump                                           */
+/* Procedure : callstack                                       */
 /*                                                             */
-/* Purpose   : Dump a word-aligned region of memory to the     */
-/*             output file.                                    */
+/* Purpose   : Print the calls in progress from the R7 save    */
+/*             stack, innermost first and at most frames of    */
+/*             them: the PC of each (below the first, the      */
+/*             return address) and the subroutine it is in.    */
 /*                                                             */
 /***************************************************************/
-void mdump(FILE * dumpsim_file, int start, int stop) {
-    int address; /* this is a address */
+void callstack(Machine *M, int frames) {
+    Return_Stack *S = &M->RETURNS;
+    int k, pc = M->CURRENT_LATCHES.PC;
 
-    printf("\nMemory content [0x%.4x..0x%.4x] :\n", start, stop);
-    printf("-------------------------------------\n");
-    for (address = start ; address <= stop ; address++)
-        printf("  0x%.4x (%d) : 0x%.2x\n", address , address , MEMORY[address]);
-    printf("\n");
+    if (!S->ENABLE) {
+        printf("No call stack: the R7 save stack is off\n\n");
+        return;
+    }
+    printf("Frame     PC      Subroutine\n");
+    for (k = S->DEPTH; k > 0 && S->DEPTH - k < frames; k--) {
+        printf("#%-7d 0x%.4x  0x%.4x\n", S->DEPTH - k, pc, S->ENTRY[k - 1] >> 16);
+        pc = S->ENTRY[k - 1] & 0xFFFF;
+    }
+    if (k == 0)
+        printf("#%-7d 0x%.4x  main program\n\n", S->DEPTH, pc);
+    else
+        printf("... %d more\n\n", k + 1);
+}
 
-    /* dump the memory contents into the dumpsim file */
-    fprintf(dumpsim_file, "\nMemory content [0x%.4x..0x%.4x] :\n", start, stop);
-    fprintf(dumpsim_file, "-------------------------------------\n");
-    for (address = start ; address <= stop ; address++)
-        fprintf(dumpsim_file, " 0x%.4x (%d) : 0x%.2x\n", address , address , MEMORY[address]);
-    fprintf(dumpsim_file, "\n");
-    fflush(dumpsim_file);
+/*
+  The console input as compare() sees it: the first engine reads the
+  real input through a Recorder, one byte per read so no more is taken
+  than the machine asks for, and the others replay what it read.
+*/
+typedef struct Recorder_Struct{
+    FILE *INPUT;
+    char *DATA;             /* every byte read from INPUT */
+    size_t LENGTH, CAPACITY;
+    int CLOSED;             /* read nothing more from INPUT */
+} Recorder;
+
+ssize_t recorder_read(void *cookie, char *buffer, size_t size) {
+    Recorder *R = cookie;
+    int c;
+
+    if (R->CLOSED || size == 0 || (c = getc(R->INPUT)) == EOF)
+        return 0;
+    if (R->LENGTH == R->CAPACITY) {
+        R->CAPACITY = R->CAPACITY ? 2 * R->CAPACITY : 256;
+        R->DATA = realloc(R->DATA, R->CAPACITY);
+        assert(R->DATA != NULL);
+    }
+    R->DATA[R->LENGTH++] = (char)c;
+    buffer[0] = (char)c;
+    return 1;
 }
 
 /***************************************************************/
 /*                                                             */
-/* Procedure : rdump                                           */
+/* Procedure : compare                                         */
 /*                                                             */
-/* Purpose   : Dump current register and bus values to the     */
-/*             output file.                                    */
+/* Purpose   : Run to HALT once on every engine from the same  */
+/*             starting state, report each engine's MIPS and   */
+/*             check that they all end in the same state and   */
+/*             write the same console output. Every engine     */
+/*             reads the same input, and the output of the     */
+/*             first is the one shown. Returns FALSE if they   */
+/*             do not agree.                                   */
 /*                                                             */
 /***************************************************************/
-void rdump(FILE * dumpsim_file) {
-    int k;
-
-    printf("\nCurrent register/bus values :\n");
-    printf("-------------------------------------\n");
-    printf("Instruction Count : %d\n", INSTRUCTION_COUNT);
-    printf("PC                : 0x%.4x\n", CURRENT_LATCHES.PC);
-    printf("CCs: N = %d  Z = %d  P = %d\n", CURRENT_LATCHES.N, CURRENT_LATCHES.Z, CURRENT_LATCHES.P);
-    printf("Registers:\n");
-    for (k = 0; k < LC_3_REGS; k++)
-        printf("%d: 0x%.4x\n", k, CURRENT_LATCHES.REGS[k]);
-    printf("\n");
+int compare(Machine *M) {
+    uint16_t *saved_memory, *final_memory;
+    uint32_t *saved_returns, *final_returns;
+    System_Latches saved_latches, final_latches;
+    Events saved_events = M->EVENTS;
+    Timer saved_timer = M->TIMER;
+    long long saved_count, final_count = 0;
+    int saved_depth = M->RETURNS.DEPTH, final_depth = 0;
+    int engine, selected = M->ENGINE, same = TRUE;
+    Profile *profiler = M->PROFILE;     /* compare the engines, not the profiler */
+    Trace *tracer = M->TRACE;           /* or the trace recorder */
+    Timing *timer = M->TIMING;          /* or the timing model */
+    Breakpoints *breakpoints = M->BREAKPOINTS;  /* and run to HALT */
+    FILE *saved_input = M->CONSOLE.INPUT, *saved_output = M->CONSOLE.OUTPUT;
+    int saved_interactive = M->CONSOLE.INTERACTIVE;
+    int saved_key = M->CONSOLE.KEY, saved_key_enable = M->CONSOLE.KEY_ENABLE;
+    cookie_io_functions_t recording = { recorder_read, NULL, NULL, NULL };
+    Recorder recorder = { NULL, NULL, 0, 0, FALSE };
+    FILE *recorded = NULL;
+    char *output, *final_output = NULL;
+    size_t output_length, final_length = 0, unread = 0;
+    long long executed, written = M->CONSOLE.WRITTEN, final_written = written;
+    double start, elapsed;
+
+    if (M->RUN_BIT == FALSE) {
+        message(M, "Can't simulate, Simulator is halted\n\n");
+        return TRUE;
+    }
 
-    /* dump the state information into the dumpsim file */
-    fprintf(dumpsim_file, "\nCurrent register/bus values :\n");
-    fprintf(dumpsim_file, "-------------------------------------\n");
-    fprintf(dumpsim_file, "Instruction Count : %d\n", INSTRUCTION_COUNT);
-    fprintf(dumpsim_file, "PC                : 0x%.4x\n", CURRENT_LATCHES.PC);
-    fprintf(dumpsim_file, "CCs: N = %d  Z = %d  P = %d\n", CURRENT_LATCHES.N, CURRENT_LATCHES.Z, CURRENT_LATCHES.P);
-    fprintf(dumpsim_file, "Registers:\n");
-    for (k = 0; k < LC_3_REGS; k++)
-        fprintf(dumpsim_file, "%d: 0x%.4x\n", k, CURRENT_LATCHES.REGS[k]);
-    fprintf(dumpsim_file, "\n");
-    fflush(dumpsim_file);
+    saved_memory = malloc(sizeof(M->MEMORY));
+    final_memory = malloc(sizeof(M->MEMORY));
+    saved_returns = malloc((saved_depth + 1) * sizeof(uint32_t));
+    final_returns = NULL;
+    assert(saved_memory != NULL && final_memory != NULL && saved_returns != NULL);
+    memcpy(saved_memory, M->MEMORY, sizeof(M->MEMORY));
+    memcpy(saved_returns, M->RETURNS.ENTRY, saved_depth * sizeof(uint32_t));
+    saved_latches = M->CURRENT_LATCHES;
+    saved_count = M->INSTRUCTION_COUNT;
+
+    M->PROFILE = NULL;
+    M->TRACE = NULL;
+    M->TIMING = NULL;
+    M->BREAKPOINTS = NULL;
+    KeyboardStop(M);                    /* every engine reads in step with the machine */
+    if (saved_input != NULL) {
+        recorder.INPUT = saved_input;
+        recorded = fopencookie(&recorder, "r", recording);
+        assert(recorded != NULL);
+    }
+    printf("Engine      Instructions        Seconds       MIPS\n");
+    printf("-------------------------------------------------\n");
+    for (engine = 0; engine < ENGINE_COUNT; engine++) {
+        memcpy(M->MEMORY, saved_memory, sizeof(M->MEMORY));
+        memset(M->DECODE_CACHE, 0, sizeof(M->DECODE_CACHE));
+        JitFlush(M);
+        M->CURRENT_LATCHES = M->NEXT_LATCHES = saved_latches;
+        M->INSTRUCTION_COUNT = saved_count;
+        memcpy(M->RETURNS.ENTRY, saved_returns, saved_depth * sizeof(uint32_t));
+        M->RETURNS.DEPTH = saved_depth;
+        M->EVENTS = saved_events;
+        M->TIMER = saved_timer;
+        M->CONSOLE.KEY = saved_key;
+        M->CONSOLE.KEY_ENABLE = saved_key_enable;
+        M->CONSOLE.INTERACTIVE = FALSE;
+        if (engine == 0)
+            M->CONSOLE.INPUT = recorded;
+        else
+            M->CONSOLE.INPUT = recorder.LENGTH > 0
+                               ? fmemopen(recorder.DATA, recorder.LENGTH, "r") : NULL;
+        M->CONSOLE.OUTPUT = open_memstream(&output, &output_length);
+        assert(M->CONSOLE.OUTPUT != NULL);
+
+        M->CONSOLE.WRITTEN = written;
+        M->ENGINE = engine;
+        start = seconds();
+        executed = execute(M, LLONG_MAX);
+        elapsed = seconds() - start;
+        fclose(M->CONSOLE.OUTPUT);
+        if (engine == 0 && recorded != NULL) {
+            /* What it read but didn't take goes back to the input */
+            recorder.CLOSED = TRUE;
+            while (getc(recorded) != EOF)
+                unread++;
+            fclose(recorded);
+            while (unread > 0)
+                ungetc((unsigned char)recorder.DATA[recorder.LENGTH - unread--], saved_input);
+        }
+        else if (engine > 0 && M->CONSOLE.INPUT != NULL)
+            fclose(M->CONSOLE.INPUT);
+        printf("%-10s %13lld %14.6f %10.2f\n", ENGINE_NAMES[engine],
+               executed, elapsed, elapsed > 0 ? executed / elapsed / 1e6 : 0.0);
+
+        if (engine == 0) {
+            final_output = output;
+            final_length = output_length;
+            final_written = M->CONSOLE.WRITTEN;
+            memcpy(final_memory, M->MEMORY, sizeof(M->MEMORY));
+            final_latches = M->CURRENT_LATCHES;
+            final_count = M->INSTRUCTION_COUNT;
+            final_depth = M->RETURNS.DEPTH;
+            final_returns = malloc((final_depth + 1) * sizeof(uint32_t));
+            assert(final_returns != NULL);
+            memcpy(final_returns, M->RETURNS.ENTRY, final_depth * sizeof(uint32_t));
+        } else if (memcmp(final_memory, M->MEMORY, sizeof(M->MEMORY)) != 0
+                   || memcmp(&final_latches, &M->CURRENT_LATCHES, sizeof(System_Latches)) != 0
+                   || final_count != M->INSTRUCTION_COUNT || final_depth != M->RETURNS.DEPTH
+                   || memcmp(final_returns, M->RETURNS.ENTRY, final_depth * sizeof(uint32_t)) != 0
+                   || final_length != output_length
+                   || memcmp(final_output, output, output_length) != 0) {
+            same = FALSE;
+        }
+        if (engine > 0)
+            free(output);
+    }
+    M->ENGINE = selected;
+    M->PROFILE = profiler;
+    M->TRACE = tracer;
+    M->TIMING = timer;
+    M->BREAKPOINTS = breakpoints;
+    if (tracer != NULL)                 /* these runs were not recorded */
+        tracer->AVAILABLE = 0;
+    M->RUN_BIT = FALSE;
+    M->CONSOLE.INPUT = saved_input;
+    M->CONSOLE.INTERACTIVE = saved_interactive;
+    M->CONSOLE.OUTPUT = saved_output;
+    M->CONSOLE.WRITTEN = final_written;
+    if (M->CONSOLE.OUTPUT != NULL && final_length > 0) {
+        fwrite(final_output, 1, final_length, M->CONSOLE.OUTPUT);
+        fflush(M->CONSOLE.OUTPUT);
+    }
+    free(final_output);
+    free(recorder.DATA);
+    free(saved_memory);
+    free(final_memory);
+    free(saved_returns);
+    free(final_returns);
+
+    printf("\n%s\n\n", same ? "All engines reached the same state"
+                             : "Error: engines disagree on the final state");
+    return same;
 }
 
 /***************************************************************/
 /*                                                             */
-/* Procedure : get_command                                     */
+/* Procedure : dump_*                                          */
 /*                                                             */
-/* Purpose   : Read a command from standard input.             */
+/* Purpose   : Buffered output for mdump and rdump. A dump is  */
+/*             formatted once into Dump.BUFFER and each full   */
+/*             buffer is written to the screen and to the dump */
+/*             file, so formatting never goes through printf.  */
 /*                                                             */
 /***************************************************************/
-void get_command(FILE * dumpsim_file) {
-    char buffer[20];
-    int start, stop, cycles;
+void dump_flush(Dump *D) {
+    if (D->ECHO)
+        fwrite(D->BUFFER, 1, D->LENGTH, stdout);
+    if (D->OUTPUT != NULL)
+        fwrite(D->BUFFER, 1, D->LENGTH, D->OUTPUT);
+    D->LENGTH = 0;
+}
 
-    printf("LC-3-SIM> ");
+void dump_room(Dump *D, int bytes) {
+    if (D->LENGTH + bytes > (int)sizeof(D->BUFFER))
+        dump_flush(D);
+}
 
-    scanf("%s", buffer);
-    printf("\n");
+void dump_string(Dump *D, const char *text) {
+    int length = (int)strlen(text);
 
-    switch(buffer[0]) {
-        case 'G':
-        case 'g':
-            go();
-            break;
+    dump_room(D, length);
+    memcpy(D->BUFFER + D->LENGTH, text, length);
+    D->LENGTH += length;
+}
 
-        case 'M':
-        case 'm':
-            scanf("%i %i", &start, &stop);
-            mdump(dumpsim_file, start, stop);
+void dump_hex(Dump *D, int value, int digits) {     /* at least digits, no 0x */
+    static const char HEX[] = "0123456789abcdef";
+    int shift = value > 0xFFF ? 12 : value > 0xFF ? 8 : value > 0xF ? 4 : 0;
+
+    dump_room(D, 4);
+    if (shift < 4 * (digits - 1))
+        shift = 4 * (digits - 1);
+    for (; shift >= 0; shift -= 4)
+        D->BUFFER[D->LENGTH++] = HEX[(value >> shift) & 0xF];
+}
+
+void dump_decimal(Dump *D, long long value) {       /* value >= 0 */
+    char digits[20];
+    int n = 0;
+
+    dump_room(D, 20);
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    while (n > 0)
+        D->BUFFER[D->LENGTH++] = digits[--n];
+}
+
+void dump_ratio(Dump *D, unsigned long long part, unsigned long long total) {
+    /* part / total with two decimals, 0.00 for no total */
+    long long hundredths = total > 0 ? (long long)(100.0L * part / total + 0.5) : 0;
+
+    dump_decimal(D, hundredths / 100);
+    dump_string(D, hundredths % 100 < 10 ? ".0" : ".");
+    dump_decimal(D, hundredths % 100);
+}
+
+void dump_word(Dump *D, int value) {                /* big-endian, for binary dumps */
+    dump_room(D, 2);
+    D->BUFFER[D->LENGTH++] = (char)(value >> 8);
+    D->BUFFER[D->LENGTH++] = (char)value;
+}
+
+int dump_begin(Dump *D, int format) {   /* FALSE: nowhere to write it */
+    D->ECHO = D->SCREEN && format != DUMP_BINARY;
+    D->LENGTH = 0;
+    return D->ECHO || D->OUTPUT != NULL;
+}
+
+void dump_end(Dump *D) {
+    dump_flush(D);
+    if (D->OUTPUT != NULL)
+        fflush(D->OUTPUT);
+}
+
+int dump_format(const char *name) {     /* DUMP_*, or -1 */
+    int format;
+
+    for (format = 0; format < DUMP_FORMATS; format++)
+        if (strcmp(name, DUMP_FORMAT_NAMES[format]) == 0)
+            return format;
+    return -1;
+}
+
+/***************************************************************/
+/*                                                             */
+/* Procedure : mdump                                           */
+/*                                                             */
+/* Purpose   : Dump a word-aligned region of memory to the     */
+/*             screen (unless quiet) and the dump file (if     */
+/*             any), as text, CSV, JSON or binary. Binary is   */
+/*             the .obj format: big-endian start address, then */
+/*             big-endian words, and never goes to the screen. */
+/*                                                             */
+/***************************************************************/
+void mdump(Machine *M, Dump *D, int start, int stop, int format) {
+    int address; /* this is a address */
+
+    if (start < 0)
+        start = 0;
+    if (stop >= WORDS_IN_MEM)
+        stop = WORDS_IN_MEM - 1;
+    if (!dump_begin(D, format))
+        return;
+
+    switch (format) {
+        case DUMP_TEXT:
+            dump_string(D, "\nMemory content [0x");
+            dump_hex(D, start, 4);
+            dump_string(D, "..0x");
+            dump_hex(D, stop, 4);
+            dump_string(D, "] :\n-------------------------------------\n");
+            for (address = start ; address <= stop ; address++) {
+                dump_string(D, " 0x");
+                dump_hex(D, address, 4);
+                dump_string(D, " (");
+                dump_decimal(D, address);
+                dump_string(D, ") : 0x");
+                dump_hex(D, M->MEMORY[address], 2);
+                dump_string(D, "\n");
+            }
+            dump_string(D, "\n");
             break;
 
-        case '?':
-            help();
+        case DUMP_CSV:
+            dump_string(D, "address,value\n");
+            for (address = start ; address <= stop ; address++) {
+                dump_string(D, "0x");
+                dump_hex(D, address, 4);
+                dump_string(D, ",0x");
+                dump_hex(D, M->MEMORY[address], 4);
+                dump_string(D, "\n");
+            }
             break;
-        case 'Q':
-        case 'q':
-            printf("Bye.\n");
-            exit(0);
 
-        case 'R':
-        case 'r':
-            if (buffer[1] == 'd' || buffer[1] == 'D')
-                rdump(dumpsim_file);
-            else {
-                scanf("%d", &cycles);
-                run(cycles);
+        case DUMP_JSON:
+            dump_string(D, "{\"start\": ");
+            dump_decimal(D, start);
+            dump_string(D, ", \"memory\": [");
+            for (address = start ; address <= stop ; address++) {
+                if (address != start)
+                    dump_string(D, ", ");
+                dump_decimal(D, M->MEMORY[address]);
             }
+            dump_string(D, "]}\n");
             break;
 
-        default:
-            printf("Invalid Command\n");
+        default:                /* DUMP_BINARY */
+            dump_word(D, start);
+            for (address = start ; address <= stop ; address++)
+                dump_word(D, M->MEMORY[address]);
             break;
     }
+    dump_end(D);
 }
 
 /***************************************************************/
 /*                                                             */
-/* Procedure : init_memory                                     */
+/* Procedure : timing / timing_dump                            */
 /*                                                             */
-/* Purpose   : Zero out the memory array                       */
+/* Purpose   : Start, stop, reset and show the timing model,   */
+/*             and add its results to rdump.                   */
+/*             timing on [spec]  start it, the defaults        */
+/*                               changed by spec               */
+/*             timing reset      empty the caches, zero counts */
+/*             timing off        stop it                       */
+/*             A spec is items separated by spaces or commas:  */
+/*             l1i=, l1d= or l2=words:ways:line[:latency] (all */
+/*             powers of two) or off, memory=latency,          */
+/*             taken=cycles and <opcode>=cycles, e.g. ldi=9.   */
 /*                                                             */
 /***************************************************************/
-void init_memory() {
-    int i;
+#define TIMING_DEFAULTS "l1i=1024:2:8 l1d=1024:4:8 l2=8192:8:16:10 memory=100 taken=1"
 
-    for (i=0; i < WORDS_IN_MEM; i++) {
-        MEMORY[i] = 0;
-    }
+const char *CACHE_NAMES[CACHE_LEVELS] = { "l1i", "l1d", "l2" };
+const char *ACCESS_NAMES[ACCESS_KINDS] = { "fetch", "load", "store" };
+
+/*
+  Cycles per instruction: the states the LC-3 microsequencer goes
+  through for it (fetch and decode are four), every memory access
+  taking one.
+*/
+const char *TIMING_OP_NAMES[OP_COUNT] = {
+    "add", "add", "and", "and", "br", "jmp", "jsr", "jsrr",
+    "ld", "ldi", "ldr", "lea", "not", "st", "sti", "str", "trap", "rti", "illegal"
+};
+const int TIMING_CYCLES[OP_COUNT] = {
+    5, 5, 5, 5, 5, 5, 6, 6, 7, 9, 7, 5, 5, 7, 9, 7, 7, 13, 14
+};
+
+unsigned long long timing_stalls(const Timing *T, int kind) {
+    unsigned long long stalls = 0;
+    int level;
+
+    for (level = 0; level <= CACHE_LEVELS; level++)
+        stalls += T->STALLS[kind][level];
+    return stalls;
 }
 
-/**************************************************************/
-/*                                                            */
-/* Procedure : load_program                                   */
-/*                                                            */
-/* Purpose   : Load program and service routines into mem.    */
-/*                                                            */
-/**************************************************************/
-void load_program(char *program_filename) {
-    FILE * prog;
-    int ii, word, program_base;
+unsigned long long timing_cycles(const Timing *T) {
+    return T->BASE + timing_stalls(T, ACCESS_FETCH) + timing_stalls(T, ACCESS_LOAD)
+           + timing_stalls(T, ACCESS_STORE);
+}
 
-    /* Open program file. */
-    prog = fopen(program_filename, "r");
-    if (prog == NULL) {
-        printf("Error: Can't open program file %s\n", program_filename);
-        exit(-1);
-    }
+int timing_cache(Cache *C, const char *value) {
+    int words, ways, line, length, more, latency = C->LATENCY;
 
-    /* Read in the program. */
-    if (fscanf(prog, "%x\n", &word) != EOF)
-        program_base = word ;
-    else {
-        printf("Error: Program file is empty\n");
-        exit(-1);
+    if (strcmp(value, "off") == 0) {
+        C->WORDS = 0;
+        return TRUE;
     }
+    if (sscanf(value, "%d:%d:%d%n", &words, &ways, &line, &length) != 3)
+        return FALSE;
+    if (value[length] == ':' && sscanf(value + length, ":%d%n", &latency, &more) == 1)
+        length += more;
+    if (value[length] != '\0')
+        return FALSE;
+    if (words < 1 || words > WORDS_IN_MEM || (words & (words - 1)) || ways < 1 || (ways & (ways - 1))
+        || line < 1 || (line & (line - 1)) || ways * line > words || latency < 0)
+        return FALSE;
+    C->WORDS = words;
+    C->WAYS = ways;
+    C->LINE = line;
+    C->LATENCY = latency;
+    C->SETS = words / (ways * line);
+    for (C->SHIFT = 0; 1 << C->SHIFT < line; C->SHIFT++)
+        ;
+    return TRUE;
+}
 
-    ii = 0;
-    while (fscanf(prog, "%x\n", &word) != EOF) {
-        /* Make sure it fits. */
-        if (program_base + ii >= WORDS_IN_MEM) {
-            printf("Error: Program file %s is too long to fit in memory. %x\n",
-                   program_filename, ii);
-            exit(-1);
+int timing_parse(Timing *T, const char *spec) {
+    char item[64], *value;
+    int length, level, op, found;
+
+    for (;;) {
+        spec += strspn(spec, " ,\t\r\n");
+        if (*spec == '\0')
+            return TRUE;
+        length = (int)strcspn(spec, " ,\t\r\n");
+        snprintf(item, sizeof(item), "%.*s", length, spec);
+        spec += length;
+
+        found = FALSE;
+        if ((value = strchr(item, '=')) != NULL) {
+            *value++ = '\0';
+            for (level = 0; level < CACHE_LEVELS; level++)
+                if (strcmp(item, CACHE_NAMES[level]) == 0)
+                    found = timing_cache(&T->LEVEL[level], value);
+            if (strcmp(item, "memory") == 0)
+                found = sscanf(value, "%d", &T->MEMORY_LATENCY) == 1 && T->MEMORY_LATENCY >= 0;
+            if (strcmp(item, "taken") == 0)
+                found = sscanf(value, "%d", &T->TAKEN) == 1 && T->TAKEN >= 0;
+            for (op = 0; op < OP_COUNT; op++)
+                if (strcmp(item, TIMING_OP_NAMES[op]) == 0)
+                    found = sscanf(value, "%d", &T->CYCLES[op]) == 1 && T->CYCLES[op] >= 0;
+            value[-1] = '=';
         }
+        if (!found) {
+            printf("Error: bad timing item %s\n\n", item);
+            return FALSE;
+        }
+    }
+}
+
+void timing_reset(Timing *T) {
+    Cache *C;
+    int level;
 
-        /* Write the word to memory array. */
-        MEMORY[program_base + ii] = word;
-        ii++;
+    for (level = 0; level < CACHE_LEVELS; level++) {
+        C = &T->LEVEL[level];
+        if (C->TAGS != NULL)
+            memset(C->TAGS, 0, C->SETS * C->WAYS * sizeof(uint32_t));
+        C->ACCESSES = C->MISSES = C->WRITEBACKS = 0;
     }
+    T->INSTRUCTIONS = T->BASE = 0;
+    memset(T->STALLS, 0, sizeof(T->STALLS));
+}
 
-    if (CURRENT_LATCHES.PC == 0) CURRENT_LATCHES.PC = program_base;
+int timing_start(Machine *M, const char *spec) {
+    Timing *T = calloc(1, sizeof(Timing));
+    Cache *C;
+    int level;
 
-    printf("Read %d words from program into memory.\n\n", ii);
+    assert(T != NULL);
+    memcpy(T->CYCLES, TIMING_CYCLES, sizeof(T->CYCLES));
+    if (!timing_parse(T, TIMING_DEFAULTS) || !timing_parse(T, spec)) {
+        free(T);
+        return FALSE;
+    }
+    for (level = 0; level < CACHE_LEVELS; level++) {
+        C = &T->LEVEL[level];
+        if (C->WORDS > 0) {
+            C->TAGS = calloc(C->SETS * C->WAYS, sizeof(uint32_t));
+            assert(C->TAGS != NULL);
+        }
+    }
+    timing_free(M);
+    M->TIMING = T;
+    return TRUE;
 }
 
-/************************************************************/
-/*                                                          */
-/* Procedure : initialize                                   */
-/*                                                          */
-/* Purpose   : Load machine language program                */
-/*             and set up initial state of the machine.     */
-/*                                                          */
-/************************************************************/
-void initialize(char *program_filename, int num_prog_files) {
-    int i;
+int timing(Machine *M, char *arguments) {
+    char name[16];
+    Timing *T = M->TIMING;
+    Cache *C;
+    int length, level, op;
+
+    if (sscanf(arguments, "%15s%n", name, &length) != 1) {
+        if (T == NULL) {
+            printf("Timing model is off\n\n");
+            return TRUE;
+        }
+        printf("Timing model:");
+        for (level = 0; level < CACHE_LEVELS; level++) {
+            C = &T->LEVEL[level];
+            if (C->WORDS == 0)
+                printf(" %s=off", CACHE_NAMES[level]);
+            else
+                printf(" %s=%d:%d:%d:%d", CACHE_NAMES[level], C->WORDS, C->WAYS, C->LINE, C->LATENCY);
+        }
+        printf(" memory=%d taken=%d\n             ", T->MEMORY_LATENCY, T->TAKEN);
+        for (op = 0; op < OP_COUNT; op++)
+            if (op == 0 || strcmp(TIMING_OP_NAMES[op], TIMING_OP_NAMES[op - 1]) != 0)
+                printf(" %s=%d", TIMING_OP_NAMES[op], T->CYCLES[op]);
+        printf("\n%llu instructions timed, see rdump\n\n", T->INSTRUCTIONS);
+        return TRUE;
+    }
 
-    init_memory();
-    for ( i = 0; i < num_prog_files; i++ ) {
-        load_program(program_filename);
-        while(*program_filename++ != '\0');
+    if (strcmp(name, "off") == 0) {
+        timing_free(M);
+        return TRUE;
+    }
+    if (strcmp(name, "reset") == 0) {
+        if (T != NULL)
+            timing_reset(T);
+        return TRUE;
     }
-    CURRENT_LATCHES.Z = 1;
-    NEXT_LATCHES = CURRENT_LATCHES;
+    if (strcmp(name, "on") == 0)
+        return timing_start(M, arguments + length);
+    return FALSE;
+}
+
+void timing_dump(Machine *M, Dump *D, int format) {
+    /* The timing part of rdump, in its format */
+    static const char *TEXT_NAMES[CACHE_LEVELS] = {
+        "L1I hit rate      : ", "L1D hit rate      : ", "L2 hit rate       : " };
+    static const char *TEXT_KINDS[ACCESS_KINDS] = {
+        "Fetch stalls      : ", "Load stalls       : ", "Store stalls      : " };
+    const Timing *T = M->TIMING;
+    const Cache *C;
+    unsigned long long cycles = timing_cycles(T);
+    int level, kind;
+
+    switch (format) {
+        case DUMP_TEXT:
+            dump_string(D, "Cycles            : ");
+            dump_decimal(D, cycles);
+            dump_string(D, " (");
+            dump_decimal(D, T->BASE);
+            dump_string(D, " + ");
+            dump_decimal(D, cycles - T->BASE);
+            dump_string(D, " stalled, ");
+            dump_ratio(D, cycles, T->INSTRUCTIONS);
+            dump_string(D, " per instruction)\n");
+            for (kind = 0; kind < ACCESS_KINDS; kind++) {
+                level = kind == ACCESS_FETCH ? CACHE_L1I : CACHE_L1D;
+                dump_string(D, TEXT_KINDS[kind]);
+                dump_decimal(D, timing_stalls(T, kind));
+                dump_string(D, " (L1 ");
+                dump_decimal(D, T->STALLS[kind][level]);
+                dump_string(D, ", L2 ");
+                dump_decimal(D, T->STALLS[kind][CACHE_L2]);
+                dump_string(D, ", memory ");
+                dump_decimal(D, T->STALLS[kind][CACHE_MEMORY]);
+                dump_string(D, ")\n");
+            }
+            for (level = 0; level < CACHE_LEVELS; level++) {
+                C = &T->LEVEL[level];
+                if (C->WORDS == 0)
+                    continue;
+                dump_string(D, TEXT_NAMES[level]);
+                dump_ratio(D, 100 * (C->ACCESSES - C->MISSES), C->ACCESSES);
+                dump_string(D, "% (");
+                dump_decimal(D, C->ACCESSES);
+                dump_string(D, " accesses, ");
+                dump_decimal(D, C->MISSES);
+                dump_string(D, " misses, ");
+                dump_decimal(D, C->WRITEBACKS);
+                dump_string(D, " writebacks)\n");
+            }
+            break;
 
-    RUN_BIT = TRUE;
+        case DUMP_CSV:          /* the columns named by rdump's header */
+            dump_string(D, ",");
+            dump_decimal(D, cycles);
+            for (kind = 0; kind < ACCESS_KINDS; kind++) {
+                dump_string(D, ",");
+                dump_decimal(D, timing_stalls(T, kind));
+            }
+            for (level = 0; level < CACHE_LEVELS; level++) {
+                dump_string(D, ",");
+                if (T->LEVEL[level].WORDS > 0)
+                    dump_ratio(D, 100 * (T->LEVEL[level].ACCESSES - T->LEVEL[level].MISSES),
+                               T->LEVEL[level].ACCESSES);
+            }
+            break;
+
+        case DUMP_JSON:
+            dump_string(D, ", \"timing\": {\"cycles\": ");
+            dump_decimal(D, cycles);
+            dump_string(D, ", \"instructions\": ");
+            dump_decimal(D, T->INSTRUCTIONS);
+            dump_string(D, ", \"base_cycles\": ");
+            dump_decimal(D, T->BASE);
+            dump_string(D, ", \"stalls\": {");
+            for (kind = 0; kind < ACCESS_KINDS; kind++) {
+                dump_string(D, kind > 0 ? ", \"" : "\"");
+                dump_string(D, ACCESS_NAMES[kind]);
+                dump_string(D, "\": {\"l1\": ");
+                dump_decimal(D, T->STALLS[kind][kind == ACCESS_FETCH ? CACHE_L1I : CACHE_L1D]);
+                dump_string(D, ", \"l2\": ");
+                dump_decimal(D, T->STALLS[kind][CACHE_L2]);
+                dump_string(D, ", \"memory\": ");
+                dump_decimal(D, T->STALLS[kind][CACHE_MEMORY]);
+                dump_string(D, "}");
+            }
+            dump_string(D, "}, \"caches\": {");
+            for (level = 0; level < CACHE_LEVELS; level++) {
+                C = &T->LEVEL[level];
+                dump_string(D, level > 0 ? ", \"" : "\"");
+                dump_string(D, CACHE_NAMES[level]);
+                if (C->WORDS == 0) {
+                    dump_string(D, "\": null");
+                    continue;
+                }
+                dump_string(D, "\": {\"accesses\": ");
+                dump_decimal(D, C->ACCESSES);
+                dump_string(D, ", \"misses\": ");
+                dump_decimal(D, C->MISSES);
+                dump_string(D, ", \"writebacks\": ");
+                dump_decimal(D, C->WRITEBACKS);
+                dump_string(D, ", \"hit_rate\": ");
+                dump_ratio(D, 100 * (C->ACCESSES - C->MISSES), C->ACCESSES);
+                dump_string(D, "}");
+            }
+            dump_string(D, "}}");
+            break;
+    }
 }
 
 /***************************************************************/
 /*                                                             */
-/* Procedure : main                                            */
+/* Procedure : rdump                                           */
+/*                                                             */
+/* Purpose   : Dump current register and bus values to the     */
+/*             screen (unless quiet) and the dump file (if     */
+/*             any), as text, CSV, JSON or binary. Binary is   */
+/*             big-endian: the instruction count (32 bits),    */
+/*             then PC, N, Z, P, R0-R7 and PSR (16 bits each). */
+/*             While timing, all but binary dumps add cycles,  */
+/*             stalls and hit rates, see timing_dump().        */
 /*                                                             */
 /***************************************************************/
-int main(int argc, char *argv[]) {
-    FILE * dumpsim_file;
+void rdump(Machine *M, Dump *D, int format) {
+    static const char *CSV_HEADER =
+        "instruction_count,pc,n,z,p,r0,r1,r2,r3,r4,r5,r6,r7,psr";
+    static const char *CSV_TIMING_HEADER =
+        ",cycles,fetch_stalls,load_stalls,store_stalls,l1i_hit_rate,l1d_hit_rate,l2_hit_rate";
+    const System_Latches *L = &M->CURRENT_LATCHES;
+    int k;
 
-    /* Error Checking */
-    if (argc < 2) {
-        printf("Error: usage: %s <program_file_1> <program_file_2> ...\n",
-               argv[0]);
-        exit(1);
-    }
+    if (!dump_begin(D, format))
+        return;
 
-    printf("LC-3 Simulator\n\n");
+    switch (format) {
+        case DUMP_TEXT:
+            dump_string(D, "\nCurrent register/bus values :\n-------------------------------------\n");
+            dump_string(D, "Instruction Count : ");
+            dump_decimal(D, M->INSTRUCTION_COUNT);
+            dump_string(D, "\nPC                : 0x");
+            dump_hex(D, L->PC, 4);
+            dump_string(D, "\nCCs: N = ");
+            dump_decimal(D, L->N);
+            dump_string(D, "  Z = ");
+            dump_decimal(D, L->Z);
+            dump_string(D, "  P = ");
+            dump_decimal(D, L->P);
+            dump_string(D, "\nPSR               : 0x");
+            dump_hex(D, GetPSR(M), 4);
+            dump_string(D, L->PRIV ? " (user, priority " : " (supervisor, priority ");
+            dump_decimal(D, L->PRIORITY);
+            dump_string(D, ")\nRegisters:\n");
+            for (k = 0; k < LC_3_REGS; k++) {
+                dump_decimal(D, k);
+                dump_string(D, ": 0x");
+                dump_hex(D, L->REGS[k], 4);
+                dump_string(D, "\n");
+            }
+            if (M->TIMING != NULL)
+                timing_dump(M, D, format);
+            dump_string(D, "\n");
+            break;
+
+        case DUMP_CSV:
+            dump_string(D, CSV_HEADER);
+            dump_string(D, M->TIMING != NULL ? CSV_TIMING_HEADER : "");
+            dump_string(D, "\n");
+            dump_decimal(D, M->INSTRUCTION_COUNT);
+            dump_string(D, ",0x");
+            dump_hex(D, L->PC, 4);
+            dump_string(D, L->N ? ",1" : ",0");
+            dump_string(D, L->Z ? ",1" : ",0");
+            dump_string(D, L->P ? ",1" : ",0");
+            for (k = 0; k < LC_3_REGS; k++) {
+                dump_string(D, ",0x");
+                dump_hex(D, L->REGS[k], 4);
+            }
+            dump_string(D, ",0x");
+            dump_hex(D, GetPSR(M), 4);
+            if (M->TIMING != NULL)
+                timing_dump(M, D, format);
+            dump_string(D, "\n");
+            break;
 
-    initialize(argv[1], argc - 1);
+        case DUMP_JSON:
+            dump_string(D, "{\"instruction_count\": ");
+            dump_decimal(D, M->INSTRUCTION_COUNT);
+            dump_string(D, ", \"pc\": ");
+            dump_decimal(D, L->PC);
+            dump_string(D, ", \"n\": ");
+            dump_decimal(D, L->N);
+            dump_string(D, ", \"z\": ");
+            dump_decimal(D, L->Z);
+            dump_string(D, ", \"p\": ");
+            dump_decimal(D, L->P);
+            dump_string(D, ", \"registers\": [");
+            for (k = 0; k < LC_3_REGS; k++) {
+                if (k > 0)
+                    dump_string(D, ", ");
+                dump_decimal(D, L->REGS[k]);
+            }
+            dump_string(D, "], \"psr\": ");
+            dump_decimal(D, GetPSR(M));
+            if (M->TIMING != NULL)
+                timing_dump(M, D, format);
+            dump_string(D, "}\n");
+            break;
 
-    if ( (dumpsim_file = fopen( "dumpsim", "w" )) == NULL ) {
-        printf("Error: Can't open dumpsim file\n");
-        exit(-1);
+        default:                /* DUMP_BINARY */
+            dump_word(D, (M->INSTRUCTION_COUNT >> 16) & 0xFFFF);
+            dump_word(D, M->INSTRUCTION_COUNT & 0xFFFF);
+            dump_word(D, L->PC);
+            dump_word(D, L->N);
+            dump_word(D, L->Z);
+            dump_word(D, L->P);
+            for (k = 0; k < LC_3_REGS; k++)
+                dump_word(D, L->REGS[k]);
+            dump_word(D, GetPSR(M));
+            break;
     }
+    dump_end(D);
+}
 
-    while (1)
-        get_command(dumpsim_file);
+/***************************************************************/
+/*                                                             */
+/* Procedure : profile                                         */
+/*                                                             */
+/* Purpose   : Turn the profiler on, off or reset it, or print */
+/*             what it has counted: the hottest addresses, the */
+/*             opcode mix, the hottest loops (taken backward   */
+/*             branches) and the most called subroutines.      */
+/*                                                             */
+/***************************************************************/
+#define PROFILE_MAX_TOP 100
+
+int profile_top(const unsigned long long *count, int *top, int n) {
+    /* Indices of the n largest non-zero counts, largest first */
+    int address, found = 0, k;
+
+    for (address = 0; address < WORDS_IN_MEM; address++) {
+        if (count[address] == 0 || (found == n && count[address] <= count[top[n - 1]]))
+            continue;
+        k = found < n ? found++ : n - 1;
+        for (; k > 0 && count[top[k - 1]] < count[address]; k--)
+            top[k] = top[k - 1];
+        top[k] = address;
+    }
+    return found;
+}
 
+double profile_percent(unsigned long long part, unsigned long long total) {
+    return total > 0 ? 100.0 * part / total : 0.0;
 }
-/***************************************************************/
-/* Do not modify the above code.
-   You are allowed to use the following global variables in your
-   code. These are defined above.
 
-   MEMORY
+void profile(Machine *M, int n) {
+    Profile *P = M->PROFILE;
+    Decoded_Instruction *D;
+    unsigned long long total = 0, *body;
+    int top[PROFILE_MAX_TOP], found, k, op, address, target;
+
+    if (P == NULL) {
+        printf("Profiler is off: use profile on\n\n");
+        return;
+    }
+    if (n > PROFILE_MAX_TOP)
+        n = PROFILE_MAX_TOP;
+    for (op = 0; op < OP_COUNT; op++)
+        total += P->OP_COUNT[op];
+    printf("Profile of %llu instructions\n\n", total);
+
+    printf("Hottest addresses:\n");
+    found = profile_top(P->PC_COUNT, top, n);
+    for (k = 0; k < found; k++) {
+        address = top[k];
+        D = &M->DECODE_CACHE[address];
+        if (D->Handler == NULL)
+            Decode(M->MEMORY[address], D);
+        printf("  0x%.4x %15llu %6.2f%%  %s\n", address, P->PC_COUNT[address],
+               profile_percent(P->PC_COUNT[address], total), OP_NAMES[D->Op]);
+    }
 
-   CURRENT_LATCHES
-   NEXT_LATCHES
+    printf("\nOpcodes:\n");
+    for (op = 0; op < OP_COUNT; op++) {
+        if (op == OP_BR) {
+            printf("  %-12s %15llu %6.2f%%\n", "BR taken", P->BR_TAKEN,
+                   profile_percent(P->BR_TAKEN, total));
+            printf("  %-12s %15llu %6.2f%%\n", "BR not taken", P->OP_COUNT[op] - P->BR_TAKEN,
+                   profile_percent(P->OP_COUNT[op] - P->BR_TAKEN, total));
+        }
+        else if (P->OP_COUNT[op] > 0)
+            printf("  %-12s %15llu %6.2f%%\n", OP_NAMES[op], P->OP_COUNT[op],
+                   profile_percent(P->OP_COUNT[op], total));
+    }
 
-   You may define your own local/global variables and functions.
-   You may use the functions to get at the control bits defined
-   above.
+    /* A loop is a taken backward branch; its body is target..branch */
+    body = calloc(WORDS_IN_MEM, sizeof(unsigned long long));
+    assert(body != NULL);
+    for (address = 0; address < WORDS_IN_MEM; address++) {
+        D = &M->DECODE_CACHE[address];
+        if (P->TAKEN[address] == 0)
+            continue;
+        if (D->Handler == NULL)
+            Decode(M->MEMORY[address], D);
+        target = Low16bits(address + 1 + D->Imm);
+        if (D->Op != OP_BR || target > address)
+            continue;
+        for (k = target; k <= address; k++)
+            body[address] += P->PC_COUNT[k];
+    }
+    printf("\nHottest loops:\n");
+    found = profile_top(body, top, n);
+    for (k = 0; k < found; k++) {
+        address = top[k];
+        printf("  0x%.4x..0x%.4x %15llu iterations %15llu instructions %6.2f%%\n",
+               Low16bits(address + 1 + M->DECODE_CACHE[address].Imm), address,
+               P->TAKEN[address], body[address], profile_percent(body[address], total));
+    }
+    free(body);
 
-   Begin your code here 	  			       */
+    printf("\nMost called (JSR/JSRR targets):\n");
+    found = profile_top(P->CALLS, top, n);
+    for (k = 0; k < found; k++)
+        printf("  0x%.4x %15llu calls\n", top[k], P->CALLS[top[k]]);
+    printf("\n");
+}
 
 /***************************************************************/
+/*                                                             */
+/* Procedure : trace / rstep                                   */
+/*                                                             */
+/* Purpose   : Start, stop and report the trace recorder, and  */
+/*             undo the last n traced instructions.            */
+/*             trace on [n]    keep the last n records         */
+/*             trace file f    also append every record to f   */
+/*             trace off       stop and forget the records     */
+/*                                                             */
+/***************************************************************/
+#define TRACE_DEFAULT_RECORDS (1 << 20)
+
+int trace(Machine *M, char *arguments) {
+    char name[16], filename[256];
+    long long records = TRACE_DEFAULT_RECORDS;
+    Trace *T = M->TRACE;
+
+    if (sscanf(arguments, "%15s", name) != 1) {
+        if (T == NULL)
+            printf("Trace recorder is off\n\n");
+        else
+            printf("Traced %lld instructions, the last %lld can be undone (room for %lld)%s\n\n",
+                   T->RECORDED, T->AVAILABLE, T->CAPACITY,
+                   T->OUTPUT != NULL ? ", all written to file" : "");
+        return TRUE;
+    }
 
-#define Low16bits(x) ((x) & 0xFFFF)
+    if (strcmp(name, "off") == 0) {
+        trace_free(M);
+        return TRUE;
+    }
+    if (strcmp(name, "on") == 0) {
+        if (sscanf(arguments, "%*s %lld", &records) == 1 && records < 1)
+            return FALSE;
+        if (T != NULL && T->CAPACITY == records)
+            return TRUE;
+        if (T != NULL) {            /* resize: the old records go */
+            free(T->RING);
+            T->RING = NULL;
+        }
+        else
+            T = M->TRACE = calloc(1, sizeof(Trace));
+        assert(T != NULL);
+        T->RING = malloc(records * sizeof(Trace_Record));
+        if (T->RING == NULL) {
+            printf("Error: Can't allocate %lld trace records\n\n", records);
+            trace_free(M);
+            return FALSE;
+        }
+        T->CAPACITY = records;
+        T->HEAD = T->AVAILABLE = T->RECORDED = 0;
+        return TRUE;
+    }
+    if (strcmp(name, "file") == 0) {
+        if (sscanf(arguments, "%*s %255s", filename) != 1)
+            return FALSE;
+        if (T == NULL && !trace(M, "on"))
+            return FALSE;
+        T = M->TRACE;
+        if (T->OUTPUT != NULL)
+            fclose(T->OUTPUT);
+        if ((T->OUTPUT = fopen(filename, "wb")) == NULL) {
+            printf("Error: Can't create trace file %s\n\n", filename);
+            return FALSE;
+        }
+        return TRUE;
+    }
+    return FALSE;
+}
 
-int Instruction;
+int rstep(Machine *M, int steps) {
+    int undone = 0;
 
-/* Stack */
-/*
- * 0x4000 -- 0x3FFB
- * Stack to save R7 automatically
- * top_p is the pointer to the top of the stack
- * pop to get the top of stack
- * push to put latch into stack
- */
-int top_p = 0x4000;
+    if (M->TRACE == NULL) {
+        printf("Error: rstep needs the trace recorder: use trace on\n\n");
+        return FALSE;
+    }
+    while (undone < steps && TraceUndo(M))
+        undone++;
+    if (undone > 0)
+        M->RUN_BIT = TRUE;
+    message(M, "Stepped back %d instructions to PC 0x%.4x\n\n", undone, M->CURRENT_LATCHES.PC);
+    return TRUE;
+}
 
-int IsEmpty(){
-    return top_p == 0x4000;
+/***************************************************************/
+/*                                                             */
+/* Procedure : snapshot / restore                              */
+/*                                                             */
+/* Purpose   : Save the whole machine state to a file, and     */
+/*             load it back. The file is a Snapshot_Header     */
+/*             followed by MEMORY exactly as it is held here,  */
+/*             then the R7 save stack entries, so restore maps */
+/*             it and copies it in without parsing anything.   */
+/*             Both return FALSE on error.                     */
+/*                                                             */
+/***************************************************************/
+#define SNAPSHOT_MAGIC      "LC3SNAP"
+#define SNAPSHOT_VERSION    4
+
+typedef struct Snapshot_Header_Struct{
+    char MAGIC[8];                  /* SNAPSHOT_MAGIC */
+    int VERSION;                    /* SNAPSHOT_VERSION */
+    int ENDIAN_MARK;                /* 0x01020304 as written by the host */
+    int WORDS;                      /* WORDS_IN_MEM */
+    System_Latches LATCHES;
+    long long INSTRUCTION_COUNT;
+    int RUN_BIT;
+    int RETURN_DEPTH;               /* entries after MEMORY */
+    int RETURN_ENABLE;
+    Events EVENTS;
+    Timer TIMER;
+    int KEY_ENABLE;
+} Snapshot_Header;
+
+int snapshot(Machine *M, char *filename) {
+    Snapshot_Header header;
+    FILE *file;
+    int ok;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.MAGIC, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.VERSION = SNAPSHOT_VERSION;
+    header.ENDIAN_MARK = 0x01020304;
+    header.WORDS = WORDS_IN_MEM;
+    header.LATCHES = M->CURRENT_LATCHES;
+    header.INSTRUCTION_COUNT = M->INSTRUCTION_COUNT;
+    header.RUN_BIT = M->RUN_BIT;
+    header.RETURN_DEPTH = M->RETURNS.DEPTH;
+    header.RETURN_ENABLE = M->RETURNS.ENABLE;
+    header.EVENTS = M->EVENTS;
+    header.TIMER = M->TIMER;
+    header.KEY_ENABLE = M->CONSOLE.KEY_ENABLE;
+
+    if ((file = fopen(filename, "wb")) == NULL) {
+        printf("Error: Can't create snapshot file %s\n\n", filename);
+        return FALSE;
+    }
+    ok = fwrite(&header, sizeof(header), 1, file) == 1
+         && fwrite(M->MEMORY, sizeof(M->MEMORY), 1, file) == 1
+         && fwrite(M->RETURNS.ENTRY, sizeof(uint32_t), M->RETURNS.DEPTH, file)
+            == (size_t)M->RETURNS.DEPTH;
+    ok = fclose(file) == 0 && ok;
+    if (!ok) {
+        printf("Error: Can't write snapshot file %s\n\n", filename);
+        return FALSE;
+    }
+    message(M, "Saved snapshot to %s\n\n", filename);
+    return TRUE;
 }
 
-int POP(){
-    top_p += 1;
-    return MEMORY[top_p - 1];
+#define IS_FLAG(x) ((x) == 0 || (x) == 1)
+#define IS_WORD(x) ((x) == Low16bits(x))
+
+int snapshot_valid(const Snapshot_Header *H) {
+    /* Every field in its architectural range: nothing restored indexes out of bounds */
+    const System_Latches *L = &H->LATCHES;
+    int k, valid;
+
+    valid = IS_WORD(L->PC) && IS_FLAG(L->N) && IS_FLAG(L->Z) && IS_FLAG(L->P)
+            && IS_FLAG(L->PRIV) && L->PRIORITY >= 0 && L->PRIORITY <= 7
+            && IS_WORD(L->SAVED_SSP) && IS_WORD(L->SAVED_USP)
+            && H->INSTRUCTION_COUNT >= 0 && IS_FLAG(H->RUN_BIT) && IS_FLAG(H->RETURN_ENABLE)
+            && (H->EVENTS.ARMED & ~((1 << EVENT_KINDS) - 1)) == 0 && IS_FLAG(H->EVENTS.DIRTY)
+            && IS_WORD(H->TIMER.INTERVAL) && IS_FLAG(H->TIMER.ENABLE)
+            && IS_FLAG(H->TIMER.EXPIRED) && IS_FLAG(H->TIMER.RESTART) && IS_FLAG(H->KEY_ENABLE);
+    for (k = 0; k < LC_3_REGS; k++)
+        valid = valid && IS_WORD(L->REGS[k]);
+    return valid;
 }
 
-int PUSH(int R7){
-    top_p -= 1;
-    MEMORY[top_p] = R7;
-    return 0;
+int restore(Machine *M, char *filename) {
+    const Snapshot_Header *header;
+    struct stat info;
+    void *image;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        printf("Error: Can't open snapshot file %s\n\n", filename);
+        if (fd >= 0)
+            close(fd);
+        return FALSE;
+    }
+    if (info.st_size < (off_t)(sizeof(Snapshot_Header) + sizeof(M->MEMORY))) {
+        printf("Error: %s is not a snapshot of this simulator\n\n", filename);
+        close(fd);
+        return FALSE;
+    }
+    image = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        printf("Error: Can't map snapshot file %s\n\n", filename);
+        return FALSE;
+    }
+
+    header = image;
+    if (memcmp(header->MAGIC, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0
+        || header->VERSION != SNAPSHOT_VERSION || header->ENDIAN_MARK != 0x01020304
+        || header->WORDS != WORDS_IN_MEM || header->RETURN_DEPTH < 0
+        || header->RETURN_DEPTH > RETURN_STACK_MAX || !snapshot_valid(header)
+        || info.st_size != (off_t)(sizeof(Snapshot_Header) + sizeof(M->MEMORY)
+                                   + header->RETURN_DEPTH * sizeof(uint32_t))) {
+        printf("Error: %s is not a snapshot of this simulator\n\n", filename);
+        munmap(image, info.st_size);
+        return FALSE;
+    }
+
+    while (M->RETURNS.CAPACITY < header->RETURN_DEPTH)
+        if (!GrowReturns(M)) {
+            printf("Error: Can't allocate the R7 save stack of %s\n\n", filename);
+            munmap(image, info.st_size);
+            return FALSE;
+        }
+    memcpy(M->MEMORY, header + 1, sizeof(M->MEMORY));
+    M->CURRENT_LATCHES = M->NEXT_LATCHES = header->LATCHES;
+    M->INSTRUCTION_COUNT = header->INSTRUCTION_COUNT;
+    M->RUN_BIT = header->RUN_BIT;
+    memcpy(M->RETURNS.ENTRY, (const char *)(header + 1) + sizeof(M->MEMORY),
+           header->RETURN_DEPTH * sizeof(uint32_t));
+    M->RETURNS.DEPTH = header->RETURN_DEPTH;
+    M->RETURNS.ENABLE = header->RETURN_ENABLE;
+    M->EVENTS = header->EVENTS;
+    M->TIMER = header->TIMER;
+    WriteDevice(M, IO_KBSR, header->KEY_ENABLE << 14);
+    munmap(image, info.st_size);
+
+    memset(M->DECODE_CACHE, 0, sizeof(M->DECODE_CACHE));
+    JitFlush(M);
+    if (M->TRACE != NULL)               /* nothing before this can be undone */
+        M->TRACE->AVAILABLE = 0;
+    message(M, "Restored %s at instruction %lld\n\n", filename, M->INSTRUCTION_COUNT);
+    return TRUE;
 }
 
-/* End of stack */
-
-int SetCC(int Result);  /* Update condition code */
-int SEXT(int num, int length);  /* Sign extension */
-int ADD(int Inst);  /* 0001 *//* SetCC */
-int AND(int Inst);  /* 0101 *//* SetCC */
-int BR(int Inst);   /* 0000 */
-int JMP(int Inst);  /* 1100 */
-int JSR(int Inst);  /* 0100 */
-int JSRR(int Inst); /* 0100 */
-int LD(int Inst);   /* 0010 *//* SetCC */
-int LDI(int Inst);  /* 1010 *//* SetCC */
-int LDR(int Inst);  /* 0110 *//* SetCC */
-int LEA(int Inst);  /* 1110 */
-int NOT(int Inst);  /* 1001 *//* SetCC */
-int ST(int Inst);   /* 0011 */
-int STI(int Inst);  /* 1011 */
-int STR(int Inst);  /* 0111 */
-int TRAP(); /* 1111 *//* Halt */
-
-void process_instruction(){
-    /*  function: process_instruction
-     *
-     *    Process one instruction at a time
-     *       -Fetch one instruction
-     *       -Decode
-     *       -Execute
-     *       -Update NEXT_LATCHES
-     */
+/***************************************************************/
+/*                                                             */
+/* Procedure : aot                                             */
+/*                                                             */
+/* Purpose   : Translate the program at the PC into a C file   */
+/*             that runs it natively, see AotTranslate().      */
+/*             Returns FALSE on error.                         */
+/*                                                             */
+/***************************************************************/
+int aot(Machine *M, char *filename) {
+    int blocks, instructions = 0, ok;
+    FILE *file;
 
-    /* Fetch */
-    Instruction = MEMORY[CURRENT_LATCHES.PC];
-    CURRENT_LATCHES.PC += 1;
-    Instruction = Low16bits(Instruction);
+    if (M->CURRENT_LATCHES.PC == 0x0000 || M->CURRENT_LATCHES.PC >= IO_PAGE) {
+        printf("Error: No program to translate at PC 0x%.4x\n\n", M->CURRENT_LATCHES.PC);
+        return FALSE;
+    }
+    if (M->CONSOLE.KEY_ENABLE || M->TIMER.ENABLE || M->TIMER.INTERVAL != 0) {
+        printf("Error: Can't translate with interrupts or the timer enabled\n\n");
+        return FALSE;
+    }
+    if ((file = fopen(filename, "w")) == NULL) {
+        printf("Error: Can't create %s\n\n", filename);
+        return FALSE;
+    }
+    blocks = AotTranslate(M, file, &instructions);
+    ok = fclose(file) == 0 && blocks > 0;
+    if (blocks < 0) {
+        printf("Error: Out of memory translating to %s\n\n", filename);
+        return FALSE;
+    }
+    if (!ok) {
+        printf("Error: Can't write %s\n\n", filename);
+        return FALSE;
+    }
+    message(M, "Wrote %s: %d instructions in %d blocks\n\n", filename, instructions, blocks);
+    return TRUE;
+}
 
-    /* Decode */
-    int Op = Instruction & 0xF000;  /* Instruction[15:12] */
+/***************************************************************/
+/*                                                             */
+/* Procedure : do_command                                      */
+/*                                                             */
+/* Purpose   : Carry out one command line. Returns COMMAND_OK, */
+/*             COMMAND_QUIT, or COMMAND_ERROR for a command    */
+/*             that is unknown, malformed or failed.           */
+/*                                                             */
+/***************************************************************/
+#define COMMAND_OK    0
+#define COMMAND_QUIT  1
+#define COMMAND_ERROR 2
 
-    /* Execute */
-    switch (Op) {
-        case 0x1000:    /* 0001 */
-            ADD(Instruction);
-            break;
+int do_command(Machine *M, Dump *dump, char *line) {
+    char buffer[20], filename[256], name[16];
+    int start, stop, cycles, length, format = dump->FORMAT;
 
-        case 0x5000:    /* 0101 */
-            AND(Instruction);
-            break;
+    if (sscanf(line, "%19s%n", buffer, &length) != 1)
+        return COMMAND_OK;      /* blank line */
+    line += length;
 
-        case 0x0000:    /* 0000 */
-            BR(Instruction);
+    switch(buffer[0]) {
+        case 'G':
+        case 'g':
+            go(M);
             break;
 
-        case 0xC000:    /* 1100 */
-            JMP(Instruction);
+        case 'A':
+        case 'a':
+            if (sscanf(line, "%255s", filename) != 1) {
+                printf("Error: usage: aot file.c\n\n");
+                return COMMAND_ERROR;
+            }
+            if (!aot(M, filename))
+                return COMMAND_ERROR;
             break;
 
-        case 0x4000:    /* 0100 */
-            if((Instruction & 0x0800) >> 11)    /* Instruction[11] = 1 */
-                JSR(Instruction);
-            else    /* Instruction[11] = 0 */
-                JSRR(Instruction);
+        case 'M':
+        case 'm':
+            length = sscanf(line, "%i %i %15s", &start, &stop, name);
+            if (length < 2 || (length == 3 && (format = dump_format(name)) < 0)) {
+                printf("Error: usage: mdump low high [text|csv|json|binary]\n\n");
+                return COMMAND_ERROR;
+            }
+            mdump(M, dump, start, stop, format);
             break;
 
-        case 0x2000:    /* 0010 */
-            LD(Instruction);
+        case 'C':
+        case 'c':
+            if (buffer[1] == 'a' || buffer[1] == 'A') {
+                if (sscanf(line, "%d", &cycles) != 1)
+                    cycles = 20;
+                callstack(M, cycles);
+            }
+            else if (!compare(M))
+                return COMMAND_ERROR;
             break;
 
-        case 0xA000:    /* 1010 */
-            LDI(Instruction);
+        case 'P':
+        case 'p':
+            if (sscanf(line, "%15s", name) != 1)
+                profile(M, 10);
+            else if (strcmp(name, "on") == 0) {
+                if (M->PROFILE == NULL)
+                    M->PROFILE = calloc(1, sizeof(Profile));
+                assert(M->PROFILE != NULL);
+            }
+            else if (strcmp(name, "off") == 0) {
+                free(M->PROFILE);
+                M->PROFILE = NULL;
+            }
+            else if (strcmp(name, "reset") == 0) {
+                if (M->PROFILE != NULL)
+                    memset(M->PROFILE, 0, sizeof(Profile));
+            }
+            else if (sscanf(name, "%d", &cycles) == 1 && cycles > 0)
+                profile(M, cycles);
+            else {
+                printf("Error: usage: profile [on|off|reset|n]\n\n");
+                return COMMAND_ERROR;
+            }
             break;
 
-        case 0x6000:    /* 0110 */
-            LDR(Instruction);
+        case 'B':
+        case 'b':
+            if (sscanf(line, "%15s", name) != 1)
+                breakpoint_list(M);
+            else if (!breakpoint_set(M, FALSE, line)) {
+                printf("Error: usage: break [address]\n\n");
+                return COMMAND_ERROR;
+            }
             break;
 
-        case 0xE000:    /* 1110 */
-            LEA(Instruction);
+        case 'W':
+        case 'w':
+            if (!breakpoint_set(M, TRUE, line)) {
+                printf("Error: usage: watch low [high]\n\n");
+                return COMMAND_ERROR;
+            }
             break;
 
-        case 0x9000:    /* 1001 */
-            NOT(Instruction);
+        case 'D':
+        case 'd':
+            if (!breakpoint_delete(M, line)) {
+                printf("Error: usage: delete [address of a break or watch]\n\n");
+                return COMMAND_ERROR;
+            }
             break;
 
-        case 0x3000:    /* 0011 */
-            ST(Instruction);
+        case 'T':
+        case 't':
+            if (buffer[1] == 'i' || buffer[1] == 'I') {
+                if (!timing(M, line)) {
+                    printf("Error: usage: timing [on [spec]|reset|off]\n\n");
+                    return COMMAND_ERROR;
+                }
+            }
+            else if (!trace(M, line)) {
+                printf("Error: usage: trace [on [records]|file name|off]\n\n");
+                return COMMAND_ERROR;
+            }
             break;
 
-        case 0xB000:    /* 1011 */
-            STI(Instruction);
+        case '?':
+            help();
             break;
-
-        case 0x7000:    /* 0111 */
-            STR(Instruction);
+        case 'Q':
+        case 'q':
+            message(M, "Bye.\n");
+            return COMMAND_QUIT;
+
+        case 'S':
+        case 's':
+            if (sscanf(line, "%255s", filename) != 1) {
+                printf("Error: usage: snapshot file\n\n");
+                return COMMAND_ERROR;
+            }
+            if (!snapshot(M, filename))
+                return COMMAND_ERROR;
             break;
 
-        case 0xF000:    /* 1111 */
-            TRAP();
+        case 'R':
+        case 'r':
+            if (buffer[1] == 'd' || buffer[1] == 'D') {
+                if (sscanf(line, "%15s", name) == 1 && (format = dump_format(name)) < 0) {
+                    printf("Error: usage: rdump [text|csv|json|binary]\n\n");
+                    return COMMAND_ERROR;
+                }
+                rdump(M, dump, format);
+            }
+            else if (buffer[1] == 's' || buffer[1] == 'S') {
+                if (sscanf(line, "%d", &cycles) != 1)
+                    cycles = 1;
+                if (!rstep(M, cycles))
+                    return COMMAND_ERROR;
+            }
+            else if (buffer[1] == 'e' || buffer[1] == 'E') {
+                if (sscanf(line, "%255s", filename) != 1) {
+                    printf("Error: usage: restore file\n\n");
+                    return COMMAND_ERROR;
+                }
+                if (!restore(M, filename))
+                    return COMMAND_ERROR;
+            }
+            else {
+                if (sscanf(line, "%d", &cycles) != 1) {
+                    printf("Error: usage: run n\n\n");
+                    return COMMAND_ERROR;
+                }
+                run(M, cycles);
+            }
             break;
 
         default:
-            break;
+            printf("Invalid Command\n");
+            return COMMAND_ERROR;
     }
-
-    /* Update NEXT_LATCHES */
-    NEXT_LATCHES = CURRENT_LATCHES;
+    return COMMAND_OK;
 }
 
+/***************************************************************/
+/*                                                             */
+/* Procedure : get_command                                     */
+/*                                                             */
+/* Purpose   : Read a command from input and carry it out.     */
+/*             Commands read from a script are echoed after    */
+/*             the prompt, as a terminal would. End of input   */
+/*             counts as quit.                                 */
+/*                                                             */
+/***************************************************************/
+int get_command(Machine *M, Dump *dump, FILE * input) {
+    char line[512];
 
-int SetCC(int Result){      /* Set the condition code */
+    message(M, "LC-3-SIM> ");
 
-    if(Result == 0){    /* Zero */
-        CURRENT_LATCHES.N = 0;
-        CURRENT_LATCHES.Z = 1;
-        CURRENT_LATCHES.P = 0;
-        return 0;
+    if (fgets(line, sizeof(line), input) == NULL) {
+        message(M, "\n");
+        return COMMAND_QUIT;
     }
+    if (input != stdin)
+        message(M, "%s", line);
+    message(M, "\n");
 
-    int Sign = Low16bits(Result) & 0x8000;  /* Sign bit */
+    return do_command(M, dump, line);
+}
 
-    if(Sign == 0){  /* Positive */
-        CURRENT_LATCHES.N = 0;
-        CURRENT_LATCHES.Z = 0;
-        CURRENT_LATCHES.P = 1;
-        return 0;
+/***************************************************************/
+/*                                                             */
+/* Procedure : script                                          */
+/*                                                             */
+/* Purpose   : Run the commands given with --exec (separated   */
+/*             by ';'), then those of the --script file, with  */
+/*             no interactive shell. Stops at the first failed */
+/*             command or quit. Returns the exit status:       */
+/*             EXIT_HALTED, EXIT_RUNNING or EXIT_ERROR.        */
+/*                                                             */
+/***************************************************************/
+#define EXIT_HALTED  0      /* the program ran to HALT */
+#define EXIT_ERROR   1      /* a command failed */
+#define EXIT_RUNNING 2      /* commands ran out before HALT */
+
+int script(Machine *M, Dump *dump, char *commands, char *script_filename) {
+    FILE *input;
+    char *command;
+    int status = COMMAND_OK;
+
+    for (command = commands != NULL ? strtok(commands, ";") : NULL;
+         command != NULL && status == COMMAND_OK; command = strtok(NULL, ";")) {
+        while (*command == ' ')
+            command++;
+        message(M, "LC-3-SIM> %s\n\n", command);
+        status = do_command(M, dump, command);
     }
 
-    if(Sign > 0){   /* Negative */
-        CURRENT_LATCHES.N = 1;
-        CURRENT_LATCHES.Z = 0;
-        CURRENT_LATCHES.P = 0;
-        return 0;
+    if (script_filename != NULL && status == COMMAND_OK) {
+        input = strcmp(script_filename, "-") == 0 ? stdin : fopen(script_filename, "r");
+        if (input == NULL) {
+            printf("Error: Can't open script file %s\n", script_filename);
+            return EXIT_ERROR;
+        }
+        while ((status = get_command(M, dump, input)) == COMMAND_OK)
+            ;
+        if (input != stdin)
+            fclose(input);
     }
-}
 
-int SEXT(int num, int length){  /* Sign extension */
-    int Sign;
-    switch (length) {
-        case 5:     /* imm5 */
-            Sign = (num & 0x0010) >> 4;
-            if(Sign)        /* Negative */
-                num += 0xFFE0;  /* Extend with 1 */
-            break;
+    if (status == COMMAND_ERROR)
+        return EXIT_ERROR;
+    return M->RUN_BIT ? EXIT_RUNNING : EXIT_HALTED;
+}
 
-        case 6:     /* PCoffset6 */
-            Sign = (num & 0x0020) >> 5;
-            if(Sign)
-                num += 0xFFC0;
-            break;
+Machine *create_machine(int engine) {
+    /* lc3_create(), which the shell can't go on without */
+    Machine *M = lc3_create(engine);
 
-        case 9:     /* PCoffset9 */
-            Sign = (num & 0x0100) >> 8;
-            if(Sign)
-                num += 0xFE00;
-            break;
+    if (M == NULL) {
+        printf("Error: Can't allocate machine\n");
+        exit(-1);
+    }
+    return M;
+}
 
-        case 11:    /* PCoffset11 */
-            Sign = (num & 0x0400) >> 10;
-            if(Sign)
-                num += 0xF800;
-            break;
+/***************************************************************/
+/*                                                             */
+/* Procedure : batch                                           */
+/*                                                             */
+/* Purpose   : Run every job of a list file on a pool of       */
+/*             worker threads, one machine per worker, and     */
+/*             print a summary line per job in list order.     */
+/*             A job is one line naming its program files.     */
+/*             Console output is counted, not shown; every job */
+/*             reads the --input file from the start. With     */
+/*             lanes > 1 a worker takes that many jobs at a    */
+/*             time and runs them together on RunLockstep().   */
+/*                                                             */
+/***************************************************************/
+#define BATCH_HALTED 0      /* PC reached 0x0000 */
+#define BATCH_BUDGET 1      /* still running when the budget ran out */
+#define BATCH_ERROR  2      /* a program file could not be loaded */
+
+typedef struct Batch_Job_Struct{
+    char *Files[16];        /* main program first, as on the command line */
+    int File_Count;
+    int Status;             /* BATCH_* */
+    long long Executed;
+    long long Lockstep;     /* of those, run by RunLockstep() */
+    long long Output;       /* console bytes written */
+    long long Instruction_Count;
+    System_Latches Latches;
+} Batch_Job;
 
-        default:
-            break;
+/*
+  Work-stealing queue: each worker starts with a contiguous share of
+  the jobs and takes them from the front; an idle worker steals from
+  the back of another worker's share. Jobs are whole programs, so one
+  lock per queue is cheap next to the work it protects.
+*/
+typedef struct Batch_Queue_Struct{
+    pthread_mutex_t Lock;
+    int Head, Tail;         /* groups [Head, Tail) not yet started */
+} Batch_Queue;
+
+typedef struct Batch_Pool_Struct{
+    Batch_Job *Jobs;
+    int Count;
+    int Lanes;              /* jobs per group */
+    Batch_Queue *Queues;
+    int Workers;
+    int Engine;
+    long long Budget;
+    char *Input;            /* console input of every job, or NULL */
+} Batch_Pool;
+
+typedef struct Batch_Worker_Struct{
+    Batch_Pool *Pool;
+    int Id;
+} Batch_Worker;
+
+int batch_take(Batch_Pool *pool, int id) {
+    Batch_Queue *queue;
+    int i, job = -1;
+
+    for (i = 0; i < pool->Workers && job < 0; i++) {
+        queue = &pool->Queues[(id + i) % pool->Workers];
+        pthread_mutex_lock(&queue->Lock);
+        if (queue->Head < queue->Tail)
+            job = i == 0 ? queue->Head++ : --queue->Tail;
+        pthread_mutex_unlock(&queue->Lock);
     }
-    num = Low16bits(num);
-    return num;
+    return job;
 }
 
-int ADD(int Inst){
-    int DR = (Inst & 0x0E00) >> 9;
-    int SR1 = (Inst & 0x01C0) >> 6;
-
-    if((Inst & 0x0020) == 0) {      /* Instruction[5] = 0 */
-        int SR2 = (Inst & 0x0007);
-        CURRENT_LATCHES.REGS[DR]
-                = CURRENT_LATCHES.REGS[SR1] + CURRENT_LATCHES.REGS[SR2];
+void *batch_worker(void *arg) {
+    Batch_Worker *worker = arg;
+    Batch_Pool *pool = worker->Pool;
+    Machine *machines[LOCKSTEP_LANES], *lanes[LOCKSTEP_LANES], *M;
+    Batch_Job *job, *jobs[LOCKSTEP_LANES];
+    long long executed[LOCKSTEP_LANES];
+    int group, count, i;
+
+    for (i = 0; i < pool->Lanes; i++) {
+        machines[i] = create_machine(pool->Engine);
+        lc3_set_console(machines[i], NULL, NULL);
     }
+    while ((group = batch_take(pool, worker->Id)) >= 0) {
+        count = 0;
+        for (i = group * pool->Lanes; i < pool->Count && i < (group + 1) * pool->Lanes; i++) {
+            job = &pool->Jobs[i];
+            M = machines[count];
+            if (pool->Input == NULL)
+                lc3_set_console(M, NULL, NULL);     /* counts the output from 0 */
+            if ((pool->Input != NULL && lc3_open_input(M, pool->Input) < 0)
+                || !initialize(M, job->Files, job->File_Count, FALSE)) {
+                job->Status = BATCH_ERROR;
+                continue;
+            }
+            jobs[count] = job;
+            lanes[count++] = M;
+        }
+        if (count > 1)
+            RunLockstep(lanes, count, pool->Budget, executed);
+        else
+            executed[0] = 0;
+
+        for (i = 0; i < count; i++) {
+            M = lanes[i];
+            job = jobs[i];
+            job->Lockstep = executed[i];
+            job->Executed = executed[i] + lc3_step(M, pool->Budget - executed[i]);
+            job->Output = lc3_output_count(M);
+            job->Status = lc3_halted(M) ? BATCH_HALTED : BATCH_BUDGET;
+            job->Instruction_Count = lc3_instruction_count(M);
+            job->Latches = M->CURRENT_LATCHES;
+        }
+    }
+    for (i = 0; i < pool->Lanes; i++)
+        lc3_destroy(machines[i]);
+    return NULL;
+}
 
-    else{      /* Instruction[5] = 1 */
-        int imm5 = (Inst & 0x001F);
-        CURRENT_LATCHES.REGS[DR] = CURRENT_LATCHES.REGS[SR1] + SEXT(imm5, 5);
+int batch(char *list_filename, char *input_filename, int workers, int lanes, int engine,
+          long long budget) {
+    static const char *status_names[] = { "halted", "budget", "error" };
+    FILE *list;
+    char line[4096], *token;
+    Batch_Job *jobs = NULL;
+    Batch_Pool pool;
+    Batch_Worker *threads;
+    pthread_t *ids;
+    int count = 0, capacity = 0, failed = 0, groups, i, k;
+    long long total = 0, lockstep = 0;
+    double start, elapsed;
+
+    list = strcmp(list_filename, "-") == 0 ? stdin : fopen(list_filename, "r");
+    if (list == NULL) {
+        printf("Error: Can't open batch list %s\n", list_filename);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), list) != NULL) {
+        if (count == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            jobs = realloc(jobs, capacity * sizeof(Batch_Job));
+            assert(jobs != NULL);
+        }
+        memset(&jobs[count], 0, sizeof(Batch_Job));
+        for (token = strtok(line, " \t\r\n"); token != NULL && jobs[count].File_Count < 16;
+             token = strtok(NULL, " \t\r\n"))
+            jobs[count].Files[jobs[count].File_Count++] = strdup(token);
+        if (jobs[count].File_Count > 0)
+            count++;
+    }
+    if (list != stdin)
+        fclose(list);
+
+    if (lanes < 1 || lanes > LOCKSTEP_LANES)
+        lanes = lanes < 1 ? 1 : LOCKSTEP_LANES;
+    groups = (count + lanes - 1) / lanes;
+    if (workers > groups)
+        workers = groups > 0 ? groups : 1;
+    pool.Jobs = jobs;
+    pool.Count = count;
+    pool.Lanes = lanes;
+    pool.Workers = workers;
+    pool.Engine = engine;
+    pool.Budget = budget;
+    pool.Input = input_filename;
+    pool.Queues = calloc(workers, sizeof(Batch_Queue));
+    threads = calloc(workers, sizeof(Batch_Worker));
+    ids = calloc(workers, sizeof(pthread_t));
+    assert(pool.Queues != NULL && threads != NULL && ids != NULL);
+    for (i = 0; i < workers; i++) {
+        pthread_mutex_init(&pool.Queues[i].Lock, NULL);
+        pool.Queues[i].Head = (int)((long long)groups * i / workers);
+        pool.Queues[i].Tail = (int)((long long)groups * (i + 1) / workers);
     }
 
-    CURRENT_LATCHES.REGS[DR] = Low16bits(CURRENT_LATCHES.REGS[DR]);
-    SetCC(CURRENT_LATCHES.REGS[DR]);
-    return 0;
+    start = seconds();
+    for (i = 0; i < workers; i++) {
+        threads[i].Pool = &pool;
+        threads[i].Id = i;
+        if (pthread_create(&ids[i], NULL, batch_worker, &threads[i]) != 0) {
+            printf("Error: Can't start worker thread\n");
+            exit(-1);
+        }
+    }
+    for (i = 0; i < workers; i++)
+        pthread_join(ids[i], NULL);
+    elapsed = seconds() - start;
+
+    for (i = 0; i < count; i++) {
+        printf("%s: %s", jobs[i].Files[0], status_names[jobs[i].Status]);
+        if (jobs[i].Status != BATCH_ERROR) {
+            printf(", %lld instructions, PC=0x%.4x N=%d Z=%d P=%d", jobs[i].Instruction_Count,
+                   jobs[i].Latches.PC, jobs[i].Latches.N, jobs[i].Latches.Z, jobs[i].Latches.P);
+            for (k = 0; k < LC_3_REGS; k++)
+                printf(" R%d=0x%.4x", k, jobs[i].Latches.REGS[k]);
+            if (jobs[i].Output > 0)
+                printf(", %lld bytes of output", jobs[i].Output);
+            total += jobs[i].Executed;
+            lockstep += jobs[i].Lockstep;
+        }
+        else
+            failed++;
+        printf("\n");
+        for (k = 0; k < jobs[i].File_Count; k++)
+            free(jobs[i].Files[k]);
+    }
+    printf("\n%d jobs on %d workers in %.6f s: %.2f MIPS (%s engine)\n",
+           count, workers, elapsed, elapsed > 0 ? total / elapsed / 1e6 : 0.0,
+           ENGINE_NAMES[engine]);
+    if (lanes > 1)
+        printf("%d lanes: %.1f%% of instructions run in lockstep\n",
+               lanes, total > 0 ? 100.0 * lockstep / total : 0.0);
+
+    for (i = 0; i < workers; i++)
+        pthread_mutex_destroy(&pool.Queues[i].Lock);
+    free(pool.Queues);
+    free(threads);
+    free(ids);
+    free(jobs);
+    return failed ? 1 : 0;
 }
 
-int AND(int Inst){
-    int DR = (Inst & 0x0E00) >> 9;
-    int SR1 = (Inst & 0x01C0) >> 6;
+/***************************************************************/
+/*                                                             */
+/* Procedure : serve                                           */
+/*                                                             */
+/* Purpose   : Run programs sent over a Unix domain socket,    */
+/*             until killed. Each of workers threads keeps one */
+/*             machine and serves one connection at a time;    */
+/*             accepted connections wait in a queue of at most */
+/*             SERVE_QUEUE, and while it is full no more are   */
+/*             accepted. Images are cached by content, see     */
+/*             serve_request() for the protocol. Without       */
+/*             --budget no request runs more than SERVE_BUDGET */
+/*             instructions, so every one gets its reply.      */
+/*                                                             */
+/***************************************************************/
+#define SERVE_QUEUE  64             /* accepted connections waiting for a worker */
+#define SERVE_IMAGES 256            /* images cached, the least recently used dropped */
+#define SERVE_BYTES  (64 << 20)     /* ... and at most this much memory held by them */
+#define SERVE_LIMIT  (1 << 20)      /* largest image or input accepted, in bytes */
+#define SERVE_OUTPUT (1 << 20)      /* console output returned per request */
+#define SERVE_OBJECT (2 * WORDS_IN_MEM + 2)
+#define SERVE_BUDGET 100000000LL    /* the budget without --budget: a request has to end */
 
-    if((Inst & 0x0020) == 0) {            /* Instruction[5] = 0 */
-        int SR2 = (Inst & 0x0007);
-        CURRENT_LATCHES.REGS[DR] = CURRENT_LATCHES.REGS[SR1] & CURRENT_LATCHES.REGS[SR2];
-    }
+/*
+  An image is found by the bytes sent, compared in full: Key, a hash of
+  them, only narrows the search. run hash names an image by Key and
+  Serial, which no later image reuses, so an evicted image's name never
+  finds another one.
+*/
+typedef struct Serve_Image_Struct{
+    uint64_t Key;                   /* hash of the format and the bytes sent */
+    unsigned long long Serial;      /* numbers the images cached, from 1 */
+    int Format;                     /* LC3_FORMAT_* of Source */
+    unsigned char *Source;          /* the bytes sent */
+    size_t Source_Size;
+    unsigned char *Object;          /* the words loaded, as an .obj image */
+    size_t Size;
+    unsigned long long Used;        /* Clock when last used, 0: empty */
+} Serve_Image;
+
+typedef struct Serve_Pool_Struct{
+    pthread_mutex_t Lock;           /* of everything below */
+    pthread_cond_t Ready;           /* a connection is queued */
+    pthread_cond_t Room;            /* the queue is not full */
+    int Queue[SERVE_QUEUE];         /* accepted sockets, a ring */
+    int Head, Count;
+    Serve_Image Images[SERVE_IMAGES];
+    size_t Bytes;                   /* held by Images */
+    unsigned long long Clock, Serials;
+    int Engine;
+    long long Budget;               /* the most one request may run */
+} Serve_Pool;
+
+typedef struct Serve_Buffers_Struct{
+    unsigned char Image[SERVE_LIMIT];
+    unsigned char Input[SERVE_LIMIT];
+    unsigned char Object[SERVE_OBJECT];
+    char Output[SERVE_OUTPUT + 1];  /* fmemopen() ends a full buffer with a NUL */
+} Serve_Buffers;
+
+uint64_t serve_hash(int format, const unsigned char *data, size_t size) {
+    uint64_t hash = 14695981039346656037ULL ^ (uint64_t)format;     /* FNV-1a */
+    size_t i;
+
+    for (i = 0; i < size; i++)
+        hash = (hash ^ data[i]) * 1099511628211ULL;
+    return hash;
+}
 
-    else{       /* Instruction[5] = 1 */
-        int imm5 = (Inst & 0x001F);
-        CURRENT_LATCHES.REGS[DR] = CURRENT_LATCHES.REGS[SR1] & SEXT(imm5, 5);
+int serve_match(const Serve_Image *image, uint64_t key, unsigned long long serial, int format,
+                const unsigned char *source, size_t source_size) {
+    if (image->Used == 0 || image->Key != key)
+        return FALSE;
+    if (serial != 0)
+        return image->Serial == serial;
+    return image->Format == format && image->Source_Size == source_size
+           && memcmp(image->Source, source, source_size) == 0;
+}
+
+int serve_lookup(Serve_Pool *pool, uint64_t key, unsigned long long *serial, int format,
+                 const unsigned char *source, size_t source_size,
+                 unsigned char *object, size_t *size) {
+    /*
+     * Copy the cached image named by *serial (if not 0) or else sent as
+     * source to object and set *serial; FALSE if it isn't cached
+     */
+    Serve_Image *image;
+    int i, found = FALSE;
+
+    pthread_mutex_lock(&pool->Lock);
+    for (i = 0; i < SERVE_IMAGES && !found; i++) {
+        image = &pool->Images[i];
+        if (serve_match(image, key, *serial, format, source, source_size)) {
+            memcpy(object, image->Object, image->Size);
+            *size = image->Size;
+            *serial = image->Serial;
+            image->Used = ++pool->Clock;
+            found = TRUE;
+        }
     }
+    pthread_mutex_unlock(&pool->Lock);
+    return found;
+}
 
-    CURRENT_LATCHES.REGS[DR] = Low16bits(CURRENT_LATCHES.REGS[DR]);
-    SetCC(CURRENT_LATCHES.REGS[DR]);
-    return 0;
+void serve_evict(Serve_Pool *pool, Serve_Image *image) {
+    pool->Bytes -= image->Source_Size + image->Size;
+    free(image->Source);
+    free(image->Object);
+    memset(image, 0, sizeof(Serve_Image));
 }
 
-int BR(int Inst){
-    int PCoffset9 = Inst & 0x01FF;
-    int n = (Inst & 0x0800) >> 11;
-    int z = (Inst & 0x0400) >> 10;
-    int p = (Inst & 0x0200) >> 9;
+unsigned long long serve_insert(Serve_Pool *pool, uint64_t key, int format,
+                                const unsigned char *source, size_t source_size,
+                                const unsigned char *object, size_t size) {
+    /* Cache an image; returns its Serial, 0 if it couldn't be kept */
+    unsigned char *source_copy = malloc(source_size), *object_copy = malloc(size);
+    unsigned long long serial = 0;
+    Serve_Image *image = NULL;
+    int i, victim;
+
+    if (source_copy == NULL || object_copy == NULL) {
+        free(source_copy);
+        free(object_copy);
+        return 0;                   /* served, just not cached */
+    }
+    memcpy(source_copy, source, source_size);
+    memcpy(object_copy, object, size);
+    pthread_mutex_lock(&pool->Lock);
+    for (i = 0; i < SERVE_IMAGES && serial == 0; i++)
+        if (serve_match(&pool->Images[i], key, 0, format, source, source_size))
+            serial = pool->Images[i].Serial;   /* another worker got there first */
+    while (serial == 0 && image == NULL) {
+        for (i = 0, victim = -1; i < SERVE_IMAGES; i++) {
+            if (pool->Images[i].Used == 0)
+                image = &pool->Images[i];
+            else if (victim < 0 || pool->Images[i].Used < pool->Images[victim].Used)
+                victim = i;         /* the least recently used */
+        }
+        if (image != NULL && pool->Bytes + source_size + size > SERVE_BYTES)
+            image = NULL;
+        if (image == NULL && victim < 0)
+            break;                  /* too big for the cache on its own */
+        if (image == NULL)
+            serve_evict(pool, &pool->Images[victim]);
+    }
+    if (image != NULL) {
+        image->Key = key;
+        image->Serial = serial = ++pool->Serials;
+        image->Format = format;
+        image->Source = source_copy;
+        image->Source_Size = source_size;
+        image->Object = object_copy;
+        image->Size = size;
+        image->Used = ++pool->Clock;
+        pool->Bytes += source_size + size;
+    }
+    pthread_mutex_unlock(&pool->Lock);
+    if (image == NULL) {
+        free(source_copy);
+        free(object_copy);
+    }
+    return serial;
+}
 
-    int flag = n * CURRENT_LATCHES.N + z * CURRENT_LATCHES.Z + p * CURRENT_LATCHES.P;  /* Condition */
+void serve_reply(FILE *out, lc3_machine *M, const char *status, uint64_t key,
+                 unsigned long long serial, int cached, const char *output, long length,
+                 long long written) {
+    int psr = lc3_get_psr(M), k, c;
+    long i;
+
+    fprintf(out, "{\"status\": \"%s\", \"image\": \"%016llx-%llu\", \"cached\": %s, "
+            "\"instruction_count\": %lld, \"pc\": %d, \"n\": %d, \"z\": %d, \"p\": %d, "
+            "\"registers\": [", status, (unsigned long long)key, serial, cached ? "true" : "false",
+            lc3_instruction_count(M), lc3_get_pc(M), (psr >> 2) & 1, (psr >> 1) & 1, psr & 1);
+    for (k = 0; k < LC3_REGISTERS; k++)
+        fprintf(out, k > 0 ? ", %d" : "%d", lc3_get_register(M, k));
+    fprintf(out, "], \"psr\": %d, \"output\": \"", psr);
+    for (i = 0; i < length; i++) {
+        c = (unsigned char)output[i];
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20 || c >= 0x7F)     /* bytes as Latin-1 */
+            fprintf(out, "\\u%04x", c);
+        else
+            putc(c, out);
+    }
+    fprintf(out, "\", \"truncated\": %s}\n", written > length ? "true" : "false");
+}
 
-    if(flag){
-        CURRENT_LATCHES.PC += SEXT(PCoffset9, 9);
-        CURRENT_LATCHES.PC = Low16bits(CURRENT_LATCHES.PC);
+/***************************************************************/
+/*                                                             */
+/* Procedure : serve_request                                   */
+/*                                                             */
+/* Purpose   : Read one request from in, run it on M from a    */
+/*             fresh state and write the reply to out. A       */
+/*             request is the line                             */
+/*               run hex|obj <bytes> <input bytes> <budget>    */
+/*             followed by the image and its console input, or */
+/*               run hash <image> <input bytes> <budget>       */
+/*             followed by the input, for an image sent before */
+/*             (<image> as in the reply). A budget of 0, or    */
+/*             over --budget, is --budget. The reply is one    */
+/*             line of JSON: status (halted, budget or error), */
+/*             image, cached, the rdump fields, the console    */
+/*             output and whether it was truncated. Returns    */
+/*             FALSE when the connection is to be closed.      */
+/*                                                             */
+/***************************************************************/
+int serve_request(Serve_Pool *pool, lc3_machine *M, Serve_Buffers *B, FILE *in, FILE *out) {
+    char line[128], format[8], image[48];
+    FILE *input, *output;
+    size_t size = 0, source_size = 0;
+    unsigned long long serial = 0, name;
+    uint64_t key;
+    long long budget, written;
+    long length;
+    int object, input_size, cached, words, origin, i;
+
+    if (fgets(line, sizeof(line), in) == NULL)
+        return FALSE;
+    if (sscanf(line, "run %7s %47s %d %lld", format, image, &input_size, &budget) != 4
+        || input_size < 0 || input_size > SERVE_LIMIT) {
+        fprintf(out, "{\"status\": \"error\", \"error\": \"usage: run hex|obj <bytes> "
+                "<input bytes> <budget>, or run hash <image> <input bytes> <budget>\"}\n");
+        return FALSE;               /* the rest of the stream can't be trusted */
+    }
+    object = strcmp(format, "obj") == 0;
+    if (strcmp(format, "hash") == 0 && sscanf(image, "%llx-%llu", &name, &serial) == 2
+        && serial != 0) {
+        key = name;
+        cached = serve_lookup(pool, key, &serial, object, NULL, 0, B->Object, &size);
+    }
+    else if ((object || strcmp(format, "hex") == 0)
+             && (source_size = strtoul(image, NULL, 10)) > 0 && source_size <= SERVE_LIMIT) {
+        if (fread(B->Image, 1, source_size, in) != source_size)
+            return FALSE;
+        key = serve_hash(object, B->Image, source_size);
+        cached = serve_lookup(pool, key, &serial, object, B->Image, source_size,
+                              B->Object, &size);
+    }
+    else {
+        fprintf(out, "{\"status\": \"error\", \"error\": \"bad image %s %s\"}\n", format, image);
+        return FALSE;
+    }
+    if (input_size > 0 && fread(B->Input, 1, input_size, in) != (size_t)input_size)
+        return FALSE;
+
+    lc3_reset(M);
+    if (cached)
+        lc3_load_buffer(M, B->Object, size, LC3_FORMAT_OBJECT);
+    else if (strcmp(format, "hash") == 0) {
+        fprintf(out, "{\"status\": \"error\", \"error\": \"image %s is not cached\"}\n",
+                image);
+        return TRUE;
+    }
+    else if ((words = lc3_load_buffer(M, B->Image, source_size,
+                                      object ? LC3_FORMAT_OBJECT : LC3_FORMAT_HEX)) < 0) {
+        fprintf(out, "{\"status\": \"error\", \"error\": \"image can't be loaded\"}\n");
+        return TRUE;
+    }
+    else {                          /* keep the words loaded, the hex already parsed */
+        origin = lc3_get_pc(M);
+        B->Object[0] = origin >> 8;
+        B->Object[1] = origin & 0xFF;
+        for (i = 0; i < words; i++) {
+            B->Object[2 + 2 * i] = lc3_read_memory(M, origin + i) >> 8;
+            B->Object[3 + 2 * i] = lc3_read_memory(M, origin + i) & 0xFF;
+        }
+        serial = serve_insert(pool, key, object, B->Image, source_size,
+                              B->Object, 2 + 2 * (size_t)words);
     }
 
-    return 0;
+    input = input_size > 0 ? fmemopen(B->Input, input_size, "r") : NULL;
+    output = fmemopen(B->Output, sizeof(B->Output), "w");
+    if (budget <= 0 || budget > pool->Budget)
+        budget = pool->Budget;
+    lc3_set_console(M, input, output);
+    lc3_run_until_halt(M, budget);
+    written = lc3_output_count(M);      /* before the console is set again */
+    lc3_set_console(M, NULL, NULL);
+    length = 0;
+    if (output != NULL) {
+        fflush(output);
+        length = ftell(output);
+        fclose(output);
+        if (length > SERVE_OUTPUT)      /* the NUL, not the program's */
+            length = SERVE_OUTPUT;
+    }
+    if (input != NULL)
+        fclose(input);
+    serve_reply(out, M, lc3_halted(M) ? "halted" : "budget", key, serial, cached, B->Output,
+                length, written);
+    return TRUE;
 }
 
-int JMP(int Inst){
-    int BaseR = (Inst & 0x01C0) >> 6;
-    if(BaseR == 7 && !IsEmpty())        /* RET */
-        CURRENT_LATCHES.REGS[7] = POP();
-
-    CURRENT_LATCHES.PC = Low16bits(CURRENT_LATCHES.REGS[BaseR]);
-    return 0;
+void *serve_worker(void *arg) {
+    Serve_Pool *pool = arg;
+    Serve_Buffers *buffers = malloc(sizeof(Serve_Buffers));
+    lc3_machine *M = create_machine(pool->Engine);
+    FILE *in, *out;
+    int fd;
+
+    assert(buffers != NULL);
+    for (;;) {
+        pthread_mutex_lock(&pool->Lock);
+        while (pool->Count == 0)
+            pthread_cond_wait(&pool->Ready, &pool->Lock);
+        fd = pool->Queue[pool->Head];
+        pool->Head = (pool->Head + 1) % SERVE_QUEUE;
+        pool->Count--;
+        pthread_cond_signal(&pool->Room);
+        pthread_mutex_unlock(&pool->Lock);
+
+        in = fdopen(fd, "r");
+        out = fdopen(dup(fd), "w");
+        if (in == NULL || out == NULL) {
+            if (in != NULL)
+                fclose(in);
+            else
+                close(fd);
+            if (out != NULL)
+                fclose(out);
+            continue;
+        }
+        while (serve_request(pool, M, buffers, in, out) && fflush(out) == 0)
+            ;
+        fclose(out);
+        fclose(in);
+    }
+    return NULL;
 }
 
-int JSR(int Inst){
-    CURRENT_LATCHES.REGS[7] = CURRENT_LATCHES.PC;  /* Save R7 first */
-    PUSH(CURRENT_LATCHES.REGS[7]);
+int serve(char *path, int workers, int engine, long long budget) {
+    static Serve_Pool pool;
+    struct sockaddr_un address;
+    struct stat info;
+    pthread_t id;
+    int listener, fd, i;
 
-    int PCoffset11 = Inst & 0x07FF;
-    CURRENT_LATCHES.PC += SEXT(PCoffset11, 11);
-    CURRENT_LATCHES.PC = Low16bits(CURRENT_LATCHES.PC);
-    return 0;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        printf("Error: socket path %s is too long\n", path);
+        return 1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    if (stat(path, &info) == 0 && S_ISSOCK(info.st_mode))
+        unlink(path);               /* left by an earlier server */
+    if ((listener = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+        || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0
+        || listen(listener, SERVE_QUEUE) != 0) {
+        printf("Error: Can't listen on %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);       /* a client gone mid-reply fails the write instead */
+
+    pthread_mutex_init(&pool.Lock, NULL);
+    pthread_cond_init(&pool.Ready, NULL);
+    pthread_cond_init(&pool.Room, NULL);
+    pool.Engine = engine;
+    pool.Budget = budget == LLONG_MAX ? SERVE_BUDGET : budget;
+    for (i = 0; i < workers; i++)
+        if (pthread_create(&id, NULL, serve_worker, &pool) != 0) {
+            printf("Error: Can't start worker thread\n");
+            exit(-1);
+        }
+    printf("Serving %s on %d workers (%s engine, budget %lld)\n", path, workers,
+           ENGINE_NAMES[engine], pool.Budget);
+    fflush(stdout);
+
+    for (;;) {
+        if ((fd = accept(listener, NULL, NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            printf("Error: accept on %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        pthread_mutex_lock(&pool.Lock);
+        while (pool.Count == SERVE_QUEUE)   /* backpressure: stop accepting */
+            pthread_cond_wait(&pool.Room, &pool.Lock);
+        pool.Queue[(pool.Head + pool.Count++) % SERVE_QUEUE] = fd;
+        pthread_cond_signal(&pool.Ready);
+        pthread_mutex_unlock(&pool.Lock);
+    }
 }
 
-int JSRR(int Inst){
-    CURRENT_LATCHES.REGS[7] = CURRENT_LATCHES.PC;   /* Save R7 first */
-    PUSH(CURRENT_LATCHES.REGS[7]);
-
-    int BaseR = (Inst & 0x01C0) >> 6;
-    CURRENT_LATCHES.PC = Low16bits(CURRENT_LATCHES.REGS[BaseR]);
+/***************************************************************/
+/*                                                             */
+/* Procedure : bench                                           */
+/*                                                             */
+/* Purpose   : Run each program to HALT repeats times on a     */
+/*             fresh machine, as go does, and print its speed: */
+/*             mean MIPS and ns per instruction, and the       */
+/*             standard deviation of MIPS over the runs.       */
+/*             Loading is not timed, console output is         */
+/*             dropped and each run reads input_filename from  */
+/*             the start. Returns 1 if a program failed to     */
+/*             load, else 0.                                   */
+/*                                                             */
+/***************************************************************/
+int bench(char *program_filenames[], int count, char *input_filename, int engine,
+          int fast_forward, int repeats) {
+    Machine *M;
+    long long executed = 0;
+    double elapsed, mips, sum, sum_squares, mean, deviation;
+    int i, run;
+
+    printf("%-24s %12s %10s %10s %8s   (%s engine, %d runs)\n", "workload", "instructions",
+           "MIPS", "ns/instr", "stddev", ENGINE_NAMES[engine], repeats);
+    for (i = 0; i < count; i++) {
+        sum = sum_squares = 0;
+        for (run = 0; run < repeats; run++) {
+            M = create_machine(engine);
+            M->QUIET = TRUE;
+            M->FAST_FORWARD = fast_forward;
+            lc3_set_console(M, NULL, NULL);
+            if ((input_filename != NULL && lc3_open_input(M, input_filename) < 0)
+                || !initialize(M, &program_filenames[i], 1, FALSE)) {
+                lc3_destroy(M);
+                return 1;
+            }
+            elapsed = seconds();
+            executed = lc3_run_until_halt(M, 0);
+            elapsed = seconds() - elapsed;
+            lc3_destroy(M);
+
+            mips = elapsed > 0 ? executed / elapsed / 1e6 : 0.0;
+            sum += mips;
+            sum_squares += mips * mips;
+        }
+        mean = sum / repeats;
+        deviation = repeats > 1 ? (sum_squares - sum * mean) / (repeats - 1) : 0.0;
+        deviation = deviation > 0 ? sqrt(deviation) : 0.0;
+        printf("%-24s %12lld %10.2f %10.3f %7.1f%%\n", program_filenames[i], executed, mean,
+               mean > 0 ? 1e3 / mean : 0.0, mean > 0 ? 100 * deviation / mean : 0.0);
+    }
+    printf("\n");
     return 0;
 }
 
-int LD(int Inst){
-    int DR = (Inst & 0x0E00) >> 9;
-    int PCoffset9 = Inst & 0x01FF;
-
-    int Addr = Low16bits((CURRENT_LATCHES.PC + SEXT(PCoffset9, 9)));
-    CURRENT_LATCHES.REGS[DR] = Low16bits(MEMORY[Addr]);
+/***************************************************************/
+/*                                                             */
+/* Procedure : fuzz                                            */
+/*                                                             */
+/* Purpose   : Differential fuzzing: generate count random     */
+/*             well-formed programs, run each on the switch    */
+/*             engine and on the engine under test, and        */
+/*             compare the whole machine state every           */
+/*             FUZZ_CHECKPOINT instructions. The first         */
+/*             divergence is narrowed down to the instruction  */
+/*             where it appears, the program is shrunk to the  */
+/*             fewest words that still show it, and written    */
+/*             out as fuzz-<seed>.hex. Returns 1 on a          */
+/*             divergence, else 0.                             */
+/*                                                             */
+/***************************************************************/
+#define FUZZ_BASE       0x3000
+#define FUZZ_BUDGET     10000   /* instructions per program by default */
+#define FUZZ_CHECKPOINT 256
+
+unsigned fuzz_random(uint64_t *state, unsigned n) {    /* 0 .. n-1, xorshift64 */
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (unsigned)((*state >> 32) % n);
+}
 
-    SetCC(CURRENT_LATCHES.REGS[DR]);
-    return 0;
+int fuzz_offset(int from, int to, int bits) {   /* PC-relative field of the word at from */
+    return (to - (from + 1)) & ((1 << bits) - 1);
 }
 
-int LDI(int Inst){
-    int DR = (Inst & 0x0E00) >> 9;
-    int PCoffset9 = Inst & 0x01FF;
+void fuzz_generate(uint16_t *image, unsigned long long seed) {
+    /*
+     * Code at FUZZ_BASE, then the constants the prologue loads, a
+     * timer/exception handler, data words and pointers to them. Only
+     * R0-R5 are written, so R6 stays the supervisor stack, and branches
+     * never land on the second word of an address-forming pair. Half
+     * the programs run the timer, half drop to user mode first.
+     */
+    uint64_t s = (seed + 1) * 0x9E3779B97F4A7C15ULL;
+    int n = 48 + (int)fuzz_random(&s, 128);
+    int cells = FUZZ_BASE + n, handler = cells + 6, data = handler + 5, ptrs = data + 48;
+    int subs[4], p = FUZZ_BASE, i, k, r, base, target, word;
+    unsigned char entry[256];
+
+    memset(image, 0, WORDS_IN_MEM * sizeof(uint16_t));
+    memset(entry, TRUE, sizeof(entry));
+    for (k = 0; k < 4; k++)
+        subs[k] = FUZZ_BASE + 16 + (int)fuzz_random(&s, n - 24);
+
+    /* Constants: SSP, timer period, TMR value, TMI and TMR pointers, user PSR */
+    image[cells] = FUZZ_BASE;
+    image[cells + 1] = 5 + fuzz_random(&s, 300);
+    image[cells + 2] = 0x4000;
+    image[cells + 3] = IO_TMI;
+    image[cells + 4] = IO_TMR;
+    image[cells + 5] = 0x8002;
+
+    /* Prologue */
+    image[p] = 0x2000 | (6 << 9) | fuzz_offset(p, cells, 9), p++;           /* LD R6, SSP */
+    if (fuzz_random(&s, 2)) {
+        image[p] = 0x2000 | fuzz_offset(p, cells + 1, 9), p++;              /* LD R0, period */
+        image[p] = 0xB000 | fuzz_offset(p, cells + 3, 9), p++;              /* STI R0, TMI */
+        image[p] = 0x2000 | fuzz_offset(p, cells + 2, 9), p++;              /* LD R0, enable */
+        image[p] = 0xB000 | fuzz_offset(p, cells + 4, 9), p++;              /* STI R0, TMR */
+    }
+    if (fuzz_random(&s, 2)) {       /* RTI to the next word in user mode */
+        image[p] = 0x2000 | fuzz_offset(p, cells + 5, 9), p++;              /* LD R0, PSR */
+        image[p] = 0x1DBF, p++;                                             /* ADD R6, R6, #-1 */
+        image[p] = 0x7180, p++;                                             /* STR R0, R6, #0 */
+        image[p] = 0xE000 | fuzz_offset(p, p + 4, 9), p++;                  /* LEA R0, body */
+        image[p] = 0x1DBF, p++;
+        image[p] = 0x7180, p++;
+        image[p] = 0x8000, p++;                                             /* RTI */
+    }
+    for (i = FUZZ_BASE; i < p; i++)
+        entry[i - FUZZ_BASE] = FALSE;
+
+    /* Body */
+    while (p < FUZZ_BASE + n - 1) {
+        k = (int)fuzz_random(&s, 100);
+        r = (int)fuzz_random(&s, 6);
+        base = (int)fuzz_random(&s, 6);
+        if (k < 12) {               /* LEA + LDR/STR */
+            image[p] = 0xE000 | (base << 9) | fuzz_offset(p, data + (int)fuzz_random(&s, 32), 9);
+            image[p + 1] = (fuzz_random(&s, 2) ? 0x6000 : 0x7000) | (r << 9) | (base << 6)
+                           | fuzz_random(&s, 16);
+            entry[p + 1 - FUZZ_BASE] = FALSE;
+            p += 2;
+            continue;
+        }
+        if (k < 15) {               /* LEA + JSRR/JMP */
+            image[p] = 0xE000 | (base << 9) | fuzz_offset(p, subs[fuzz_random(&s, 4)], 9);
+            image[p + 1] = (fuzz_random(&s, 5) < 3 ? 0x4000 : 0xC000) | (base << 6);
+            entry[p + 1 - FUZZ_BASE] = FALSE;
+            p += 2;
+            continue;
+        }
+        if (k < 17) {               /* countdown loop, fused and fast-forwarded */
+            image[p] = 0x1020 | (r << 9) | (r << 6) | (0x1F & -(1 + (int)fuzz_random(&s, 3)));
+            image[p + 1] = 0x0200 | fuzz_offset(p + 1, p, 9);               /* BRp back */
+            entry[p + 1 - FUZZ_BASE] = FALSE;
+            p += 2;
+            continue;
+        }
+        if (k < 35) {               /* ADD / AND */
+            word = (fuzz_random(&s, 2) ? 0x1000 : 0x5000) | (r << 9) | (fuzz_random(&s, 8) << 6);
+            word |= fuzz_random(&s, 5) < 3 ? 0x20 | fuzz_random(&s, 32) : fuzz_random(&s, 8);
+        }
+        else if (k < 40)            /* NOT */
+            word = 0x903F | (r << 9) | (fuzz_random(&s, 8) << 6);
+        else if (k < 45)            /* LEA */
+            word = 0xE000 | (r << 9) | fuzz_random(&s, 512);
+        else if (k < 55) {          /* LD data, pointer or code */
+            target = fuzz_random(&s, 3) == 0 ? FUZZ_BASE + (int)fuzz_random(&s, n)
+                                             : data + (int)fuzz_random(&s, 56);
+            word = 0x2000 | (r << 9) | fuzz_offset(p, target, 9);
+        }
+        else if (k < 62)            /* ST */
+            word = 0x3000 | (fuzz_random(&s, 8) << 9) | fuzz_offset(p, data + (int)fuzz_random(&s, 48), 9);
+        else if (k < 67)            /* LDI */
+            word = 0xA000 | (r << 9) | fuzz_offset(p, ptrs + (int)fuzz_random(&s, 8), 9);
+        else if (k < 71)            /* STI */
+            word = 0xB000 | (fuzz_random(&s, 8) << 9) | fuzz_offset(p, ptrs + (int)fuzz_random(&s, 8), 9);
+        else if (k < 86)            /* BR anywhere in the code */
+            word = (fuzz_random(&s, 8) << 9) | fuzz_offset(p, FUZZ_BASE + (int)fuzz_random(&s, n), 9);
+        else if (k < 90)            /* JSR */
+            word = 0x4800 | fuzz_offset(p, subs[fuzz_random(&s, 4)], 11);
+        else if (k < 92)            /* RET */
+            word = 0xC1C0;
+        else if (k < 94)            /* OUT */
+            word = 0xF021;
+        else if (k < 95)            /* ST over the code */
+            word = 0x3000 | (fuzz_random(&s, 8) << 9) | fuzz_offset(p, FUZZ_BASE + (int)fuzz_random(&s, n), 9);
+        else if (k < 96)            /* RTI */
+            word = 0x8000;
+        else if (k < 97)            /* illegal opcode */
+            word = 0xD000 | fuzz_random(&s, 4096);
+        else                        /* BR never */
+            word = fuzz_random(&s, 512);
+        image[p++] = word;
+    }
+    image[p] = 0xF025;              /* HALT */
+
+    /* Move branches that land on the second word of a pair */
+    for (p = FUZZ_BASE; p < FUZZ_BASE + n; p++) {
+        word = image[p];
+        if ((word & 0xF000) != 0 || (word & 0x0E00) == 0)
+            continue;
+        target = p + 1 + (short)(word << 7) / 128;
+        if (target >= FUZZ_BASE && target < FUZZ_BASE + n && !entry[target - FUZZ_BASE])
+            image[p] = (word & 0xFE00) | fuzz_offset(p, target - 1, 9);
+    }
 
-    int Addr = Low16bits((CURRENT_LATCHES.PC + SEXT(PCoffset9, 9)));
-    CURRENT_LATCHES.REGS[DR] = Low16bits(MEMORY[MEMORY[Addr]]);
+    /* Handler for the timer and both exceptions: acknowledge, return */
+    image[handler] = 0x3000 | fuzz_offset(handler, handler + 4, 9);         /* ST R0, save */
+    image[handler + 1] = 0xA000 | fuzz_offset(handler + 1, cells + 4, 9);   /* LDI R0, TMR */
+    image[handler + 2] = 0x2000 | fuzz_offset(handler + 2, handler + 4, 9); /* LD R0, save */
+    image[handler + 3] = 0x8000;                                            /* RTI */
+    image[IVT_BASE + VECTOR_PRIVILEGE] = handler;
+    image[IVT_BASE + VECTOR_ILLEGAL] = handler;
+    image[IVT_BASE + VECTOR_TIMER] = handler;
+
+    for (i = 0; i < 48; i++)
+        image[data + i] = fuzz_random(&s, 0x10000);
+    for (i = 0; i < 8; i++)
+        image[ptrs + i] = data + fuzz_random(&s, 48);
+    if (fuzz_random(&s, 4) == 0)
+        image[ptrs + fuzz_random(&s, 8)] = IO_TMR;
+}
 
-    SetCC(CURRENT_LATCHES.REGS[DR]);
-    return 0;
+void fuzz_load(Machine *M, const uint16_t *image) {
+    initialize(M, NULL, 0, FALSE);
+    memcpy(M->MEMORY, image, sizeof(M->MEMORY));
+    M->CURRENT_LATCHES.PC = FUZZ_BASE;
+    M->NEXT_LATCHES = M->CURRENT_LATCHES;
+    M->CONSOLE.LENGTH = 0;
+    M->CONSOLE.WRITTEN = 0;
 }
 
-int LDR(int Inst){
-    int DR = (Inst & 0x0E00) >> 9;
-    int BaseR = (Inst & 0x01C0) >> 6;
-    int PCoffset6 = Inst & 0x003F;
+int fuzz_differ(Machine *A, Machine *B, int report) {
+    /* Compare everything the program can see; print what differs if report */
+    const System_Latches *L = &A->CURRENT_LATCHES, *K = &B->CURRENT_LATCHES;
+    const char *name_a = ENGINE_NAMES[A->ENGINE], *name_b = ENGINE_NAMES[B->ENGINE];
+    int differ = FALSE, shown = 0, k, addr;
+    char label[24];
+
+#define FUZZ_FIELD(label, a, b) \
+    if ((a) != (b)) { \
+        differ = TRUE; \
+        if (report) \
+            printf("  %-18s %s 0x%.4x, %s 0x%.4x\n", label, name_a, (unsigned)(a), name_b, (unsigned)(b)); \
+    }
 
-    int Addr = Low16bits((CURRENT_LATCHES.REGS[BaseR] + SEXT(PCoffset6, 6)));
-    CURRENT_LATCHES.REGS[DR] = Low16bits(MEMORY[Addr]);
+    FUZZ_FIELD("PC", L->PC, K->PC);
+    FUZZ_FIELD("PSR", GetPSR(A), GetPSR(B));
+    for (k = 0; k < LC_3_REGS; k++) {
+        sprintf(label, "R%d", k);
+        FUZZ_FIELD(label, L->REGS[k], K->REGS[k]);
+    }
+    FUZZ_FIELD("saved SSP", L->SAVED_SSP, K->SAVED_SSP);
+    FUZZ_FIELD("saved USP", L->SAVED_USP, K->SAVED_USP);
+    FUZZ_FIELD("instruction count", A->INSTRUCTION_COUNT, B->INSTRUCTION_COUNT);
+    FUZZ_FIELD("R7 save stack", A->RETURNS.DEPTH, B->RETURNS.DEPTH);
+    for (k = 0; k < A->RETURNS.DEPTH && k < B->RETURNS.DEPTH; k++) {
+        sprintf(label, "stack[%d]", k);
+        FUZZ_FIELD(label, A->RETURNS.ENTRY[k] & 0xFFFF, B->RETURNS.ENTRY[k] & 0xFFFF);
+    }
+    FUZZ_FIELD("output bytes", A->CONSOLE.WRITTEN, B->CONSOLE.WRITTEN);
+    FUZZ_FIELD("TMR", (A->TIMER.EXPIRED << 15) | (A->TIMER.ENABLE << 14),
+               (B->TIMER.EXPIRED << 15) | (B->TIMER.ENABLE << 14));
+    if (memcmp(A->MEMORY, B->MEMORY, sizeof(A->MEMORY)) != 0) {
+        differ = TRUE;
+        for (addr = 0; addr < WORDS_IN_MEM && report; addr++)
+            if (A->MEMORY[addr] != B->MEMORY[addr] && shown++ < 8)
+                printf("  MEMORY[0x%.4x]     %s 0x%.4x, %s 0x%.4x\n", addr,
+                       name_a, A->MEMORY[addr], name_b, B->MEMORY[addr]);
+        if (shown > 8)
+            printf("  ... %d more words\n", shown - 8);
+    }
+#undef FUZZ_FIELD
+    return differ;
+}
 
-    SetCC(CURRENT_LATCHES.REGS[DR]);
-    return 0;
+long long fuzz_run(Machine *A, Machine *B, const uint16_t *image, long long budget) {
+    /* The first checkpoint at which A and B differ, or -1 */
+    long long done = 0, step, a, b;
+
+    fuzz_load(A, image);
+    fuzz_load(B, image);
+    while (done < budget) {
+        step = budget - done < FUZZ_CHECKPOINT ? budget - done : FUZZ_CHECKPOINT;
+        a = execute(A, step);
+        b = execute(B, step);
+        done += step;
+        if (a != b || fuzz_differ(A, B, FALSE))
+            return done;
+        if (a < step)           /* both halted */
+            break;
+    }
+    return -1;
 }
 
+long long fuzz_first(Machine *A, Machine *B, const uint16_t *image, long long bad) {
+    /* Bisect down to the first instruction count at which A and B differ */
+    long long good = bad - FUZZ_CHECKPOINT > 0 ? bad - FUZZ_CHECKPOINT : 0, middle;
+
+    while (bad - good > 1) {
+        middle = good + (bad - good) / 2;
+        fuzz_load(A, image);
+        fuzz_load(B, image);
+        execute(A, middle);
+        execute(B, middle);
+        if (fuzz_differ(A, B, FALSE))
+            bad = middle;
+        else
+            good = middle;
+    }
+    return bad;
+}
 
-int LEA(int Inst){
-    int DR = (Inst & 0x0E00) >> 9;
-    int PCoffset9 = Inst & 0x01FF;
-    CURRENT_LATCHES.REGS[DR] = Low16bits(CURRENT_LATCHES.PC + SEXT(PCoffset9, 9));
-    return 0;
+int fuzz_shrink(Machine *A, Machine *B, uint16_t *image, long long budget) {
+    /* Zero runs of words, halving their length, while A and B still differ */
+    uint16_t saved[32];
+    int size, addr, k, empty, changed, words = 0;
+
+    for (size = 32; size >= 1; size /= 2) {
+        do {
+            changed = FALSE;
+            for (addr = 0; addr + size <= WORDS_IN_MEM; addr += size) {
+                for (k = 0, empty = TRUE; k < size; k++)
+                    empty = empty && image[addr + k] == 0;
+                if (empty)
+                    continue;
+                memcpy(saved, &image[addr], size * sizeof(uint16_t));
+                memset(&image[addr], 0, size * sizeof(uint16_t));
+                if (fuzz_run(A, B, image, budget) >= 0)
+                    changed = TRUE;
+                else
+                    memcpy(&image[addr], saved, size * sizeof(uint16_t));
+            }
+        } while (changed);
+    }
+    for (addr = 0; addr < WORDS_IN_MEM; addr++)
+        words += image[addr] != 0;
+    return words;
 }
 
-int NOT(int Inst){
-    int DR = (Inst & 0x0E00) >> 9;
-    int SR = (Inst & 0x01C0) >> 6;
-    CURRENT_LATCHES.REGS[DR] = Low16bits(~ CURRENT_LATCHES.REGS[SR]);
+int fuzz_write(const uint16_t *image, const char *filename, int low, int high) {
+    /* The nonzero words of image[low..high] as a program file; FALSE if none */
+    FILE *file;
+    int first = -1, last = -1, addr;
 
-    SetCC(CURRENT_LATCHES.REGS[DR]);
-    return 0;
+    for (addr = low; addr <= high; addr++)
+        if (image[addr] != 0) {
+            if (first < 0)
+                first = addr;
+            last = addr;
+        }
+    if (first < 0)
+        return FALSE;
+    if (low == FUZZ_BASE)       /* the program starts at its origin */
+        first = FUZZ_BASE;
+    if ((file = fopen(filename, "w")) == NULL) {
+        printf("Error: Can't create %s\n", filename);
+        return FALSE;
+    }
+    fprintf(file, "x%.4X\n", first);
+    for (addr = first; addr <= last; addr++)
+        fprintf(file, "x%.4X\n", image[addr]);
+    fclose(file);
+    return TRUE;
 }
 
-int ST(int Inst){
-    int SR = (Inst & 0x0E00) >> 9;
-    int PCoffset9 = Inst & 0x01FF;
-
-    int Addr = Low16bits((CURRENT_LATCHES.PC + SEXT(PCoffset9, 9)));
-    MEMORY[Addr] = Low16bits(CURRENT_LATCHES.REGS[SR]);
+int fuzz(int count, unsigned long long seed, int engine, int fast_forward, long long budget) {
+    uint16_t *image = malloc(WORDS_IN_MEM * sizeof(uint16_t));
+    Machine *A = create_machine(ENGINE_SWITCH), *B = create_machine(engine);
+    char program[64], vectors[64];
+    long long bad = -1, executed = 0;
+    double start = seconds();
+    int i, words, tested[ENGINE_COUNT], engines = 0, e;
+
+    assert(image != NULL);
+    if (budget == LLONG_MAX)
+        budget = FUZZ_BUDGET;
+    if (engine == ENGINE_SWITCH)    /* test every other engine */
+        for (e = 1; e < ENGINE_COUNT; e++)
+            tested[engines++] = e;
+    else
+        tested[engines++] = engine;
+    A->QUIET = B->QUIET = TRUE;
+    A->CONSOLE.OUTPUT = B->CONSOLE.OUTPUT = NULL;
+    A->CONSOLE.INPUT = B->CONSOLE.INPUT = NULL;
+    B->FAST_FORWARD = fast_forward;
+
+    for (i = 0; i < count && bad < 0; i++) {
+        fuzz_generate(image, seed + i);
+        for (e = 0; e < engines && bad < 0; e++) {
+            B->ENGINE = tested[e];
+            bad = fuzz_run(A, B, image, budget);
+            executed += A->INSTRUCTION_COUNT;
+        }
+    }
+    if (bad < 0) {
+        printf("Fuzzed %d programs, %lld instructions on each engine in %.2f s: no divergence\n",
+               count, executed / engines, seconds() - start);
+        lc3_destroy(A);
+        lc3_destroy(B);
+        free(image);
+        return 0;
+    }
 
-    return 0;
+    seed += i - 1;
+    printf("Program %llu: the %s engine diverges from switch within %lld instructions\n",
+           seed, ENGINE_NAMES[B->ENGINE], bad);
+    words = fuzz_shrink(A, B, image, bad);
+    bad = fuzz_run(A, B, image, bad);
+    bad = fuzz_first(A, B, image, bad);
+    fuzz_load(A, image);
+    fuzz_load(B, image);
+    execute(A, bad);
+    execute(B, bad);
+    printf("Shrunk to %d words, first different after %lld instructions:\n", words, bad);
+    fuzz_differ(A, B, TRUE);
+
+    sprintf(program, "fuzz-%llu.hex", seed);
+    sprintf(vectors, "fuzz-%llu-ivt.hex", seed);
+    if (fuzz_write(image, program, FUZZ_BASE, IO_PAGE - 1)) {
+        printf("Reproduce with: --engine=%s%s --exec=\"run %lld; rdump\" %s", ENGINE_NAMES[B->ENGINE],
+               fast_forward ? " --fast-forward" : "", bad, program);
+        if (fuzz_write(image, vectors, IVT_BASE, IVT_BASE + 0xFF))
+            printf(" %s", vectors);
+        printf("\n");
+    }
+    lc3_destroy(A);
+    lc3_destroy(B);
+    free(image);
+    return 1;
 }
 
-int STI(int Inst){
-    int SR = (Inst & 0x0E00) >> 9;
-    int PCoffset9 = Inst & 0x01FF;
+/***************************************************************/
+/*                                                             */
+/* Procedure : main                                            */
+/*                                                             */
+/***************************************************************/
+int main(int argc, char *argv[]) {
+    Dump *dump;
+    Machine *M;
+    char *batch_list = NULL, *serve_path = NULL, *restore_file = NULL, *dump_filename = "dumpsim";
+    char *commands = NULL, *script_filename = NULL, *timing_spec = NULL;
+    int first = 1, engine = ENGINE_SWITCH, workers = (int)sysconf(_SC_NPROCESSORS_ONLN), lanes = 1;
+    long long budget = LLONG_MAX;
+    int quiet = FALSE, profiling = FALSE, status, dump_default = DUMP_TEXT, repeats = 0;
+    int fast_forward = FALSE, fuzz_count = 0, return_stack = TRUE;
+    unsigned long long seed = 1;
+    char *input_filename = NULL;
+
+    /* Options */
+    for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+        if (strcmp(argv[first], "--engine=switch") == 0)
+            engine = ENGINE_SWITCH;
+        else if (strcmp(argv[first], "--engine=threaded") == 0)
+            engine = ENGINE_THREADED;
+        else if (strcmp(argv[first], "--engine=jit") == 0)
+            engine = ENGINE_JIT;
+        else if (strncmp(argv[first], "--batch=", 8) == 0)
+            batch_list = argv[first] + 8;
+        else if (strncmp(argv[first], "--serve=", 8) == 0)
+            serve_path = argv[first] + 8;
+        else if (strncmp(argv[first], "--jobs=", 7) == 0)
+            workers = atoi(argv[first] + 7);
+        else if (strncmp(argv[first], "--lanes=", 8) == 0)
+            lanes = atoi(argv[first] + 8);
+        else if (strncmp(argv[first], "--budget=", 9) == 0)
+            budget = atoll(argv[first] + 9);
+        else if (strncmp(argv[first], "--restore=", 10) == 0)
+            restore_file = argv[first] + 10;
+        else if (strncmp(argv[first], "--exec=", 7) == 0)
+            commands = argv[first] + 7;
+        else if (strncmp(argv[first], "--script=", 9) == 0)
+            script_filename = argv[first] + 9;
+        else if (strncmp(argv[first], "--dump=", 7) == 0)
+            dump_filename = argv[first] + 7;
+        else if (strncmp(argv[first], "--dump-format=", 14) == 0
+                 && (dump_default = dump_format(argv[first] + 14)) >= 0)
+            ;
+        else if (strcmp(argv[first], "--quiet") == 0)
+            quiet = TRUE;
+        else if (strcmp(argv[first], "--profile") == 0)
+            profiling = TRUE;
+        else if (strcmp(argv[first], "--timing") == 0)
+            timing_spec = "";
+        else if (strncmp(argv[first], "--timing=", 9) == 0)
+            timing_spec = argv[first] + 9;
+        else if (strncmp(argv[first], "--input=", 8) == 0)
+            input_filename = argv[first] + 8;
+        else if (strcmp(argv[first], "--fast-forward") == 0)
+            fast_forward = TRUE;
+        else if (strcmp(argv[first], "--return-stack=on") == 0)
+            return_stack = TRUE;
+        else if (strcmp(argv[first], "--return-stack=off") == 0)
+            return_stack = FALSE;
+        else if (strcmp(argv[first], "--bench") == 0)
+            repeats = 5;
+        else if (strncmp(argv[first], "--bench=", 8) == 0 && (repeats = atoi(argv[first] + 8)) > 0)
+            ;
+        else if (strcmp(argv[first], "--fuzz") == 0)
+            fuzz_count = 1000;
+        else if (strncmp(argv[first], "--fuzz=", 7) == 0 && (fuzz_count = atoi(argv[first] + 7)) > 0)
+            ;
+        else if (strncmp(argv[first], "--seed=", 7) == 0)
+            seed = strtoull(argv[first] + 7, NULL, 0);
+        else {
+            printf("Error: unknown option %s\n", argv[first]);
+            exit(1);
+        }
+    }
+    if (workers < 1)
+        workers = 1;
 
-    int Addr = Low16bits((CURRENT_LATCHES.PC + SEXT(PCoffset9, 9)));
-    MEMORY[MEMORY[Addr]] = Low16bits(CURRENT_LATCHES.REGS[SR]);
+    if (batch_list != NULL)
+        return batch(batch_list, input_filename, workers, lanes, engine, budget);
+    if (serve_path != NULL)
+        return serve(serve_path, workers, engine, budget);
+    if (fuzz_count > 0)
+        return fuzz(fuzz_count, seed, engine, fast_forward, budget);
 
-    return 0;
-}
+    /* Error Checking */
+    if (argc - first < 1 && restore_file == NULL) {
+        printf("Error: usage: %s [--engine=switch|threaded|jit] [--restore=<snapshot>] "
+               "[--exec=<commands>] [--script=<file>] [--dump=<file>|none] "
+               "[--dump-format=text|csv|json|binary] [--quiet] [--profile] [--timing[=<spec>]] "
+               "[--fast-forward] [--return-stack=on|off] [--input=<file>] "
+               "<program_file_1> <program_file_2> ...\n", argv[0]);
+        printf("       %s [--engine=...] [--jobs=n] [--lanes=n] [--budget=n] --batch=<list_file>\n",
+               argv[0]);
+        printf("       %s [--engine=...] [--jobs=n] [--budget=n] --serve=<socket>\n", argv[0]);
+        printf("       %s [--engine=...] --bench[=runs] <program_file_1> ...\n", argv[0]);
+        printf("       %s [--engine=...] [--fast-forward] [--budget=n] [--seed=n] --fuzz[=programs]\n",
+               argv[0]);
+        exit(1);
+    }
+    if (repeats > 0)
+        return bench(argv + first, argc - first, input_filename, engine, fast_forward, repeats);
+
+    M = create_machine(engine);
+    M->QUIET = quiet;
+    M->RETURNS.ENABLE = return_stack;
+    M->FAST_FORWARD = fast_forward;
+    if (input_filename != NULL && lc3_open_input(M, input_filename) < 0)
+        exit(-1);
+    if (profiling) {
+        M->PROFILE = calloc(1, sizeof(Profile));
+        assert(M->PROFILE != NULL);
+    }
+    if (timing_spec != NULL && !timing_start(M, timing_spec))
+        exit(1);
+    message(M, "LC-3 Simulator\n\n");
 
-int STR(int Inst){
-    int SR = (Inst & 0x0E00) >> 9;
-    int BaseR = (Inst & 0x01C0) >> 6;
-    int PCoffset6 = Inst & 0x003F;
+    if (!initialize(M, argv + first, argc - first, !quiet))
+        exit(-1);
+    if (restore_file != NULL && !restore(M, restore_file))
+        exit(-1);
 
-    int Addr = Low16bits((CURRENT_LATCHES.REGS[BaseR] + SEXT(PCoffset6, 6)));
-    MEMORY[Addr] = Low16bits(CURRENT_LATCHES.REGS[SR]);
+    dump = calloc(1, sizeof(Dump));
+    assert(dump != NULL);
+    dump->SCREEN = !quiet;
+    dump->FORMAT = dump_default;
+    if (strcmp(dump_filename, "none") == 0)
+        dump->OUTPUT = NULL;
+    else if ( (dump->OUTPUT = fopen( dump_filename, "w" )) == NULL ) {
+        printf("Error: Can't open dump file %s\n", dump_filename);
+        exit(-1);
+    }
 
-    return 0;
-}
+    if (commands != NULL || script_filename != NULL)
+        status = script(M, dump, commands, script_filename);
+    else {
+        while (get_command(M, dump, stdin) != COMMAND_QUIT)
+            ;
+        status = 0;
+    }
 
-int TRAP(){
-    CURRENT_LATCHES.PC = 0x0000;    /* Halt */
-    return 0;
+    if (dump->OUTPUT != NULL)
+        fclose(dump->OUTPUT);
+    free(dump);
+    lc3_destroy(M);
+    return status;
 }
-
@@ -0,0 +1,118 @@
+/*
+ * serve_check.c: checks of simulate --serve (make check).
+ *
+ * Starts ./simulate --serve on a socket of its own, sends it requests
+ * and checks the replies. Exits 0 if every check passes, else 1.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRUE  1
+#define FALSE 0
+
+/* Prints 'A' forever: LD R0, CHAR; OUT; BR back to the OUT */
+static const char LOOP_OUT[] = "3000\n2002\nF021\n0FFE\n0041\n";
+
+static char *Socket_Path;
+static pid_t Server;
+
+void stop_server(void) {
+    if (Server > 0) {
+        kill(Server, SIGTERM);
+        waitpid(Server, NULL, 0);
+    }
+    unlink(Socket_Path);
+}
+
+int connect_server(void) {
+    /* The server listens once it has started: try for a few seconds */
+    struct sockaddr_un address;
+    struct timespec pause = {0, 50000000};
+    int fd, tries;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, Socket_Path);
+    for (tries = 0; tries < 100; tries++) {
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+            return -1;
+        if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0)
+            return fd;
+        close(fd);
+        nanosleep(&pause, NULL);
+    }
+    return -1;
+}
+
+char *request(int fd, const char *image, long long budget) {
+    /* Send one run hex request, return its reply line (malloc'd) or NULL */
+    FILE *in = fdopen(dup(fd), "r");
+    char header[64], *line = NULL;
+    size_t size = 0;
+
+    snprintf(header, sizeof(header), "run hex %zu 0 %lld\n", strlen(image), budget);
+    if (in == NULL || write(fd, header, strlen(header)) < 0
+        || write(fd, image, strlen(image)) < 0 || getline(&line, &size, in) < 0) {
+        free(line);
+        line = NULL;
+    }
+    if (in != NULL)
+        fclose(in);
+    return line;
+}
+
+int check(const char *name, int ok) {
+    printf("%-40s %s\n", name, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    char path[64], option[80], *reply;
+    int fd, ok = TRUE;
+
+    if (argc != 2) {
+        printf("Usage: %s <simulate>\n", argv[0]);
+        return 1;
+    }
+    snprintf(path, sizeof(path), "/tmp/serve_check.%d.sock", (int)getpid());
+    Socket_Path = path;
+    snprintf(option, sizeof(option), "--serve=%s", path);
+    if ((Server = fork()) == 0) {
+        freopen("/dev/null", "w", stdout);
+        execl(argv[1], argv[1], option, "--jobs=1", (char *)NULL);
+        _exit(127);
+    }
+    if (Server < 0 || (fd = connect_server()) < 0) {
+        printf("Error: Can't start %s %s\n", argv[1], option);
+        stop_server();
+        return 1;
+    }
+
+    /* Output past SERVE_OUTPUT (1MB) is dropped and the reply says so */
+    reply = request(fd, LOOP_OUT, 3000000);
+    ok &= check("output over 1MB: status budget",
+                reply != NULL && strstr(reply, "\"status\": \"budget\"") != NULL);
+    ok &= check("output over 1MB: truncated",
+                reply != NULL && strstr(reply, "\"truncated\": true") != NULL);
+    ok &= check("output over 1MB: no NUL at the end",
+                reply != NULL && strstr(reply, "\\u0000") == NULL);
+    free(reply);
+
+    /* Output that fits is returned whole */
+    reply = request(fd, LOOP_OUT, 30);
+    ok &= check("short output: not truncated",
+                reply != NULL && strstr(reply, "\"truncated\": false") != NULL);
+    free(reply);
+
+    close(fd);
+    stop_server();
+    return ok ? 0 : 1;
+}